@@ -3,14 +3,193 @@
  * This file implements a table of builtin commands.
  */
 
+#define _GNU_SOURCE
 #include "thsh.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+
+// Output written to a terminal or file is flushed in blocks of this size
+#define OUTBUF_BLOCK 65536
 
 struct builtin {
     const char * cmd;
-    int (*func)(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory);
+    int (*func)(char **args, int stdin, outbuf *out, history *myhistory);
+    bool pure;  // Leaves the shell as it was, see is_builtin()
+    bool streams; // Runs long, writing as it goes, see builtin_streams()
 };
 
+/* Write all of data to fd, retrying short writes.
+ * Errors (such as EPIPE, if the reader is gone) end the write early.
+ */
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += rv;
+        len -= rv;
+    }
+}
+
+/* Set up the output buffer of a builtin that writes to fd.
+ *
+ * If fd is a pipe of the pipeline (anything but the shell's own
+ * standard out), the whole output is captured, so that the shell never
+ * blocks on a reader that has not caught up; see flush_output().
+ */
+void init_output(outbuf *out, int fd) {
+    struct stat sb;
+    out->fd = fd;
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+    out->status = 0;
+    out->capture = fd != 1 && fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode);
+}
+
+/* Append len bytes of data to a builtin's output.
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+int out_write(outbuf *out, const void *data, size_t len) {
+    if (!out->capture && out->len + len > OUTBUF_BLOCK) {
+        write_all(out->fd, out->data, out->len);
+        out->len = 0;
+        if (len > OUTBUF_BLOCK) {
+            write_all(out->fd, data, len);
+            return 0;
+        }
+    }
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        while (cap < out->len + len) {
+            cap *= 2;
+        }
+        char *tmp = realloc(out->data, cap);
+        if (tmp == NULL) {
+            return -ENOMEM;
+        }
+        out->data = tmp;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+/* printf() into a builtin's output.
+ *
+ * Returns the number of bytes formatted, or a negative value on error.
+ */
+int out_printf(outbuf *out, const char *fmt, ...) {
+    char small[256];
+    char *str = small;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return len;
+    }
+    if ((size_t) len >= sizeof(small)) {
+        va_start(ap, fmt);
+        len = vasprintf(&str, fmt, ap);
+        va_end(ap);
+        if (len < 0) {
+            return -ENOMEM;
+        }
+    }
+    out_write(out, str, len);
+    if (str != small) {
+        free(str);
+    }
+    return len;
+}
+
+/* Write out what a builtin has buffered so far, for one that produces
+ * output over a long time (see handle_parallel()).
+ *
+ * Output to a terminal or file is written whole.  Captured output only
+ * goes into the room its pipe has right now, with a write that cannot
+ * block; the rest stays buffered, for a later call or flush_output().
+ */
+void drain_output(outbuf *out) {
+    int flags;
+    ssize_t rv;
+
+    if (out->len == 0 || out->fd < 0) {
+        return;
+    }
+    if (!out->capture) {
+        write_all(out->fd, out->data, out->len);
+        out->len = 0;
+        return;
+    }
+    flags = fcntl(out->fd, F_GETFL);
+    if (flags < 0 || fcntl(out->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return;
+    }
+    do {
+        rv = write(out->fd, out->data, out->len);
+    } while (rv < 0 && errno == EINTR);
+    fcntl(out->fd, F_SETFL, flags);
+    if (rv > 0) {
+        memmove(out->data, out->data + rv, out->len - rv);
+        out->len -= rv;
+    }
+}
+
+/* Hand a builtin's output to its file descriptor and free the buffer.
+ *
+ * Captured output that fits in the (empty) pipe is written right away,
+ * since that cannot block.  Anything larger is written by a forked
+ * child, so the shell does not wait on the reader; the child exits
+ * with the builtin's status.
+ *
+ * Returns the pid of that child, 0 if none was needed, or -errno.
+ */
+int flush_output(outbuf *out) {
+    int pid = 0;
+
+    if (out->capture && out->len > 0) {
+        int capacity = fcntl(out->fd, F_GETPIPE_SZ);
+        if (capacity < 0 || out->len > (size_t) capacity) {
+            pid = fork();
+            if (pid == 0) {
+                // Drop every other descriptor, in particular the read
+                // end of this very pipe, so a reader that quits early
+                // is seen as EPIPE rather than blocking us forever
+                signal(SIGPIPE, SIG_DFL);
+                dup2(out->fd, 1);
+                close_range(3, ~0U, 0);
+                write_all(1, out->data, out->len);
+                _exit(out->status);
+            }
+            if (pid < 0) {
+                pid = -errno;
+            }
+        }
+    }
+    if (pid <= 0) {
+        write_all(out->fd, out->data, out->len);
+    }
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = 0;
+    return pid;
+}
+
 
 static char old_path[MAX_INPUT];
 static char cur_path[MAX_INPUT];
@@ -22,14 +201,19 @@ static char cur_path[MAX_INPUT];
  * Returns zero on success, -errno on failure.
  */
 int init_cwd(void) {
-
-    // Lab 2: Your code here
-
+    if (getcwd(cur_path, sizeof(cur_path)) == NULL) {
+        return -errno;
+    }
     return 0;
 }
 
+/* Returns the current working directory, as tracked by cd. */
+const char *current_dir(void) {
+    return cur_path;
+}
+
 /* Handle a cd command.  */
-int handle_cd(char *args[MAX_INPUT], int stdin, int stdout, history *myhistory) {
+int handle_cd(char *args[MAX_INPUT], int stdin, outbuf *out, history *myhistory) {
     if (strcmp(args[1], "..") == 0) {
         // Case: ".."
         getcwd(cur_path, sizeof(cur_path));
@@ -73,7 +257,7 @@ int handle_cd(char *args[MAX_INPUT], int stdin, int stdout, history *myhistory)
 }
 
 /* Handle an exit command. */
-int handle_exit(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory) {
+int handle_exit(char **args, int stdin, outbuf *out, history *myhistory) {
     // Save the history before exiting 
 //    remove("thsh_history.txt");
 //    save_history(myhistory);
@@ -82,151 +266,795 @@ int handle_exit(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory)
     return 0; // Does not actually return
 }
 
-int handle_goheels(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory) {
-    printf("YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY55Y55\n");
-printf("YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY\n");
-printf("YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY\n");
-printf("YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY5555555YYYYYY55555555555555555555YYYYYYYYYYYYYYYYYYYYYYYYYYYY5YYYY55555555555YYYYYYYYYYYYYYYYYYYYY\n");
-printf("YYYYYYYYYYYYYYYYYYYYYYYYYYYJJ?77!!!!!!!!!77?JJYYYYYYYYYYYYYYYYYYYYYYYY55YY55555555PPPPPP55PPPGGGGPPPGGGBGBGGGPPPP55Y55PPP5YYYYYYYY5YYYYY5555YYYYJJJJJJJJYYY5555YYYYYYYYYYYYYYY5\n");
-printf("YYYYYYYYYYYYYYYYYYYYYYYJ7!~^^::::::::::::::::^^~!7JYY5YYYYY5555Y5555555555555PPGGGGGBBBBGGBBBBBGBBBBBBGBBBBBGGGGGGGGGGPGG555YYYY5YY555YYJ?7!!~~^^^^^^^^^^^~!7?JYY55YYYYYYYYYYYY\n");
-printf("YYYYYYYYYYYYYYYYYYYY?!~^::::::::::::::::::::::::::^^~7JY555555555PPGGGGGGGGGGGGGBBGBBBBBBBBBBBBBBBBB#BBBBBBBBBBGGGB##BGGGP55555555YJ?7!~^^:::::::::::::::::::::^~7J55YYYYYYYYYY\n");
-printf("YYYYYYYYYYYYYYYYYY7~^:::::::::::::::::::::::::::::::::^~7J5PPPGGGGGGGGGGGGBBBGGBBBBBBBBBBBGGGBBBBBBBBBBBBBBBB#BBBBB###BGGGPPP555J7~^^:::::::::::::^^^^^^::::::::::^!JY5YYYYYYYY\n");
-printf("YYYYYYYYYYYYYYYY?~^::::::::::^^^^^^^^^^^^^^::::::::::::::^!JPGGGGGGGGGGGGGBBBBBBBBBBBGGGGBBGGGGBBBGGBBBBBBBBBBBBBBBBB###BBBBG5?~^^:::::::::::^^^^^^^^^^^^^^^:::::::::~J5YYYYYYY\n");
-printf("YYYYYYYYYYYYYYY!^:::::::::^^^~~~~~~~~~~~~^^^^^^::::::::::::^!JPGGGGGGGGGGBBBBBBBBGGGGGGGGGBBBBBBBBBBBGBBBBBBBBBBBBB#BBBBB#B57^^:::::::::::^^^^^^^^~~~~~~^^^^^^::::::::^7Y5YYYYY\n");
-printf("YYYYYYYYYYYYYY!^::::::::^^~~!??JJJJJJJJ?7!!~~^^^^^::::::::::^^75BBGGGGGBBBBBBBBBBGBGGGGGGGGGGGGGGBGGGGGGGGGGGGGGGBBBBBBBB57^^:::::::::::^^^^~~~!!!777??77!!~~^^^::::::::!YYYYYY\n");
-printf("YYYYYYYYYYYYY!^:::::::^^^!?JYYYYYYYYY555YYJ?7!~~^^^^::::::::^^!?5GGGGGBBBBBBBBBBGGGGGGGGGGGGGBBBBGGGGGPPPPPGGGGGGGGGGGBG?~^^::::::::::^^^^~~!7?JYY5555555YYJ?!~^^::::::::75YYYY\n");
-printf("YYYYYYYYYYYY7^^::::::^^~7Y5YYYYYYYYYYYYYY5555Y?!~~^^^^::::::^~!7YGBGGGGGBBBBBGGGGPPP5PPPPPGGGGGBBBGGGPPPPGGGGGGGGBGGGBB?^^^:::::::::^^^~~!?JY5555555555555555Y7~^^:::::::^J5YYY\n");
-printf("YYYYYYYYYYYY!^^::::::^~?5YYYYYYYYYYY5555555Y55PPJ!~~^^^^:::^~~!?5GGGGGPGGGGPPP5555YYY55555PPGGGGGGGPP5P55555PPPGGBBBBGJ!^^::::::::^^^~~7J5555555555555555555555?~^^::::::^?55YY\n");
-printf("YYYYYYYYYYYJ~^::::::^^!YYYYYYYYYYYYYYYY55555555PBP?~~~^^^^^^!~7J555555555555YJJJ????????JJJYY5PPP55555YYJJYY55PGGBBBBPJ!~^::::::^^^~~!JGGP5555555555555555555555!~^::::::^75YYY\n");
-printf("YYYYYYYYYYYJ~^^:::::^^!YYYYYYYYYYYYYY55555555YJYYGBJ!~~~^^~~!77J55YJJJJJJJJ?7777!!!!!!!!!!!7??????77777?7777??J5PBBBGP5?!^^:::^^^^~~7PBBBP55555555555555555555557~^::::::^75YYY\n");
-printf("YYYYYYYYYYYY!^^::::::^!YYYYYYYYY5555555555YJ?7?YY5G#57!~~~~!7?JJJ??????????7777777777777777??????7!~~^~~~~~~~!!!7JPGPPPY7~^^^^^^^~~JB###BG55555555555555555555557^^::::::^?5YYY\n");
-printf("YYYYYYYYYYYY7~^::::::^^?5Y5YY5555555555Y??7!~~~7?JPB#P7!!!!!7777!!!!7????????????????????????????7~~^^^^~^^~~~~~~!7Y5PPY7~^^^^^~~!Y######G555555555555555555555J~^::::::^~Y5555\n");
-printf("YYYYYYYYYYYYY!^^::::::^~?Y555555555555J!~~~^^^^^~~!G##PJ7777!!!!~~!77??????????????????????????????7!~^^^^^^~~~~~~!7?J??7!~~~~~!7P####BGY???JYYYY5555555555555Y!^^:::::^^?55555\n");
-printf("YYYYYYYYYYYYYJ!^^:::::::^!?Y55555555?!^::::^:^^^^~~5#BBB5?7!!!~~!7???????????????7~^~~~~?????????????7!^^^^^^^^~~~~~~~~~!!7!!!!7P&####?~~~^^^~^^~~!?Y5555555Y?~^^:::::^^7555555\n");
-printf("YYYYYYYYYYYYYYJ!~^^:::::::^^!7????7~:::::::^^^^~~!Y####BY!!!~~~7???????7??????????7!^^^^!??????77??7!^^^^^^^^^^^^~~~~~~~~~!7??YB&#B###5!~~^^^^^^^^^^~J55YYJ7~^^:::::^^~75555555\n");
-printf("YYYYYYYYYYYYYYYY?!~^^:::::::::::::::::::::^^^!?YPB&&&&P?!!!!~~7??????7~~7???????????7!^:!?????7^^~~^:^^^^^^^^^^^^~~~~~~~~~!!!?5GGBBB###5!~~~~^^^^^^^^^~~~^^:::::::^^^!J55555555\n");
-printf("YYYYYYYYYYYYYYYY5Y?!~~^^^^:::::::::::::^^^~!?P#&&&#&#Y7!!!!~~~7?????7^^^!?????????????7~!?????7:::~::^^^^^^^^^^^^~~~~~~~~!!!!!!7YPGBBB##G5J7~~^^^^^^^::::::::::^^^~!?Y555555555\n");
-printf("YYYYYYYYYYYYYYYY555YJ?7!~~~^^^^^^^^^^^~~!?J5PPB###&#Y77!!!~~~~7??????~^^~???????7?????????????7::^!~^:^^^^^^^^^^^~~~~~~~!!!!!!!77YPGBBBB###BP?!~~^^^^^^^^^^^^^^~!7JY55555555555\n");
-printf("YYYYYYYYYY5Y555Y5555555YYJJ?77777777?JJY5555PPPGB#&57?7!!!~~~~!7??????7~!??????:^!7??????????????7??~^^^^^^^^^^^^~~~~!!!!!!!!!!!7?Y5GBGBB#B###GY?7!!~~~~~~!!77?YY55555555555555\n");
-printf("YYYYYYYY55YY55555555555555555555555555555555PPPGB#G???7!!!!~~~~~7?????????????7~^:^!?????????????????77^^^^^^^^^^^~~!!!!!!!!!!!7?JY5PGBGBB#######BGP5YYYYYY55555555555555555555\n");
-printf("YYYY5YY555YYY5555555555555555555555555555555PPGB#GJ???7!!!!~~~~~~~7????????????J77!!?????????????????7~^^^^^^^^^^~~~!!!!!!!!~!!7?JY5PPGBBBB#####BBBGP55555555555555555555555555\n");
-printf("YYYY5YY5555555555555555555555555555555555555PGBBGJ??J?7!!!!~~~~~^^^^~!?????????????????????????????~^^^^^^^^^^^^~~~!!!!!!!!!!!7?JYY5PGGBBB######BBGP555555555555555555555555555\n");
-printf("YYY55555555555555555555555555555555555555555GBGGYJJJJ?77!!!~~~~~~^^^^!????????????????????????????~::^^^^^^^^^^~~~~!!!!!!!!!!!7JYYY5GGGBB########BBGPPP555555555555555555555555\n");
-printf("5555555555555555555555555555555555555555555PGGBPJJJJJ?777!!!!!~~~~~^~777?!?!~^~~~~~~~~~~~~~!7?77!~^^^^^^^^^~~~~~~!!!!!!!!!!!!!7J5YY5PGBBB##########BGPP555555555555555555555555\n");
-printf("555555555555555555555555555555555555555555PGGBB5JJ?J????JJ?JJ???77!!~~~~~~~^^^^^::^:^^^~~~^~!!!!!!!!!~~!!!!77!!~~!!!!!!!!!!!!!!?Y5Y5PGBBBBBB########BGP555555555555555555555555\n");
-printf("555555555555555555555555555555555555555555PGB##YJJ?JJJJYY555P5555YJ??7!!!~~~^^^^^^^^^~~!!!!7?JJY55555YJ????????7!!!!!!!!!!!!!!77?5P55PGB#BBBBB#######G5555555555555555555555555\n");
-printf("555555555555555555555555555555555555555555GB###Y??J55YYYYJJJJJJJYYYJJJ?77!!~~~^^^^~~~!!!!77??JJJYJJJJ???7777777777777!!!!!!!77777YPPPPBBB#B##########G5555555555555555555555555\n");
-printf("55555555555555555555555555555555555555555PGB#&#YYYPP555YYJJ????????JJJJJJ?7!!~^^^^~!!777????77777!!~~~~~~~~~!!!!7??77!!!!!!!!!!!7?PGGGBBBBB##########G5555555555555555555555555\n");
-printf("5555555555555555555555555555555555555555PGBB###BBBGGPPP55PPPPPPPP5YJY5555YYJ7!~^^~~!?JYYYYYYY5YJJYYYYYY55555555YJJJJJ???7777777?J5B#BBBBBBB#########BP5555555555555555555555555\n");
-printf("5555555555555555555555555555555555555555P####G55555YYYY55PPPPPPPP5555P55PGG#BB5PP5YY5555YYYY5YYJJJY55PPGGPP555555P####BBGGBBBBB##&&&&#&########BB####P5555555555555555555555555\n");
-printf("55Y5555555555555555555555555555555555555PGB##55PP5555PPPP5YYGGG5PPPP5Y555G##&&#BBBGG5JJYYYYYYY?7!!J5YPGGGGGPPPP5YJP##&##GGBBBBBBB##&&#&&####BGGGGGBBBG5555555555555555555555555\n");
-printf("5555555555555555555555555555555555555555555BB555555PPGGP5?7?5P555P55J?JYYPB#Y?77?5BBY????JY???7!~~!Y55PPPP5Y5PPPP5Y##5JJJJJJJJJJJJ5GBBBBB#BB5YYPPP5GGP5555555555555555555555555\n");
-printf("5555555555555555555555555555555555555555555GB5YY555PPP5YJ??77JJJJ????JJJJG#Y!~~^^~YBP?77777???7777!777?JJJ??JY5YYYY#G7777777777777?YPGGGGPPP5Y5555J5P55555555555555555555555555\n");
-printf("555555555555555555555555555555555555555555PGBPJJYY555YJ?7777777???JJJJJ?Y#G?!~~^~!7PGJ77!!7777???777!!!!!7777???JJY#Y!!777777!!!777J5GGGGP555JYYYY?Y555555555555555555555555555\n");
-printf("5555555555555555555555555555555555555555PPGGBGJ?JJYYYJ??77777777?????77Y#GJ7!~~~~!7JGP?!!!!~!!!!!!!!!!!!!!!7777???5B!!!!!!!!!!!!77??5GGBGG55YJJYJ??5555555555555555555555555555\n");
-printf("555555555555555555555555555555555555555PPPBBBBP??JJYYJ?77!!!!!!!!!!!!!YBG??7!~~~~!77JGG?!~~~^~~~~~~~~~~~~~!!77777?BY~!!!!!!!!!!7777?YPGGGG5YJ?JJJ?Y5555555555555555555555555555\n");
-printf("55555555555555555555555555555555555555P5PPBBBBB5?????77!!~~~~~~~!!!!?PB5???7!~~~~!!77?PGY!~^^^^^^^^^^^^^^~~!!!!!7PP!!!!!!!!!7!77777?Y5GGGGPJ?77???J5555555555555555555555555555\n");
-printf("5555555555555555555555555555555555555555PPGBBBPPGP5YYJJJ???????JJYPGGPJ7??7!!~~~~!!!!77JPPY?7!~^^^^^^^^^^^~~!!7JP57!!!!!!!!!7777777?J5PPPP55J7~!7!J5555555555555555555555555555\n");
-printf("555555555555555555555555555555555555555PPPGBGB5JJJJYY555PPPPPP5555YYJ????77!~~~~~~!!7777?Y55P5555YYYYYYYYYY555YJ?!!!!!!!!!!!7777777?J5PP55YYY?!~77Y5555555555555555555555555555\n");
-printf("55555555555555555555555555555555555555555PPGGG5JJJ???????????7777777?J??77!!~~~~~~~!!7777????7??????JJ?JJ???777!!!!!!!!!!!!!7777777?Y5P5PY?JJ?!!?7Y5555555555555555555555555555\n");
-printf("555555555555555555555555555555555555555P5PPGGG5JJJ????777!!!!!!!!!7??77777~~^^^^~!!~!!!777??7777!!~~~~~~~~~~~~~~!!!!~!!!!!!77777777?Y5555JJJJ7!7??55555555555555555555555555555\n");
-printf("5555555555555555555555555555555555555PPPPPPPGG5JJJ??77!!!!!~~!!!77??JJ????~~~~~^~!7777??????7!7777!!!~~^^^^^~^~~~~~!!!!!!!77777777?JY55Y5YJ?77777Y55555555555555555555555555555\n");
-printf("5555555555555555555555555555555555555PPPPPPPGG5JJ???7!!!!!!!!!777777JY5YY?7777777?JY55555YJ7!!!!7777!~~~~~~~~~~~~!!!!!!!!7777777???Y5PP5JJ???777J555555555555555555555555555555\n");
-printf("55555555555555555555555555555555555PPPPPPPPGGG5JJJ??77!!!!!!!!7777!7?JY5555YYYYY55PP5555YJ?7!~~~~!777!!~~~~~~~~~!!!!!!7!7777777???Y555P5JJYJ?77J5555555555555555555555555555555\n");
-printf("555555555555555555555555555555555555PPPPPPPGGG5YJJ??7777!!!!!!!!!!7JJY5PGGGPP55555555PP55YJJ?7!!~~~!7?77!!!!!!!!!!!!!!!!7777777??YYYPPG5JYJ???YPP555555555555555555555555555555\n");
-printf("5555555555555555555555555555555555P5PPPPPPPGGGPYJJ???777!!!!!!7!7JY55PGGGGGPPP555PPPPPGGGPP55Y??J??777??77!!!!!!!!!!!!!!7777777?J5555PG5YYYJJYPP5555555555555555555555555555555\n");
-printf("5555555555555555555555555555555555PPPPPPPPGGGGPYJJ????777!!!77?JYPPPPGGGGGPGGG5YPPGPPPGGGPGP55YY55555YJ??7!!!!!!!!!!!!!!!777???JY555PPGP55P55PPPP555555555555555555555555555555\n");
-printf("5555555555555555555555555555555P5PPPPPPPPPGGGGPYJJ???7777777JY5PPPPGPGGGGPP5Y??JY5PPPPPPGGP5555YY5PPP55YJJ!!!~~~~~~~!!!!!77???JYYYPPPGGGPGGGPPPP5555555555555555555555555555555\n");
-printf("5555555555555555555555555555555555PPPPPPPPPGGGG5YJJ??77777?Y5P55PP55PPPPP55YJJ??JY55PPPPPP555555PPGGP5PPYY7~~~~~~~~~!!7!!7?JJJJ55PPGGGGGBGGPPPPP5555555555555555555555555555555\n");
-printf("555555555555555555555555555555P5PPPPPPPPPPGGGGGP5YJJ??77?J55555YPGGBBPYY??JJJJJYJJJ?JJ7!7J7!JYJ5PPYJY5PPP57!!!!!!!!!!7!!!7??Y555PPPGGBBBGPPPPPPPP555555555555555555555555555555\n");
-printf("5555555555555555555555555555P5P5PPPPPPPPPGGGGGGPP55YJJ?JYY555Y55PY5PP5YJ777~^^~!~^^^!7~~!???JJJJ7!!7J5GG5Y?7!!!77!!!!7!!7JJYYPPPPGGGGBBBGGGPPPPPPPP5555555555555555555555555555\n");
-printf("5555555555555555555555555555555PPPPPPPPPPPGGGGGGGP555YJYY555PPGPY?JYYJJJJYJ?77777777?????????77!!!!7J5GGPY??777J?!!!!77?JJYPPPGPGGBBGBBBGGGPPPPPPPP5555555555555555555555555555\n");
-printf("55555555555555555555555555P5PP55PPPPPPPPPPGBGGGGGGP55Y5555PPPGPY??JJJJ????77!!7777!!!!!777777!!!77?JYPGPP5J?J?JYJ??77?JJJY5PPGGGGBBBBBBBGGGPPPPPPPP5P55555555555555555555555555\n");
-printf("5555555555555555555555555555PPPPPPPPPPPPPPGGGBBBGGGP555PPGGGPGPYJ??J?????7777777777!777777!!777?77J5PGGGG5YYYY5YJYJ??JY55PPGGGGGGBBBBBGGGPPPPPPPP5P5555555555555555555555555555\n");
-printf("555555555555555555555555555PPPP5PPPPPPPPPPPGGGGBGGGGPPPGGGGGGGP55J?JYJJJJJJJYYYJJJJJJJJJJ???777?JY5PGGBGGP55PPPY55YYJ55PGGGGGGBBBGBBBGGGPPPPPPPPPPPP555555555555555555555555555\n");
-printf("55555555555555555555555555555PPPPPPPPPPPPPPGGGGBBGBBGGGGGGGGGGGGP5YY5YYY555PPPPPP5PP55555YJ?7?JY5PGBBGBBGGGPGPPPP5YPPPGGGGBBGBBBBBBBGGGGPPPPPPPPPP55555555555555555555555555555\n");
-printf("5555555555555555555555555555PPPPPPPPPPPPPGGGGGBBBGBGGGBGGGGBBBBBPP5YYYYYYYPPPPGPGPP55YYY55YJJJYPGGBBB###BBBBGGGPPPPGGPGBBBBBBBBBBBGGGGGPPPPPPPPPPPPPP55555555555555555555555555\n");
-printf("5555555555555555555555555PPP5PPPPPPPPPPPPPPGGGBBBGGGBBBBBBBB##BBBG55YYYYYPP5PPGGPG55YYJYYY55555GBBB#####BBBBBGBGGGGGGBBBBBBBBBBBBGPPGPPPPPPPPPPPPPPP555555555555555555555555555\n");
-printf("555555555555555555555555555PPPPPPPPPPPPPPPPPGGGBBBBBBBBB#######BGGPPPPPPGGGPGGBBPPPPPPPP5GPPGGGBB########BBBBBBBBBBBBBBBBBBBBBBGP55Y5PPPPPPPPPPPPPPP555555555555555555555555555\n");
-printf("555555555555555555555555555PPPPPPPPPPPPPPPPPPGGBBBBBBB########BBGBBGGGGBGBBBBBBGGGGGGGGGPGGBGBGB##########BBBBBBBBB##B#BB##BBGP555YJ5PPPPPPPPPPPPPPP555555555555555555555555555\n");
-printf("555555555555555555555555555PPPPPPPPPPPPPPPPPPGGGGBBBBB########BBGGGGBBGGBBBBBBGGBBBBGBGBPGBBBBGB###############BBBB##BBBBBBGGGPYYJ?JG5Y5PPPPPPPPPPPPPP5555555555555555555555555\n");
-printf("55555555555555555555555555PPPPPPPPPPPPPPPPPPPPPPGGBBBBB#####BBBGPGGBBGBBBBBBBBGGBGBBBBBGGGGBBBB################B#BB#BBBGBGP5Y5YJ???JBY??J5PPPPPPPPPPP5P555555555555555555555555\n");
-printf("555555555555555555555555PP5PPPPPPPPPPPPPPPPPPPPPGGGBBBB##B##BBPPGGBGGGBBBBBBBBBBBBBBBGPGPPGBBBB###&#####B######BBBBBBBGPPPYJJJ?????Y5?777?YPPPPPPPPPPP5P55555555555555555555555\n");
-printf("555555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPGGGB#BBBBBGGBBGGBGGBBBBBBB#BBGBBBBBGGGGGBPGBB##########B####BB#BB#GGP5YYJJ?77???JY?777777J5PPPPPPPPPP555555555555555555555555\n");
-printf("555555555555555555555555P5PPPPPPPPPPPPPPPPPPPPPPPPGGGGGB#BBBPB#BGBGGGBB#BBB#BBBBBBGBGGGGGBPPBBBBBB######B#####B#BGGGP5YJJ??777777?Y?77777777?YPPPPPPPPPP55555555555555555555555\n");
-printf("555555555555555555555555P55PPPPPPPPPPPPPPPPPPPPPPPPPPGGBBBBBPBBBGGBGPBBBBBBBBBBBBGGGGBBGGP5GBB#BBB####BB#####BBGP5YYJJ???7777777?J?777!777!!77?5PPPPPPPP55555555555555555555555\n");
-printf("555555555555555555555PP5P5PPPPPPPPPPPPPPPPPPPPPPPPPPPPPGGBBPGBBGBGBBGBBBBBBBBBGGGPGGBGGGPPGGGBBBB#BBBBBB###BGPP5YJJJ??777777!!7?J77!!!7777!!!!!7YPPPPPPP55555555555555555555555\n");
-printf("555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGGGBPPBGGPGBBPBBBBBBGBBPGGGBGBGBPPPGGGBBBBBBBGGGPGGP5YYYJ???7777777!!!7??7!!!!!!!7!!!!!!!!J5PPPPPPP5P5555555555555555555\n");
-printf("555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPP5PPPGG5PGBBPGBBBBBBBGGBBGPPGBGPP5PPBGGGGGGGGGP55YYJJ???7777777!!!!!??7!!!!!!!!!!7!!!!~!!!?5PPPPP55P5555555555555555555\n");
-printf("555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPP55PPPPPGGGBBBBBBBBGGGGPPBBGGPPP5PGPBPPP5YYYJYJJ???77777!!!!!!!!7!?!!!!!!!!!!!!!!!!!~!!!!?5PPPPP555555555555555555555\n");
-printf("555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPP5P5PPPPGBBBBBBBBBGPPPPPGGBPG5PPPPPPP5YYJJJJ????77777!!!!!!!!!7?7!!!!!!!!!!!!!!!!!!~~~~!!7JYY555PPP55555555555555555\n");
-printf("55555555555555555PP5PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGPPPP5Y5PGPPPGBGGBBBBG5555PGP5YPYYY5Y5YJJJJJ???7777777!!!!!!!!!7??7!!!!!!!!!!!!!!!!~~~~~~~~!!7?????JJY55555555555555555\n");
-printf("555555555555555555PP5PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGPP5Y5PBBP5PP5PPPGG5Y55YYYYYYYJJJJJJ??????77777777!!!!!!!!!!???7!!!!!!!!!!!!!!!!~~~~~~~~~~!!77!777777???JY55555555555\n");
-printf("5555555555555555P55PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGGGGPYY5PP#B5YYJJYY55YYYYYYYJJJJJ????????77777!!!!!!!!!!!!!!!7??7!!!!!!!!!!!!!!!!!~~~~~~!~~~!!7!!!!!!7777777??JJY555555\n");
-printf("\n\n\n+++++++++++++++++++++++++++++++++++++++++++++ ZOOOM OUT FOR SUPRISE !!! +++++++++++++++++++++++++++++++++++++ \n");
+int handle_goheels(char **args, int stdin, outbuf *out, history *myhistory) {
+    out_printf(out, "YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY55Y55\n");
+out_printf(out, "YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYY5555555YYYYYY55555555555555555555YYYYYYYYYYYYYYYYYYYYYYYYYYYY5YYYY55555555555YYYYYYYYYYYYYYYYYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYYYYYYYYYYYYYYYJJ?77!!!!!!!!!77?JJYYYYYYYYYYYYYYYYYYYYYYYY55YY55555555PPPPPP55PPPGGGGPPPGGGBGBGGGPPPP55Y55PPP5YYYYYYYY5YYYYY5555YYYYJJJJJJJJYYY5555YYYYYYYYYYYYYYY5\n");
+out_printf(out, "YYYYYYYYYYYYYYYYYYYYYYYJ7!~^^::::::::::::::::^^~!7JYY5YYYYY5555Y5555555555555PPGGGGGBBBBGGBBBBBGBBBBBBGBBBBBGGGGGGGGGGPGG555YYYY5YY555YYJ?7!!~~^^^^^^^^^^^~!7?JYY55YYYYYYYYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYYYYYYYY?!~^::::::::::::::::::::::::::^^~7JY555555555PPGGGGGGGGGGGGGBBGBBBBBBBBBBBBBBBBB#BBBBBBBBBBGGGB##BGGGP55555555YJ?7!~^^:::::::::::::::::::::^~7J55YYYYYYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYYYYYY7~^:::::::::::::::::::::::::::::::::^~7J5PPPGGGGGGGGGGGGBBBGGBBBBBBBBBBBGGGBBBBBBBBBBBBBBBB#BBBBB###BGGGPPP555J7~^^:::::::::::::^^^^^^::::::::::^!JY5YYYYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYYYY?~^::::::::::^^^^^^^^^^^^^^::::::::::::::^!JPGGGGGGGGGGGGGBBBBBBBBBBBGGGGBBGGGGBBBGGBBBBBBBBBBBBBBBBB###BBBBG5?~^^:::::::::::^^^^^^^^^^^^^^^:::::::::~J5YYYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYYY!^:::::::::^^^~~~~~~~~~~~~^^^^^^::::::::::::^!JPGGGGGGGGGGBBBBBBBBGGGGGGGGGBBBBBBBBBBBGBBBBBBBBBBBBB#BBBBB#B57^^:::::::::::^^^^^^^^~~~~~~^^^^^^::::::::^7Y5YYYYY\n");
+out_printf(out, "YYYYYYYYYYYYYY!^::::::::^^~~!??JJJJJJJJ?7!!~~^^^^^::::::::::^^75BBGGGGGBBBBBBBBBBGBGGGGGGGGGGGGGGBGGGGGGGGGGGGGGGBBBBBBBB57^^:::::::::::^^^^~~~!!!777??77!!~~^^^::::::::!YYYYYY\n");
+out_printf(out, "YYYYYYYYYYYYY!^:::::::^^^!?JYYYYYYYYY555YYJ?7!~~^^^^::::::::^^!?5GGGGGBBBBBBBBBBGGGGGGGGGGGGGBBBBGGGGGPPPPPGGGGGGGGGGGBG?~^^::::::::::^^^^~~!7?JYY5555555YYJ?!~^^::::::::75YYYY\n");
+out_printf(out, "YYYYYYYYYYYY7^^::::::^^~7Y5YYYYYYYYYYYYYY5555Y?!~~^^^^::::::^~!7YGBGGGGGBBBBBGGGGPPP5PPPPPGGGGGBBBGGGPPPPGGGGGGGGBGGGBB?^^^:::::::::^^^~~!?JY5555555555555555Y7~^^:::::::^J5YYY\n");
+out_printf(out, "YYYYYYYYYYYY!^^::::::^~?5YYYYYYYYYYY5555555Y55PPJ!~~^^^^:::^~~!?5GGGGGPGGGGPPP5555YYY55555PPGGGGGGGPP5P55555PPPGGBBBBGJ!^^::::::::^^^~~7J5555555555555555555555?~^^::::::^?55YY\n");
+out_printf(out, "YYYYYYYYYYYJ~^::::::^^!YYYYYYYYYYYYYYYY55555555PBP?~~~^^^^^^!~7J555555555555YJJJ????????JJJYY5PPP55555YYJJYY55PGGBBBBPJ!~^::::::^^^~~!JGGP5555555555555555555555!~^::::::^75YYY\n");
+out_printf(out, "YYYYYYYYYYYJ~^^:::::^^!YYYYYYYYYYYYYY55555555YJYYGBJ!~~~^^~~!77J55YJJJJJJJJ?7777!!!!!!!!!!!7??????77777?7777??J5PBBBGP5?!^^:::^^^^~~7PBBBP55555555555555555555557~^::::::^75YYY\n");
+out_printf(out, "YYYYYYYYYYYY!^^::::::^!YYYYYYYYY5555555555YJ?7?YY5G#57!~~~~!7?JJJ??????????7777777777777777??????7!~~^~~~~~~~!!!7JPGPPPY7~^^^^^^^~~JB###BG55555555555555555555557^^::::::^?5YYY\n");
+out_printf(out, "YYYYYYYYYYYY7~^::::::^^?5Y5YY5555555555Y??7!~~~7?JPB#P7!!!!!7777!!!!7????????????????????????????7~~^^^^~^^~~~~~~!7Y5PPY7~^^^^^~~!Y######G555555555555555555555J~^::::::^~Y5555\n");
+out_printf(out, "YYYYYYYYYYYYY!^^::::::^~?Y555555555555J!~~~^^^^^~~!G##PJ7777!!!!~~!77??????????????????????????????7!~^^^^^^~~~~~~!7?J??7!~~~~~!7P####BGY???JYYYY5555555555555Y!^^:::::^^?55555\n");
+out_printf(out, "YYYYYYYYYYYYYJ!^^:::::::^!?Y55555555?!^::::^:^^^^~~5#BBB5?7!!!~~!7???????????????7~^~~~~?????????????7!^^^^^^^^~~~~~~~~~!!7!!!!7P&####?~~~^^^~^^~~!?Y5555555Y?~^^:::::^^7555555\n");
+out_printf(out, "YYYYYYYYYYYYYYJ!~^^:::::::^^!7????7~:::::::^^^^~~!Y####BY!!!~~~7???????7??????????7!^^^^!??????77??7!^^^^^^^^^^^^~~~~~~~~~!7??YB&#B###5!~~^^^^^^^^^^~J55YYJ7~^^:::::^^~75555555\n");
+out_printf(out, "YYYYYYYYYYYYYYYY?!~^^:::::::::::::::::::::^^^!?YPB&&&&P?!!!!~~7??????7~~7???????????7!^:!?????7^^~~^:^^^^^^^^^^^^~~~~~~~~~!!!?5GGBBB###5!~~~~^^^^^^^^^~~~^^:::::::^^^!J55555555\n");
+out_printf(out, "YYYYYYYYYYYYYYYY5Y?!~~^^^^:::::::::::::^^^~!?P#&&&#&#Y7!!!!~~~7?????7^^^!?????????????7~!?????7:::~::^^^^^^^^^^^^~~~~~~~~!!!!!!7YPGBBB##G5J7~~^^^^^^^::::::::::^^^~!?Y555555555\n");
+out_printf(out, "YYYYYYYYYYYYYYYY555YJ?7!~~~^^^^^^^^^^^~~!?J5PPB###&#Y77!!!~~~~7??????~^^~???????7?????????????7::^!~^:^^^^^^^^^^^~~~~~~~!!!!!!!77YPGBBBB###BP?!~~^^^^^^^^^^^^^^~!7JY55555555555\n");
+out_printf(out, "YYYYYYYYYY5Y555Y5555555YYJJ?77777777?JJY5555PPPGB#&57?7!!!~~~~!7??????7~!??????:^!7??????????????7??~^^^^^^^^^^^^~~~~!!!!!!!!!!!7?Y5GBGBB#B###GY?7!!~~~~~~!!77?YY55555555555555\n");
+out_printf(out, "YYYYYYYY55YY55555555555555555555555555555555PPPGB#G???7!!!!~~~~~7?????????????7~^:^!?????????????????77^^^^^^^^^^^~~!!!!!!!!!!!7?JY5PGBGBB#######BGP5YYYYYY55555555555555555555\n");
+out_printf(out, "YYYY5YY555YYY5555555555555555555555555555555PPGB#GJ???7!!!!~~~~~~~7????????????J77!!?????????????????7~^^^^^^^^^^~~~!!!!!!!!~!!7?JY5PPGBBBB#####BBBGP55555555555555555555555555\n");
+out_printf(out, "YYYY5YY5555555555555555555555555555555555555PGBBGJ??J?7!!!!~~~~~^^^^~!?????????????????????????????~^^^^^^^^^^^^~~~!!!!!!!!!!!7?JYY5PGGBBB######BBGP555555555555555555555555555\n");
+out_printf(out, "YYY55555555555555555555555555555555555555555GBGGYJJJJ?77!!!~~~~~~^^^^!????????????????????????????~::^^^^^^^^^^~~~~!!!!!!!!!!!7JYYY5GGGBB########BBGPPP555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555555555PGGBPJJJJJ?777!!!!!~~~~~^~777?!?!~^~~~~~~~~~~~~~!7?77!~^^^^^^^^^~~~~~~!!!!!!!!!!!!!7J5YY5PGBBB##########BGPP555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555555555PGGBB5JJ?J????JJ?JJ???77!!~~~~~~~^^^^^::^:^^^~~~^~!!!!!!!!!~~!!!!77!!~~!!!!!!!!!!!!!!?Y5Y5PGBBBBBB########BGP555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555555555PGB##YJJ?JJJJYY555P5555YJ??7!!!~~~^^^^^^^^^~~!!!!7?JJY55555YJ????????7!!!!!!!!!!!!!!77?5P55PGB#BBBBB#######G5555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555555555GB###Y??J55YYYYJJJJJJJYYYJJJ?77!!~~~^^^^~~~!!!!77??JJJYJJJJ???7777777777777!!!!!!!77777YPPPPBBB#B##########G5555555555555555555555555\n");
+out_printf(out, "55555555555555555555555555555555555555555PGB#&#YYYPP555YYJJ????????JJJJJJ?7!!~^^^^~!!777????77777!!~~~~~~~~~!!!!7??77!!!!!!!!!!!7?PGGGBBBBB##########G5555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555555PGBB###BBBGGPPP55PPPPPPPP5YJY5555YYJ7!~^^~~!?JYYYYYYY5YJJYYYYYY55555555YJJJJJ???7777777?J5B#BBBBBBB#########BP5555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555555P####G55555YYYY55PPPPPPPP5555P55PGG#BB5PP5YY5555YYYY5YYJJJY55PPGGPP555555P####BBGGBBBBB##&&&&#&########BB####P5555555555555555555555555\n");
+out_printf(out, "55Y5555555555555555555555555555555555555PGB##55PP5555PPPP5YYGGG5PPPP5Y555G##&&#BBBGG5JJYYYYYYY?7!!J5YPGGGGGPPPP5YJP##&##GGBBBBBBB##&&#&&####BGGGGGBBBG5555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555555555BB555555PPGGP5?7?5P555P55J?JYYPB#Y?77?5BBY????JY???7!~~!Y55PPPP5Y5PPPP5Y##5JJJJJJJJJJJJ5GBBBBB#BB5YYPPP5GGP5555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555555555GB5YY555PPP5YJ??77JJJJ????JJJJG#Y!~~^^~YBP?77777???7777!777?JJJ??JY5YYYY#G7777777777777?YPGGGGPPP5Y5555J5P55555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555555555PGBPJJYY555YJ?7777777???JJJJJ?Y#G?!~~^~!7PGJ77!!7777???777!!!!!7777???JJY#Y!!777777!!!777J5GGGGP555JYYYY?Y555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555555PPGGBGJ?JJYYYJ??77777777?????77Y#GJ7!~~~~!7JGP?!!!!~!!!!!!!!!!!!!!!7777???5B!!!!!!!!!!!!77??5GGBGG55YJJYJ??5555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555555PPPBBBBP??JJYYJ?77!!!!!!!!!!!!!YBG??7!~~~~!77JGG?!~~~^~~~~~~~~~~~~~!!77777?BY~!!!!!!!!!!7777?YPGGGG5YJ?JJJ?Y5555555555555555555555555555\n");
+out_printf(out, "55555555555555555555555555555555555555P5PPBBBBB5?????77!!~~~~~~~!!!!?PB5???7!~~~~!!77?PGY!~^^^^^^^^^^^^^^~~!!!!!7PP!!!!!!!!!7!77777?Y5GGGGPJ?77???J5555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555555PPGBBBPPGP5YYJJJ???????JJYPGGPJ7??7!!~~~~!!!!77JPPY?7!~^^^^^^^^^^^~~!!7JP57!!!!!!!!!7777777?J5PPPP55J7~!7!J5555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555555PPPGBGB5JJJJYY555PPPPPP5555YYJ????77!~~~~~~!!7777?Y55P5555YYYYYYYYYY555YJ?!!!!!!!!!!!7777777?J5PP55YYY?!~77Y5555555555555555555555555555\n");
+out_printf(out, "55555555555555555555555555555555555555555PPGGG5JJJ???????????7777777?J??77!!~~~~~~~!!7777????7??????JJ?JJ???777!!!!!!!!!!!!!7777777?Y5P5PY?JJ?!!?7Y5555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555555P5PPGGG5JJJ????777!!!!!!!!!7??77777~~^^^^~!!~!!!777??7777!!~~~~~~~~~~~~~~!!!!~!!!!!!77777777?Y5555JJJJ7!7??55555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555PPPPPPPGG5JJJ??77!!!!!~~!!!77??JJ????~~~~~^~!7777??????7!7777!!!~~^^^^^~^~~~~~!!!!!!!77777777?JY55Y5YJ?77777Y55555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555555PPPPPPPGG5JJ???7!!!!!!!!!777777JY5YY?7777777?JY55555YJ7!!!!7777!~~~~~~~~~~~~!!!!!!!!7777777???Y5PP5JJ???777J555555555555555555555555555555\n");
+out_printf(out, "55555555555555555555555555555555555PPPPPPPPGGG5JJJ??77!!!!!!!!7777!7?JY5555YYYYY55PP5555YJ?7!~~~~!777!!~~~~~~~~~!!!!!!7!7777777???Y555P5JJYJ?77J5555555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555555555PPPPPPPGGG5YJJ??7777!!!!!!!!!!7JJY5PGGGPP55555555PP55YJJ?7!!~~~!7?77!!!!!!!!!!!!!!!!7777777??YYYPPG5JYJ???YPP555555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555P5PPPPPPPGGGPYJJ???777!!!!!!7!7JY55PGGGGGPPP555PPPPPGGGPP55Y??J??777??77!!!!!!!!!!!!!!7777777?J5555PG5YYYJJYPP5555555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555PPPPPPPPGGGGPYJJ????777!!!77?JYPPPPGGGGGPGGG5YPPGPPPGGGPGP55YY55555YJ??7!!!!!!!!!!!!!!!777???JY555PPGP55P55PPPP555555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555P5PPPPPPPPPGGGGPYJJ???7777777JY5PPPPGPGGGGPP5Y??JY5PPPPPPGGP5555YY5PPP55YJJ!!!~~~~~~~!!!!!77???JYYYPPPGGGPGGGPPPP5555555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555555PPPPPPPPPGGGG5YJJ??77777?Y5P55PP55PPPPP55YJJ??JY55PPPPPP555555PPGGP5PPYY7~~~~~~~~~!!7!!7?JJJJ55PPGGGGGBGGPPPPP5555555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555555P5PPPPPPPPPPGGGGGP5YJJ??77?J55555YPGGBBPYY??JJJJJYJJJ?JJ7!7J7!JYJ5PPYJY5PPP57!!!!!!!!!!7!!!7??Y555PPPGGBBBGPPPPPPPP555555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555P5P5PPPPPPPPPGGGGGGPP55YJJ?JYY555Y55PY5PP5YJ777~^^~!~^^^!7~~!???JJJJ7!!7J5GG5Y?7!!!77!!!!7!!7JJYYPPPPGGGGBBBGGGPPPPPPPP5555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555555PPPPPPPPPPPGGGGGGGP555YJYY555PPGPY?JYYJJJJYJ?77777777?????????77!!!!7J5GGPY??777J?!!!!77?JJYPPPGPGGBBGBBBGGGPPPPPPPP5555555555555555555555555555\n");
+out_printf(out, "55555555555555555555555555P5PP55PPPPPPPPPPGBGGGGGGP55Y5555PPPGPY??JJJJ????77!!7777!!!!!777777!!!77?JYPGPP5J?J?JYJ??77?JJJY5PPGGGGBBBBBBBGGGPPPPPPPP5P55555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555PPPPPPPPPPPPPPGGGBBBGGGP555PPGGGPGPYJ??J?????7777777777!777777!!777?77J5PGGGG5YYYY5YJYJ??JY55PPGGGGGGBBBBBGGGPPPPPPPP5P5555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555PPPP5PPPPPPPPPPPGGGGBGGGGPPPGGGGGGGP55J?JYJJJJJJJYYYJJJJJJJJJJ???777?JY5PGGBGGP55PPPY55YYJ55PGGGGGGBBBGBBBGGGPPPPPPPPPPPP555555555555555555555555555\n");
+out_printf(out, "55555555555555555555555555555PPPPPPPPPPPPPPGGGGBBGBBGGGGGGGGGGGGP5YY5YYY555PPPPPP5PP55555YJ?7?JY5PGBBGBBGGGPGPPPP5YPPPGGGGBBGBBBBBBBGGGGPPPPPPPPPP55555555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555555PPPPPPPPPPPPPGGGGGBBBGBGGGBGGGGBBBBBPP5YYYYYYYPPPPGPGPP55YYY55YJJJYPGGBBB###BBBBGGGPPPPGGPGBBBBBBBBBBBGGGGGPPPPPPPPPPPPPP55555555555555555555555555\n");
+out_printf(out, "5555555555555555555555555PPP5PPPPPPPPPPPPPPGGGBBBGGGBBBBBBBB##BBBG55YYYYYPP5PPGGPG55YYJYYY55555GBBB#####BBBBBGBGGGGGGBBBBBBBBBBBBGPPGPPPPPPPPPPPPPPP555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555PPPPPPPPPPPPPPPPPGGGBBBBBBBBB#######BGGPPPPPPGGGPGGBBPPPPPPPP5GPPGGGBB########BBBBBBBBBBBBBBBBBBBBBBGP55Y5PPPPPPPPPPPPPPP555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555PPPPPPPPPPPPPPPPPPGGBBBBBBB########BBGBBGGGGBGBBBBBBGGGGGGGGGPGGBGBGB##########BBBBBBBBB##B#BB##BBGP555YJ5PPPPPPPPPPPPPPP555555555555555555555555555\n");
+out_printf(out, "555555555555555555555555555PPPPPPPPPPPPPPPPPPGGGGBBBBB########BBGGGGBBGGBBBBBBGGBBBBGBGBPGBBBBGB###############BBBB##BBBBBBGGGPYYJ?JG5Y5PPPPPPPPPPPPPP5555555555555555555555555\n");
+out_printf(out, "55555555555555555555555555PPPPPPPPPPPPPPPPPPPPPPGGBBBBB#####BBBGPGGBBGBBBBBBBBGGBGBBBBBGGGGBBBB################B#BB#BBBGBGP5Y5YJ???JBY??J5PPPPPPPPPPP5P555555555555555555555555\n");
+out_printf(out, "555555555555555555555555PP5PPPPPPPPPPPPPPPPPPPPPGGGBBBB##B##BBPPGGBGGGBBBBBBBBBBBBBBBGPGPPGBBBB###&#####B######BBBBBBBGPPPYJJJ?????Y5?777?YPPPPPPPPPPP5P55555555555555555555555\n");
+out_printf(out, "555555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPGGGB#BBBBBGGBBGGBGGBBBBBBB#BBGBBBBBGGGGGBPGBB##########B####BB#BB#GGP5YYJJ?77???JY?777777J5PPPPPPPPPP555555555555555555555555\n");
+out_printf(out, "555555555555555555555555P5PPPPPPPPPPPPPPPPPPPPPPPPGGGGGB#BBBPB#BGBGGGBB#BBB#BBBBBBGBGGGGGBPPBBBBBB######B#####B#BGGGP5YJJ??777777?Y?77777777?YPPPPPPPPPP55555555555555555555555\n");
+out_printf(out, "555555555555555555555555P55PPPPPPPPPPPPPPPPPPPPPPPPPPGGBBBBBPBBBGGBGPBBBBBBBBBBBBGGGGBBGGP5GBB#BBB####BB#####BBGP5YYJJ???7777777?J?777!777!!77?5PPPPPPPP55555555555555555555555\n");
+out_printf(out, "555555555555555555555PP5P5PPPPPPPPPPPPPPPPPPPPPPPPPPPPPGGBBPGBBGBGBBGBBBBBBBBBGGGPGGBGGGPPGGGBBBB#BBBBBB###BGPP5YJJJ??777777!!7?J77!!!7777!!!!!7YPPPPPPP55555555555555555555555\n");
+out_printf(out, "555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGGGBPPBGGPGBBPBBBBBBGBBPGGGBGBGBPPPGGGBBBBBBBGGGPGGP5YYYJ???7777777!!!7??7!!!!!!!7!!!!!!!!J5PPPPPPP5P5555555555555555555\n");
+out_printf(out, "555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPP5PPPGG5PGBBPGBBBBBBBGGBBGPPGBGPP5PPBGGGGGGGGGP55YYJJ???7777777!!!!!??7!!!!!!!!!!7!!!!~!!!?5PPPPP55P5555555555555555555\n");
+out_printf(out, "555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPP55PPPPPGGGBBBBBBBBGGGGPPBBGGPPP5PGPBPPP5YYYJYJJ???77777!!!!!!!!7!?!!!!!!!!!!!!!!!!!~!!!!?5PPPPP555555555555555555555\n");
+out_printf(out, "555555555555555555555PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPP5P5PPPPGBBBBBBBBBGPPPPPGGBPG5PPPPPPP5YYJJJJ????77777!!!!!!!!!7?7!!!!!!!!!!!!!!!!!!~~~~!!7JYY555PPP55555555555555555\n");
+out_printf(out, "55555555555555555PP5PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGPPPP5Y5PGPPPGBGGBBBBG5555PGP5YPYYY5Y5YJJJJJ???7777777!!!!!!!!!7??7!!!!!!!!!!!!!!!!~~~~~~~~!!7?????JJY55555555555555555\n");
+out_printf(out, "555555555555555555PP5PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGPP5Y5PBBP5PP5PPPGG5Y55YYYYYYYJJJJJJ??????77777777!!!!!!!!!!???7!!!!!!!!!!!!!!!!~~~~~~~~~~!!77!777777???JY55555555555\n");
+out_printf(out, "5555555555555555P55PPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPPGGGGPYY5PP#B5YYJJYY55YYYYYYYJJJJJ????????77777!!!!!!!!!!!!!!!7??7!!!!!!!!!!!!!!!!!~~~~~~!~~~!!7!!!!!!7777777??JJY555555\n");
+out_printf(out, "\n\n\n+++++++++++++++++++++++++++++++++++++++++++++ ZOOOM OUT FOR SUPRISE !!! +++++++++++++++++++++++++++++++++++++ \n");
+    return 42;
+}
+
+/* Handle a hash command: show the executable lookup cache,
+ * or empty it with "hash -r".
+ */
+int handle_hash(char **args, int stdin, outbuf *out, history *myhistory) {
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        reset_hash_table();
+    } else {
+        print_hash_table(out);
+    }
+    return 42;
+}
+
+/* Handle a rehash command: forget every cached executable path. */
+int handle_rehash(char **args, int stdin, outbuf *out, history *myhistory) {
+    reset_hash_table();
+    return 42;
+}
+
+/* Handle a launcher command: print the backend used to start
+ * external commands, or select one ("spawn" or "fork").
+ */
+int handle_launcher(char **args, int stdin, outbuf *out, history *myhistory) {
+    if (args[1] == NULL) {
+        out_printf(out, "%s\n", get_launcher());
+    } else if (set_launcher(args[1]) < 0) {
+        dprintf(2, "launcher: unknown backend %s (spawn or fork)\n", args[1]);
+        return -1;
+    }
+    return 42;
+}
+
+/* Handle a true command. */
+int handle_true(char **args, int stdin, outbuf *out, history *myhistory) {
+    return 42;
+}
+
+/* Handle a false command. */
+int handle_false(char **args, int stdin, outbuf *out, history *myhistory) {
+    out->status = 1;
+    return 42;
+}
+
+/* Decode the backslash escape at p (which points at the backslash)
+ * into *c.
+ *
+ * octal_zero: octal escapes are written \0nnn, as for echo and
+ *             printf's %b, rather than \nnn, as in printf formats.
+ *
+ * *stop is set for \c, which ends all output.
+ *
+ * Returns a pointer past the escape.
+ */
+static const char *unescape(const char *p, char *c, bool octal_zero, bool *stop) {
+    static const char plain[] = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+    const char *q;
+    int value = 0, digits = 0;
+
+    p++;
+    if (*p == '\0') {
+        *c = '\\';
+        return p;
+    }
+    if (*p == 'c') {
+        *stop = true;
+        return p + 1;
+    }
+    for (q = plain; *q; q += 2) {
+        if (*p == q[0]) {
+            *c = q[1];
+            return p + 1;
+        }
+    }
+    if (*p == 'x' && isxdigit((unsigned char) p[1])) {
+        // \xHH, as in GNU's echo and printf
+        for (p++; digits < 2 && isxdigit((unsigned char) *p); p++, digits++) {
+            value = value * 16 + (isdigit((unsigned char) *p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+        }
+        *c = value;
+        return p;
+    }
+    if (*p >= '0' && *p <= '7') {
+        if (octal_zero && *p == '0') {
+            p++;
+        } else if (octal_zero) {
+            *c = '\\';
+            return p;
+        }
+        for (; digits < 3 && *p >= '0' && *p <= '7'; p++, digits++) {
+            value = value * 8 + *p - '0';
+        }
+        *c = value;
+        return p;
+    }
+    // Not an escape; keep the backslash
+    *c = '\\';
+    return p;
+}
+
+/* Write s to out with its backslash escapes decoded, see unescape().
+ *
+ * Returns true if a \c ended the output.
+ */
+static bool write_unescaped(outbuf *out, const char *s, bool octal_zero) {
+    bool stop = false;
+
+    while (*s && !stop) {
+        size_t run = strcspn(s, "\\");
+        char c;
+        out_write(out, s, run);
+        s += run;
+        if (*s == '\\') {
+            s = unescape(s, &c, octal_zero, &stop);
+            if (!stop) {
+                out_write(out, &c, 1);
+            }
+        }
+    }
+    return stop;
+}
+
+/* Handle an echo command: print the arguments, separated by blanks
+ * and followed by a newline.  As in /bin/echo, -n leaves out the
+ * newline, -e decodes backslash escapes and -E (the default) does not.
+ */
+int handle_echo(char **args, int stdin, outbuf *out, history *myhistory) {
+    bool newline = true, escapes = false;
+    int i = 1, first;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1]
+            && strspn(args[i] + 1, "neE") == strlen(args[i] + 1); i++) {
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 'n') {
+                newline = false;
+            } else {
+                escapes = *o == 'e';
+            }
+        }
+    }
+    for (first = i; args[i]; i++) {
+        if (i > first) {
+            out_write(out, " ", 1);
+        }
+        if (!escapes) {
+            out_write(out, args[i], strlen(args[i]));
+        } else if (write_unescaped(out, args[i], true)) {
+            return 42;
+        }
+    }
+    if (newline) {
+        out_write(out, "\n", 1);
+    }
+    return 42;
+}
+
+/* Convert a printf argument to a number: a C constant (decimal, 0x
+ * hex or 0 octal) or, after a quote, the code of the next character.
+ * An empty argument is 0.  One that is not a number is reported,
+ * makes the builtin fail, and counts as 0 (or its leading numeric
+ * part).
+ */
+static intmax_t printf_int(outbuf *out, const char *arg, bool is_unsigned) {
+    char *end;
+    intmax_t value;
+
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char) arg[1];
+    }
+    if (arg[0] == '\0') {
+        return 0;
+    }
+    errno = 0;
+    if (is_unsigned && arg[strspn(arg, " \t")] != '-') {
+        value = strtoumax(arg, &end, 0);
+    } else {
+        value = strtoimax(arg, &end, 0);
+    }
+    if (end == arg || *end || errno) {
+        dprintf(2, "printf: %s: %s\n", arg, end == arg ? "expected a numeric value"
+                : errno ? strerror(errno) : "not completely converted");
+        out->status = 1;
+    }
+    return value;
+}
+
+static double printf_double(outbuf *out, const char *arg) {
+    char *end;
+    double value;
+
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char) arg[1];
+    }
+    if (arg[0] == '\0') {
+        return 0;
+    }
+    errno = 0;
+    value = strtod(arg, &end);
+    if (end == arg || *end || errno) {
+        dprintf(2, "printf: %s: %s\n", arg, end == arg ? "expected a numeric value"
+                : errno ? strerror(errno) : "not completely converted");
+        out->status = 1;
+    }
+    return value;
+}
+
+/* Handle a printf command: printf format [arguments...]
+ *
+ * The format takes the escapes of unescape() and the conversions
+ * %d %i %o %u %x %X %c %s %b %e %E %f %F %g %G %a %A and %%, with
+ * flags, widths and precisions ('*' takes them from an argument).
+ * The format is used again while arguments are left; missing
+ * arguments count as "" or 0.
+ */
+int handle_printf(char **args, int stdin, outbuf *out, history *myhistory) {
+    char **arg;
+    bool stop = false;
+
+    if (args[1] == NULL) {
+        dprintf(2, "printf: usage: printf format [arguments]\n");
+        out->status = 2;
+        return 42;
+    }
+    arg = args + 2;
+
+// The next argument, or "" once they run out
+#define NEXT_ARG() (*arg ? *arg++ : "")
+
+    do {
+        char **pass = arg;
+        const char *p = args[1];
+
+        while (*p && !stop) {
+            // A conversion is rebuilt into spec, with '*'s filled in
+            char spec[64];
+            size_t n = 0;
+            char conv;
+
+            if (*p == '\\') {
+                char c;
+                p = unescape(p, &c, false, &stop);
+                if (!stop) {
+                    out_write(out, &c, 1);
+                }
+                continue;
+            }
+            if (*p != '%') {
+                size_t run = strcspn(p, "\\%");
+                out_write(out, p, run);
+                p += run;
+                continue;
+            }
+            if (p[1] == '%') {
+                out_write(out, "%", 1);
+                p += 2;
+                continue;
+            }
+
+            spec[n++] = *p++;
+            while (*p && strchr("-+ #0", *p) && n < 8) {
+                spec[n++] = *p++;
+            }
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*p != '.') {
+                        break;
+                    }
+                    spec[n++] = *p++;
+                }
+                if (*p == '*') {
+                    n += snprintf(spec + n, 16, "%d", (int) printf_int(out, NEXT_ARG(), false));
+                    p++;
+                } else {
+                    while (isdigit((unsigned char) *p) && n < 40) {
+                        spec[n++] = *p++;
+                    }
+                }
+            }
+            conv = *p;
+            if (conv == '\0' || !strchr("diouxXcsbeEfFgGaA", conv)) {
+                dprintf(2, "printf: %%%c: invalid conversion\n", conv ? conv : ' ');
+                out->status = 1;
+                return 42;
+            }
+            p++;
+
+            if (strchr("di", conv)) {
+                strcpy(spec + n, "jd");
+                out_printf(out, spec, printf_int(out, NEXT_ARG(), false));
+            } else if (strchr("ouxX", conv)) {
+                spec[n++] = 'j';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                out_printf(out, spec, (uintmax_t) printf_int(out, NEXT_ARG(), true));
+            } else if (strchr("eEfFgGaA", conv)) {
+                spec[n++] = conv;
+                spec[n] = '\0';
+                out_printf(out, spec, printf_double(out, NEXT_ARG()));
+            } else if (conv == 'c') {
+                strcpy(spec + n, "c");
+                out_printf(out, spec, *arg ? (*arg++)[0] : '\0');
+            } else if (conv == 's') {
+                strcpy(spec + n, "s");
+                out_printf(out, spec, NEXT_ARG());
+            } else {
+                // %b: a string with escapes, decoded before padding
+                outbuf decoded;
+                memset(&decoded, 0, sizeof(decoded));
+                decoded.capture = true;
+                stop = write_unescaped(&decoded, NEXT_ARG(), true);
+                out_write(&decoded, "", 1);
+                strcpy(spec + n, "s");
+                out_printf(out, spec, decoded.data ? decoded.data : "");
+                free(decoded.data);
+            }
+        }
+        // Go again only if this pass used up some of the arguments
+        if (arg == pass) {
+            break;
+        }
+    } while (*arg && !stop);
+#undef NEXT_ARG
+
     return 42;
 }
 
+// State of a test command being evaluated
+struct test {
+    char **args;
+    int argc;
+    int pos;
+    bool error;
+};
+
+static bool test_error(struct test *t, const char *what, const char *arg) {
+    if (!t->error) {
+        dprintf(2, "test: %s%s%s\n", arg ? arg : "", arg ? ": " : "", what);
+    }
+    t->error = true;
+    return false;
+}
+
+/* Parse an integer operand, with optional blanks around it. */
+static long long test_int(struct test *t, const char *s) {
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(s, &end, 10);
+    end += strspn(end, " \t");
+    if (end == s || *end || errno || s[strspn(s, " \t")] == '\0') {
+        test_error(t, "integer expression expected", s);
+        return 0;
+    }
+    return value;
+}
+
+static bool is_unary(const char *op) {
+    return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghknprsStuwxzLGO", op[1]);
+}
+
+static bool is_binary(const char *op) {
+    static const char *ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", "-a", "-o", NULL
+    };
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Evaluate a unary primary, e.g. "-f file" or "-z string". */
+static bool test_unary(struct test *t, const char *op, const char *arg) {
+    struct stat sb;
+
+    switch (op[1]) {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 't':
+        return isatty(test_int(t, arg));
+    case 'r':
+        return eaccess(arg, R_OK) == 0;
+    case 'w':
+        return eaccess(arg, W_OK) == 0;
+    case 'x':
+        return eaccess(arg, X_OK) == 0;
+    case 'h':
+    case 'L':
+        return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+    }
+    if (stat(arg, &sb) < 0) {
+        return false;
+    }
+    switch (op[1]) {
+    case 'b':
+        return S_ISBLK(sb.st_mode);
+    case 'c':
+        return S_ISCHR(sb.st_mode);
+    case 'd':
+        return S_ISDIR(sb.st_mode);
+    case 'f':
+        return S_ISREG(sb.st_mode);
+    case 'p':
+        return S_ISFIFO(sb.st_mode);
+    case 'S':
+        return S_ISSOCK(sb.st_mode);
+    case 'g':
+        return sb.st_mode & S_ISGID;
+    case 'u':
+        return sb.st_mode & S_ISUID;
+    case 'k':
+        return sb.st_mode & S_ISVTX;
+    case 's':
+        return sb.st_size > 0;
+    case 'G':
+        return sb.st_gid == getegid();
+    case 'O':
+        return sb.st_uid == geteuid();
+    }
+    // -e
+    return true;
+}
+
+/* Compare two timespecs */
+static int timespec_cmp(struct timespec a, struct timespec b) {
+    if (a.tv_sec != b.tv_sec) {
+        return a.tv_sec < b.tv_sec ? -1 : 1;
+    }
+    return a.tv_nsec < b.tv_nsec ? -1 : a.tv_nsec > b.tv_nsec;
+}
+
+/* Evaluate a binary primary, e.g. "a = b" or "1 -lt 2". */
+static bool test_binary(struct test *t, const char *a, const char *op, const char *b) {
+    struct stat sa, sb;
+    bool ha, hb;
+    long long x, y;
+
+    if (op[0] != '-') {
+        int cmp = strcmp(a, b);
+        switch (op[0]) {
+        case '=':
+            return cmp == 0;
+        case '!':
+            return cmp != 0;
+        case '<':
+            return cmp < 0;
+        default:
+            return cmp > 0;
+        }
+    }
+    if (strcmp(op, "-a") == 0) {
+        return a[0] && b[0];
+    }
+    if (strcmp(op, "-o") == 0) {
+        return a[0] || b[0];
+    }
+    if (op[2] == 't' && op[1] != 'g' && op[1] != 'l') {
+        // -nt and -ot; a missing file is older than any other
+        ha = stat(a, &sa) == 0;
+        hb = stat(b, &sb) == 0;
+        if (op[1] == 'o') {
+            return hb && (!ha || timespec_cmp(sa.st_mtim, sb.st_mtim) < 0);
+        }
+        return ha && (!hb || timespec_cmp(sa.st_mtim, sb.st_mtim) > 0);
+    }
+    if (strcmp(op, "-ef") == 0) {
+        return stat(a, &sa) == 0 && stat(b, &sb) == 0
+            && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+    x = test_int(t, a);
+    y = test_int(t, b);
+    if (strcmp(op, "-eq") == 0) {
+        return x == y;
+    } else if (strcmp(op, "-ne") == 0) {
+        return x != y;
+    } else if (strcmp(op, "-lt") == 0) {
+        return x < y;
+    } else if (strcmp(op, "-le") == 0) {
+        return x <= y;
+    } else if (strcmp(op, "-gt") == 0) {
+        return x > y;
+    }
+    return x >= y;
+}
+
+static bool test_or(struct test *t);
+
+/* primary: ( expr ) | unary-op arg | arg binary-op arg | arg */
+static bool test_primary(struct test *t) {
+    char **a = t->args + t->pos;
+    int left = t->argc - t->pos;
+
+    if (left <= 0) {
+        return test_error(t, "argument expected", NULL);
+    }
+    if (left >= 3 && is_binary(a[1]) && strcmp(a[1], "-a") && strcmp(a[1], "-o")) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "(") == 0) {
+        bool value;
+        t->pos++;
+        value = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->args[t->pos], ")") != 0) {
+            return test_error(t, "')' expected", NULL);
+        }
+        t->pos++;
+        return value;
+    }
+    if (left >= 2 && is_unary(a[0])) {
+        t->pos += 2;
+        return test_unary(t, a[0], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+static bool test_not(struct test *t) {
+    if (t->pos < t->argc && strcmp(t->args[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static bool test_and(struct test *t) {
+    bool value = test_not(t);
+    while (t->pos < t->argc && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        value = test_not(t) && value;
+    }
+    return value;
+}
+
+static bool test_or(struct test *t) {
+    bool value = test_and(t);
+    while (t->pos < t->argc && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        value = test_and(t) || value;
+    }
+    return value;
+}
+
+/* Evaluate argc arguments, with the rules POSIX gives for up to four
+ * arguments, which settle lines such as "test ! = x" or "test -n".
+ * Longer expressions are parsed with -a binding tighter than -o.
+ */
+static bool test_eval(struct test *t, char **args, int argc) {
+    t->args = args;
+    t->argc = argc;
+    t->pos = 0;
+
+    switch (argc) {
+    case 0:
+        return false;
+    case 1:
+        return args[0][0] != '\0';
+    case 2:
+        if (strcmp(args[0], "!") == 0) {
+            return args[1][0] == '\0';
+        }
+        if (is_unary(args[0])) {
+            return test_unary(t, args[0], args[1]);
+        }
+        return test_error(t, "unary operator expected", args[0]);
+    case 3:
+        if (is_binary(args[1])) {
+            return test_binary(t, args[0], args[1], args[2]);
+        }
+        if (strcmp(args[0], "!") == 0) {
+            return !test_eval(t, args + 1, 2);
+        }
+        if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+            return args[1][0] != '\0';
+        }
+        return test_error(t, "binary operator expected", args[1]);
+    case 4:
+        if (strcmp(args[0], "!") == 0) {
+            return !test_eval(t, args + 1, 3);
+        }
+        if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) {
+            return test_eval(t, args + 1, 2);
+        }
+        break;
+    }
+    bool value = test_or(t);
+    if (t->pos < t->argc) {
+        return test_error(t, "too many arguments", NULL);
+    }
+    return value;
+}
+
+/* Handle a test or [ command.  It exits with 0 if the expression is
+ * true, 1 if it is false, and 2 if it is malformed.
+ */
+int handle_test(char **args, int stdin, outbuf *out, history *myhistory) {
+    struct test t;
+    int argc = 0;
+    bool value;
+
+    while (args[argc + 1]) {
+        argc++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (argc == 0 || strcmp(args[argc], "]") != 0) {
+            dprintf(2, "[: missing ']'\n");
+            out->status = 2;
+            return 42;
+        }
+        argc--;
+    }
+    t.error = false;
+    value = test_eval(&t, args + 1, argc);
+    out->status = t.error ? 2 : !value;
+    return 42;
+}
 
 static struct builtin builtins[] = {{"cd", handle_cd},
     {"exit", handle_exit},
     {"goheels", handle_goheels},
     {"history", print_history},
     {"clear", clear_history},
+    {"hash", handle_hash},
+    {"rehash", handle_rehash},
+    {"launcher", handle_launcher},
+    {"jobs", handle_jobs},
+    {"fg", handle_fg},
+    {"bg", handle_bg},
+    {"wait", handle_wait},
+    {"parallel", handle_parallel, false, true},
+    {"forall", handle_parallel, false, true},
+    {"nice", handle_nice},
+    {"taskset", handle_taskset},
+    {"ulimit", handle_ulimit},
+    {"spread", handle_spread},
+    {"pipesize", handle_pipesize},
+    {"pipestats", handle_pipestats},
+    {"true", handle_true, true},
+    {"false", handle_false, true},
+    {"echo", handle_echo, true},
+    {"printf", handle_printf, true},
+    {"test", handle_test, true},
+    {"[", handle_test, true},
+    {"export", handle_export},
+    {"unset", handle_unset},
     {NULL, NULL}};
 
+/* Returns true if name is a builtin, and sets *pure to whether it
+ * only writes output, and so may run in the shell's own process for
+ * a command substitution (see capture_output()).
+ */
+bool is_builtin(const char *name, bool *pure) {
+    for (int i = 0; builtins[i].cmd != NULL; i++) {
+        if (strcmp(name, builtins[i].cmd) == 0) {
+            *pure = builtins[i].pure;
+            return true;
+        }
+    }
+    *pure = false;
+    return false;
+}
+
+/* Returns true if name is a builtin that runs for long and writes its
+ * output as it goes, such as parallel.  In a pipeline, it runs in a
+ * child of its own (see run_stage()), so that the stages after it
+ * start right away and read its output as it comes.
+ */
+bool builtin_streams(const char *name) {
+    for (int i = 0; builtins[i].cmd != NULL; i++) {
+        if (strcmp(name, builtins[i].cmd) == 0) {
+            return builtins[i].streams;
+        }
+    }
+    return false;
+}
+
 /* This function checks if the command (args[0]) is a built-in.
  * If so, call the appropriate handler, and return 1.
  * If not, return 0.
  *
- * stdin and stdout are the file handles for standard in and standard out,
- * respectively. These may or may not be used by individual builtin commands.
+ * stdin is the file handle for standard in, and out the buffered
+ * standard out (see init_output()); the caller flushes it with
+ * flush_output().  These may or may not be used by individual
+ * builtin commands.
  *
  * Places the return value of the command in *retval.
  *
- * stdin and stdout should not be closed by this command.
+ * stdin and the handle behind out should not be closed by this command.
  *
  * In the case of "exit", this function will not return.
  */
-int handle_builtin(char *args[MAX_ARGS], int stdin, int stdout, int *retval, history *myhistory) {
+int handle_builtin(char **args, int stdin, outbuf *out, int *retval, history *myhistory) {
     int rv = 0;
 
     //Loop thru builtins and check for string matches, call appropriate function if we find match
     for (int i=0; builtins[i].cmd != NULL; i++) {
         if (strcmp(args[0], builtins[i].cmd) == 0) {
-            *retval = builtins[i].func(args, stdin, stdout, myhistory);
+            *retval = builtins[i].func(args, stdin, out, myhistory);
             rv=*retval;
             break;
         }
     }  
     return rv;
 }
-
-/* This function initially prints a default prompt of:
- * thsh>
- *
- * Returns the number of bytes written
- */
-int print_prompt(void) {
-    int ret = 0;
-    // Print the prompt
-    // file descriptor 1 -> writing to stdout
-    // print the whole prompt string (write number of
-    // bytes/chars equal to the length of prompt)
-
-    // Adding the current dir to the shell
-    char cwd[280];
-    cwd[0] = '[';
-    char *pointer = &cwd[1];
-    getcwd(pointer, sizeof(cwd));
-    strcat(cwd, "] "); 
-    strcat(cwd, "thsh> ");
-
-    const char *prompt = cwd;
-
-    // Lab 2: Your code here
-
-
-    ret = write(1, prompt, strlen(prompt));
-    return ret;
-}
@@ -0,0 +1,72 @@
+/* Tar Heel SHell
+ *
+ * This file is a benchmark for the builtins that replace common
+ * utilities.  For each one it times running the command to
+ * completion through run_command(), both as a builtin and as the
+ * binary in /bin (or /usr/bin), with output going to /dev/null.
+ *
+ */
+#include "thsh.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ITERATIONS 2000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Average microseconds to run args to completion */
+static double time_command(char **args, int iterations) {
+  double start = now();
+  for (int i = 0; i < iterations; i++) {
+    int status;
+    int job_id = create_job(args[0]);
+    int out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (run_command(args, 0, out, job_id, NULL) || wait_on_job(job_id, &status)) {
+      printf("Failed to run %s\n", args[0]);
+      exit(1);
+    }
+  }
+  return (now() - start) * 1e6 / iterations;
+}
+
+int main(int argc, char **argv) {
+  char *commands[][6] = {
+    { "true", NULL },
+    { "false", NULL },
+    { "echo", "hello", "world", NULL },
+    { "printf", "%s=%d\\n", "answer", "42", NULL },
+    { "test", "-d", "/tmp", NULL },
+    { "[", "abc", "=", "abc", "]", NULL },
+  };
+  int iterations = argc > 1 ? atoi(argv[1]) : ITERATIONS;
+
+  if (init_path() || init_jobs(false)) {
+    printf("Problem setting up the shell.\n");
+    return 1;
+  }
+
+  printf("%-8s %12s %12s %10s\n", "command", "builtin_us", "external_us", "speedup");
+  for (int i = 0; i < (int)(sizeof(commands) / sizeof(commands[0])); i++) {
+    char **args = commands[i];
+    char path[64];
+    double builtin_us, external_us;
+
+    snprintf(path, sizeof(path), "/bin/%s", args[0]);
+    if (access(path, X_OK) < 0) {
+      snprintf(path, sizeof(path), "/usr/bin/%s", args[0]);
+    }
+
+    builtin_us = time_command(args, iterations);
+    args[0] = path;
+    external_us = time_command(args, iterations / 10 ? iterations / 10 : 1);
+    printf("%-8s %12.2f %12.1f %9.0fx\n", strrchr(path, '/') + 1,
+           builtin_us, external_us, external_us / builtin_us);
+  }
+  return 0;
+}
@@ -0,0 +1,186 @@
+/* Tar Heel SHell
+ *
+ * This file is an end-to-end benchmark of the shell binary.
+ * It writes a few scripts into a temporary directory and times
+ * running them with thsh, and with dash and bash if they are
+ * installed, for comparison:
+ *
+ *   startup    an empty script                      (ms per run)
+ *   external   one external command per line       (us per command)
+ *   pipeline   cat | cat | wc -c over a large file  (MB/s)
+ *   script     builtin-only lines                   (lines/s)
+ *   glob       lines with several globs each        (lines/s)
+ *
+ * Each result is printed as one JSON object per line, e.g.
+ *   {"shell":"thsh","workload":"startup","value":1.234,"unit":"ms","runs":5}
+ * so that runs of different versions can be compared by a script.
+ *
+ * Usage: e2e_bench [runs [thsh binary]]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_RUNS 5
+#define EXTERNAL_LINES 200
+#define SCRIPT_LINES 20000
+#define GLOB_LINES 200
+#define GLOB_FILES 2000
+#define PIPE_MB 64
+
+extern char **environ;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Write lines copies of line into the script at path */
+static void write_script(const char *path, const char *line, int lines) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  fprintf(f, "# e2e_bench\n");
+  for (int i = 0; i < lines; i++) {
+    fputs(line, f);
+  }
+  fclose(f);
+}
+
+/* Run shell on script, with standard in and out on /dev/null,
+ * and return the wall clock time it took, in seconds.
+ */
+static double run_script(const char *shell, const char *script) {
+  posix_spawn_file_actions_t actions;
+  char *args[] = { (char *) shell, (char *) script, NULL };
+  double start;
+  int status;
+  pid_t pid;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+  start = now();
+  if (posix_spawn(&pid, shell, &actions, NULL, args, environ) != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    return -1;
+  }
+  waitpid(pid, &status, 0);
+  start = now() - start;
+  posix_spawn_file_actions_destroy(&actions);
+  return start;
+}
+
+/* Median time of runs runs of script under shell, in seconds */
+static double median_time(const char *shell, const char *script, int runs) {
+  double times[runs];
+
+  // Warm up the page cache and the shell's binary
+  run_script(shell, script);
+  for (int i = 0; i < runs; i++) {
+    times[i] = run_script(shell, script);
+  }
+  qsort(times, runs, sizeof(double), compare_doubles);
+  return times[runs / 2];
+}
+
+static void report(const char *shell, const char *workload, double value, const char *unit, int runs) {
+  printf("{\"shell\":\"%s\",\"workload\":\"%s\",\"value\":%.3f,\"unit\":\"%s\",\"runs\":%d}\n",
+         shell, workload, value, unit, runs);
+  fflush(stdout);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(int argc, char **argv) {
+  int runs = argc > 1 ? atoi(argv[1]) : DEFAULT_RUNS;
+  const char *thsh = argc > 2 ? argv[2] : "./thsh";
+  const char *shells[][2] = { { "thsh", NULL }, { "dash", "/bin/dash" }, { "bash", "/bin/bash" } };
+  char thsh_path[PATH_MAX];
+  char dir[] = "/tmp/e2e_bench.XXXXXX";
+  char line[256];
+  double t, startup;
+  FILE *f;
+
+  if (runs < 1) {
+    runs = 1;
+  }
+  if (realpath(thsh, thsh_path) == NULL) {
+    fprintf(stderr, "e2e_bench: %s: %s\n", thsh, strerror(errno));
+    return 1;
+  }
+  shells[0][1] = thsh_path;
+  if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+    perror("e2e_bench");
+    return 1;
+  }
+
+  // The workloads
+  write_script("startup.sh", "", 0);
+  write_script("external.sh", "/bin/true\n", EXTERNAL_LINES);
+  write_script("script.sh", "cd .\n", SCRIPT_LINES);
+  write_script("glob.sh", "cd . *.txt f1*.txt [a-c]*.txt ?2?.txt\n", GLOB_LINES);
+  snprintf(line, sizeof(line), "cat %s/data | cat | wc -c > /dev/null\n", dir);
+  write_script("pipeline.sh", line, 1);
+
+  for (int i = 0; i < GLOB_FILES; i++) {
+    snprintf(line, sizeof(line), "%c%d.txt", 'a' + i % 26, i);
+    close(open(line, O_WRONLY | O_CREAT, 0644));
+  }
+  f = fopen("data", "w");
+  memset(line, 'x', sizeof(line));
+  for (long i = 0; i < PIPE_MB * 1024L * 1024 / (long) sizeof(line); i++) {
+    fwrite(line, 1, sizeof(line), f);
+  }
+  fclose(f);
+
+  for (int s = 0; s < (int)(sizeof(shells) / sizeof(shells[0])); s++) {
+    const char *name = shells[s][0], *path = shells[s][1];
+    if (access(path, X_OK) != 0) {
+      continue;
+    }
+    // Each shell starts with no history, in the same directory
+    unlink(".history");
+
+    startup = median_time(path, "startup.sh", runs);
+    report(name, "startup", startup * 1e3, "ms", runs);
+
+    t = median_time(path, "external.sh", runs);
+    report(name, "external", (t - startup) * 1e6 / EXTERNAL_LINES, "us", runs);
+
+    t = median_time(path, "pipeline.sh", runs);
+    report(name, "pipeline", PIPE_MB / (t - startup), "MB/s", runs);
+
+    t = median_time(path, "script.sh", runs);
+    report(name, "script", SCRIPT_LINES / (t - startup), "lines/s", runs);
+
+    t = median_time(path, "glob.sh", runs);
+    report(name, "glob", GLOB_LINES / (t - startup), "lines/s", runs);
+  }
+
+  if (chdir("/") == 0) {
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  return 0;
+}
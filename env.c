@@ -0,0 +1,435 @@
+/* Tar Heel SHell
+ *
+ * This module keeps the shell's variables, and the environment
+ * handed to the commands it starts.
+ *
+ * Each variable is one allocation holding "NAME=value", so its name
+ * is stored exactly once, and the entry of an exported variable is
+ * also what goes into the envp of a child, as is.  Variables are
+ * found through a hash table keyed by name; lookups take a name and
+ * its length, so the parser can look up a name in the middle of a
+ * word without copying it.
+ *
+ * The envp array is built on first use and then reused for every
+ * command, until an exported variable is set, exported or unset.
+ * Changing PATH also rebuilds the path table (see init_path()).
+ *
+ * The store starts out as a copy of the environment the shell was
+ * started with.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include "thsh.h"
+
+#define VAR_INITIAL_BUCKETS 64
+
+extern char **environ;
+
+struct var {
+    char *entry;       // "NAME=value", or just "NAME" if exported but not set
+    size_t name_len;
+    size_t hash;
+    bool exported;
+    struct var *next;  // Chain in the same bucket
+};
+
+static struct var **vars = NULL;
+static size_t var_buckets = 0;
+static size_t num_vars = 0;
+static size_t num_exported = 0;
+static bool env_loaded = false;
+
+// The environment of children, NULL until it is next needed
+static char **envp_cache = NULL;
+static bool envp_valid = false;
+
+/* FNV-1a hash of the len bytes at name */
+static size_t hash_var(const char *name, size_t len) {
+    size_t h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Returns true if the len bytes at name are a valid variable name. */
+bool is_var_name(const char *name, size_t len) {
+    if (len == 0 || (name[0] >= '0' && name[0] <= '9')) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Double the number of buckets once the table is fully loaded. */
+static void grow_vars(void) {
+    size_t n = var_buckets ? var_buckets * 2 : VAR_INITIAL_BUCKETS;
+    struct var **table = calloc(n, sizeof(struct var *));
+    if (table == NULL) {
+        return;
+    }
+    for (size_t b = 0; b < var_buckets; b++) {
+        struct var *v, *next;
+        for (v = vars[b]; v; v = next) {
+            next = v->next;
+            v->next = table[v->hash & (n - 1)];
+            table[v->hash & (n - 1)] = v;
+        }
+    }
+    free(vars);
+    vars = table;
+    var_buckets = n;
+}
+
+static void load_env(void);
+
+/* Find the link that points at the variable named by the len bytes
+ * at name, or at the NULL that ends its bucket.
+ */
+static struct var **find_var(const char *name, size_t len, size_t hash) {
+    struct var **link;
+
+    if (!env_loaded) {
+        load_env();
+    }
+    if (var_buckets == 0) {
+        grow_vars();
+        if (var_buckets == 0) {
+            return NULL;
+        }
+    }
+    for (link = &vars[hash & (var_buckets - 1)]; *link; link = &(*link)->next) {
+        struct var *v = *link;
+        if (v->hash == hash && v->name_len == len && memcmp(v->entry, name, len) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+/* Set the variable named by the len bytes at name to value, and
+ * export it if export is set.  An exported variable stays exported.
+ *
+ * A NULL value leaves the value as it is, so that export can mark a
+ * variable that is not set yet: it is kept with no value, left out of
+ * the environment until it is set, and exported then.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int store_var(const char *name, size_t len, const char *value, bool export) {
+    size_t hash = hash_var(name, len);
+    size_t value_len = value ? strlen(value) : 0;
+    struct var **link = find_var(name, len, hash);
+    struct var *v;
+    char *entry = NULL;
+
+    if (link == NULL) {
+        return -ENOMEM;
+    }
+    if (value || *link == NULL) {
+        entry = malloc(len + value_len + 2);
+        if (entry == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(entry, name, len);
+        entry[len] = value ? '=' : '\0';
+        if (value) {
+            memcpy(entry + len + 1, value, value_len + 1);
+        }
+    }
+
+    v = *link;
+    if (v == NULL) {
+        if (num_vars >= var_buckets) {
+            grow_vars();
+            link = find_var(name, len, hash);
+        }
+        v = malloc(sizeof(struct var));
+        if (v == NULL) {
+            free(entry);
+            return -ENOMEM;
+        }
+        v->entry = NULL;
+        v->name_len = len;
+        v->hash = hash;
+        v->exported = false;
+        v->next = NULL;
+        *link = v;
+        num_vars++;
+    }
+    if (entry) {
+        free(v->entry);
+        v->entry = entry;
+    }
+    if (export && !v->exported) {
+        v->exported = true;
+        num_exported++;
+    }
+    if (v->exported) {
+        envp_valid = false;
+    }
+    return 0;
+}
+
+/* Copy the environment the shell was started with into the store. */
+static void load_env(void) {
+    env_loaded = true;
+    for (char **e = environ; e && *e; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq && is_var_name(*e, eq - *e)) {
+            store_var(*e, eq - *e, eq + 1, true);
+        }
+    }
+}
+
+/* Returns the value of the variable named by the len bytes at name,
+ * or NULL if it is not set.
+ */
+const char *get_var(const char *name, size_t len) {
+    struct var **link = find_var(name, len, hash_var(name, len));
+    if (link == NULL || *link == NULL || (*link)->entry[len] == '\0') {
+        return NULL;
+    }
+    return (*link)->entry + len + 1;
+}
+
+/* Set the variable name to value, and export it if export is set.
+ * A variable that is already exported stays exported.
+ *
+ * Returns 0 on success, -EINVAL for a bad name, -ENOMEM.
+ */
+int set_var(const char *name, const char *value, bool export) {
+    size_t len = strlen(name);
+    int rv;
+
+    if (!is_var_name(name, len)) {
+        return -EINVAL;
+    }
+    rv = store_var(name, len, value, export);
+    if (rv == 0 && strcmp(name, "PATH") == 0) {
+        rv = init_path();
+    }
+    return rv;
+}
+
+/* Remove the variable name, if it is set. */
+void unset_var(const char *name) {
+    size_t len = strlen(name);
+    struct var **link = find_var(name, len, hash_var(name, len));
+    struct var *v;
+
+    if (link == NULL || *link == NULL) {
+        return;
+    }
+    v = *link;
+    *link = v->next;
+    num_vars--;
+    if (v->exported) {
+        num_exported--;
+        envp_valid = false;
+    }
+    free(v->entry);
+    free(v);
+    if (strcmp(name, "PATH") == 0) {
+        init_path();
+    }
+}
+
+/* Remove every variable, for a command that brings an environment
+ * of its own (see serve.c).  The shell's starting environment is not
+ * loaded again.
+ */
+void clear_vars(void) {
+    for (size_t b = 0; b < var_buckets; b++) {
+        struct var *v, *next;
+        for (v = vars[b]; v; v = next) {
+            next = v->next;
+            free(v->entry);
+            free(v);
+        }
+        vars[b] = NULL;
+    }
+    env_loaded = true;
+    num_vars = num_exported = 0;
+    envp_valid = false;
+    init_path();
+}
+
+/* Returns the environment for a child: the NULL-terminated
+ * "NAME=value" entries of every exported variable that is set.  The array is
+ * owned by the store, and stays valid until a variable changes.
+ */
+char **get_envp(void) {
+    size_t n = 0;
+
+    if (!env_loaded) {
+        load_env();
+    }
+    if (envp_valid) {
+        return envp_cache;
+    }
+    char **tmp = realloc(envp_cache, (num_exported + 1) * sizeof(char *));
+    if (tmp == NULL) {
+        // Better an outdated environment than none
+        return envp_cache;
+    }
+    envp_cache = tmp;
+    for (size_t b = 0; b < var_buckets; b++) {
+        for (struct var *v = vars[b]; v; v = v->next) {
+            if (v->exported && v->entry[v->name_len]) {
+                envp_cache[n++] = v->entry;
+            }
+        }
+    }
+    envp_cache[n] = NULL;
+    envp_valid = true;
+    return envp_cache;
+}
+
+/* Returns the length of the name of an assignment "NAME=value" in
+ * word, or 0 if word is not an assignment.
+ */
+size_t assignment_name(const char *word) {
+    const char *eq = strchr(word, '=');
+    if (eq == NULL || !is_var_name(word, eq - word)) {
+        return 0;
+    }
+    return eq - word;
+}
+
+/* Returns the environment for a child started with the assignments
+ * in words (each "NAME=value") in front of it: get_envp(), with those
+ * variables replaced or added.
+ *
+ * Returns a malloc()ed array (the strings are not copied), or NULL.
+ */
+char **envp_with(char **words, int count) {
+    char **base = get_envp();
+    size_t n = 0;
+    char **envp = malloc((num_exported + count + 1) * sizeof(char *));
+
+    if (envp == NULL) {
+        return NULL;
+    }
+    for (char **e = base; e && *e; e++) {
+        size_t len = strchr(*e, '=') - *e;
+        bool replaced = false;
+        for (int i = 0; i < count && !replaced; i++) {
+            replaced = assignment_name(words[i]) == len && memcmp(words[i], *e, len + 1) == 0;
+        }
+        if (!replaced) {
+            envp[n++] = *e;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        // A later assignment to the same name wins
+        size_t len = assignment_name(words[i]);
+        bool later = false;
+        for (int k = i + 1; k < count && !later; k++) {
+            later = assignment_name(words[k]) == len && memcmp(words[i], words[k], len + 1) == 0;
+        }
+        if (!later) {
+            envp[n++] = words[i];
+        }
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Print an entry as "export NAME='value'", quoted for the shell. */
+static void print_export(outbuf *out, const char *entry) {
+    const char *eq = strchr(entry, '=');
+    const char *value = eq + 1;
+
+    out_printf(out, "export %.*s='", (int) (eq - entry), entry);
+    while (*value) {
+        size_t run = strcspn(value, "'");
+        out_write(out, value, run);
+        value += run;
+        if (*value == '\'') {
+            out_write(out, "'\\''", 4);
+            value++;
+        }
+    }
+    out_write(out, "'\n", 2);
+}
+
+/* Handle an export command.  "export NAME=value" sets and exports a
+ * variable, "export NAME" exports one (if it is not set, as soon as
+ * it is), and "export" (or "export -p") lists the exported variables.
+ */
+int handle_export(char **args, int stdin, outbuf *out, history *myhistory) {
+    int i = 1;
+
+    if (args[1] && strcmp(args[1], "-p") == 0) {
+        i++;
+    }
+    if (args[i] == NULL) {
+        char **envp = get_envp();
+        size_t n = 0;
+        while (envp && envp[n]) {
+            n++;
+        }
+        char **sorted = malloc((n + 1) * sizeof(char *));
+        if (sorted == NULL) {
+            return -1;
+        }
+        memcpy(sorted, envp, n * sizeof(char *));
+        qsort(sorted, n, sizeof(char *), compare_strings);
+        for (size_t k = 0; k < n; k++) {
+            print_export(out, sorted[k]);
+        }
+        free(sorted);
+        return 42;
+    }
+
+    for (; args[i]; i++) {
+        size_t len = assignment_name(args[i]);
+        int rv;
+        if (len) {
+            char name[len + 1];
+            memcpy(name, args[i], len);
+            name[len] = '\0';
+            rv = set_var(name, args[i] + len + 1, true);
+        } else if (is_var_name(args[i], strlen(args[i]))) {
+            rv = store_var(args[i], strlen(args[i]), NULL, true);
+        } else {
+            rv = -EINVAL;
+        }
+        if (rv == -EINVAL) {
+            dprintf(2, "export: %s: not a valid identifier\n", args[i]);
+            out->status = 1;
+        } else if (rv < 0) {
+            dprintf(2, "export: %s: %s\n", args[i], strerror(-rv));
+            out->status = 1;
+        }
+    }
+    return 42;
+}
+
+/* Handle an unset command: remove each variable named. */
+int handle_unset(char **args, int stdin, outbuf *out, history *myhistory) {
+    for (int i = 1; args[i]; i++) {
+        if (i == 1 && strcmp(args[i], "-v") == 0) {
+            continue;
+        }
+        if (!is_var_name(args[i], strlen(args[i]))) {
+            dprintf(2, "unset: %s: not a valid identifier\n", args[i]);
+            out->status = 1;
+            continue;
+        }
+        unset_var(args[i]);
+    }
+    return 42;
+}
@@ -0,0 +1,936 @@
+/* Tar Heel SHell
+ *
+ * This module implements file name expansion (globbing): '*', '?'
+ * and '[...]' in any component of a path, and '**' for any number
+ * of directories.
+ *
+ * Directory listings are read once, sorted, and kept in a small cache
+ * keyed by the directory's inode.  A listing is reused for as long as
+ * the directory's mtime does not change, so globbing the same
+ * directory over and over (e.g., in a loop) does not call readdir().
+ */
+
+#define _GNU_SOURCE
+#include "thsh.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Number of directory listings kept between command lines
+#define DIR_CACHE_SLOTS 16
+
+struct dir_entry {
+    const char *name;
+    unsigned char type;  // d_type from readdir(), may be DT_UNKNOWN
+};
+
+struct dir_snapshot {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;            // Read in the same second as the last change
+    char *path;           // Path this listing was last looked up by
+    unsigned long line;   // Command line this listing was last checked on
+    unsigned long used;   // Last use, for evicting the oldest listing
+    int pinned;           // Expansions currently walking this listing
+    struct dir_entry *entries; // Sorted by name, without "." and ".."
+    size_t count;
+    char *names;          // Storage for the entry names
+};
+
+static struct dir_snapshot dir_cache[DIR_CACHE_SLOTS];
+static unsigned long glob_line = 1;
+static unsigned long glob_clock = 0;
+
+/* Start a new command line.
+ *
+ * A directory listing is only checked against the file system once
+ * per line, so that every glob on the line sees the same snapshot.
+ */
+void glob_new_line(void) {
+    glob_line++;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct dir_entry *) a)->name,
+                  ((const struct dir_entry *) b)->name);
+}
+
+static void free_snapshot(struct dir_snapshot *d) {
+    free(d->entries);
+    free(d->names);
+    free(d->path);
+    memset(d, 0, sizeof(*d));
+}
+
+/* Read the directory at path, which stat() described as sb, into d.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int read_snapshot(struct dir_snapshot *d, const char *path, struct stat *sb) {
+    size_t names_len = 0, names_cap = 4096, cap = 64;
+    struct timespec now;
+    struct dirent *de;
+    size_t *offsets;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -errno;
+    }
+    d->names = malloc(names_cap);
+    d->entries = malloc(cap * sizeof(struct dir_entry));
+    offsets = malloc(cap * sizeof(size_t));
+    d->path = strdup(path);
+    if (!d->names || !d->entries || !offsets || !d->path) {
+        goto nomem;
+    }
+
+    // The name buffer may move as it grows; keep offsets until the end
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name) + 1;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (d->count == cap) {
+            void *e = realloc(d->entries, 2 * cap * sizeof(struct dir_entry));
+            void *o = e ? realloc(offsets, 2 * cap * sizeof(size_t)) : NULL;
+            if (e) {
+                d->entries = e;
+            }
+            if (o == NULL) {
+                goto nomem;
+            }
+            offsets = o;
+            cap *= 2;
+        }
+        if (names_len + len > names_cap) {
+            char *tmp;
+            while (names_len + len > names_cap) {
+                names_cap *= 2;
+            }
+            tmp = realloc(d->names, names_cap);
+            if (tmp == NULL) {
+                goto nomem;
+            }
+            d->names = tmp;
+        }
+        memcpy(d->names + names_len, de->d_name, len);
+        offsets[d->count] = names_len;
+        d->entries[d->count].type = de->d_type;
+        d->count++;
+        names_len += len;
+    }
+    closedir(dir);
+
+    for (size_t i = 0; i < d->count; i++) {
+        d->entries[i].name = d->names + offsets[i];
+    }
+    free(offsets);
+    qsort(d->entries, d->count, sizeof(struct dir_entry), compare_entries);
+
+    d->dev = sb->st_dev;
+    d->ino = sb->st_ino;
+    d->mtime = sb->st_mtim;
+    // A change later in the same second may not move the mtime on
+    // file systems with coarse timestamps, so do not trust it yet
+    clock_gettime(CLOCK_REALTIME, &now);
+    d->racy = now.tv_sec <= sb->st_mtim.tv_sec;
+    return 0;
+
+nomem:
+    closedir(dir);
+    free(offsets);
+    free_snapshot(d);
+    return -ENOMEM;
+}
+
+/* Find the listing of the directory at path, reading it if it is not
+ * cached or has changed since.  The listing is pinned until
+ * release_snapshot() is called.
+ *
+ * Returns NULL if path is not a readable directory.
+ */
+static struct dir_snapshot *get_snapshot(const char *path) {
+    struct dir_snapshot *d = NULL;
+    struct stat sb;
+
+    // Already checked on this line
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (dir_cache[i].line == glob_line && strcmp(dir_cache[i].path, path) == 0) {
+            d = &dir_cache[i];
+            goto found;
+        }
+    }
+
+    if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+        return NULL;
+    }
+
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (dir_cache[i].names && dir_cache[i].dev == sb.st_dev
+                && dir_cache[i].ino == sb.st_ino) {
+            d = &dir_cache[i];
+            break;
+        }
+    }
+    if (d && !d->racy && d->mtime.tv_sec == sb.st_mtim.tv_sec
+            && d->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+        // Unchanged; it may just have been reached by another name
+        if (strcmp(d->path, path) != 0) {
+            char *tmp = strdup(path);
+            if (tmp == NULL) {
+                return NULL;
+            }
+            free(d->path);
+            d->path = tmp;
+        }
+        d->line = glob_line;
+        goto found;
+    }
+    if (d && d->pinned) {
+        // Changed under an expansion that is still walking it
+        return NULL;
+    }
+
+    // Reread into the stale slot, else an empty or the oldest one
+    if (d == NULL) {
+        for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+            if (dir_cache[i].pinned) {
+                continue;
+            }
+            if (d == NULL || dir_cache[i].used < d->used) {
+                d = &dir_cache[i];
+            }
+        }
+        if (d == NULL) {
+            return NULL;
+        }
+    }
+    free_snapshot(d);
+    if (read_snapshot(d, path, &sb) < 0) {
+        return NULL;
+    }
+    d->line = glob_line;
+
+found:
+    d->used = ++glob_clock;
+    d->pinned++;
+    return d;
+}
+
+static void release_snapshot(struct dir_snapshot *d) {
+    d->pinned--;
+}
+
+/* Match the bracket expression at p (pointing to the '[') against c.
+ *
+ * Returns a pointer just past the closing ']' and sets *matched,
+ * or NULL if there is no closing ']' (the '[' is then an ordinary
+ * character).
+ */
+static const char *match_bracket(const char *p, char c, bool *matched) {
+    bool negate = false, found = false;
+    const char *first;
+
+    p++;
+    if (*p == '!' || *p == '^') {
+        negate = true;
+        p++;
+    }
+    // A ']' right at the start is part of the set
+    first = p;
+    while (*p && (*p != ']' || p == first)) {
+        unsigned char lo, hi;
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        lo = hi = *p;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            p += 2;
+            if (*p == '\\' && p[1]) {
+                p++;
+            }
+            hi = *p;
+        }
+        if (lo <= (unsigned char) c && (unsigned char) c <= hi) {
+            found = true;
+        }
+        p++;
+    }
+    if (*p != ']') {
+        return NULL;
+    }
+    *matched = found != negate;
+    return p + 1;
+}
+
+/* Check if a file name matches a glob.
+ *
+ * This function takes in a glob without '/' (such as '*.[ch]')
+ * and a file name, and returns true if it matches.
+ *
+ * A '*' that fails to match is retried one character further along,
+ * so the match takes at most (pattern length) * (name length) steps.
+ */
+static bool glob_matches(const char *p, const char *name) {
+    const char *star = NULL, *star_name = NULL;
+
+    while (*name) {
+        const char *next = p + 1;
+        bool ok;
+
+        switch (*p) {
+        case '*':
+            star = ++p;
+            star_name = name;
+            continue;
+        case '?':
+            ok = true;
+            break;
+        case '[':
+            next = match_bracket(p, *name, &ok);
+            if (next == NULL) {
+                next = p + 1;
+                ok = *name == '[';
+            }
+            break;
+        case '\\':
+            if (p[1]) {
+                next = p + 2;
+                ok = p[1] == *name;
+            } else {
+                ok = *name == '\\';
+            }
+            break;
+        case '\0':
+            ok = false;
+            break;
+        default:
+            ok = *p == *name;
+        }
+
+        if (ok) {
+            p = next;
+            name++;
+        } else if (star) {
+            p = star;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*p == '*') {
+        p++;
+    }
+    return *p == '\0';
+}
+
+/* Check if word contains any special glob characters.
+ *
+ * A '[' only counts if a ']' follows it.
+ */
+bool has_glob(const char *word) {
+    for (const char *p = word; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '*' || *p == '?') {
+            return true;
+        } else if (*p == '[' && strchr(p + 1, ']')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Recursive '**' expansion.
+ *
+ * The directory tree below a '**' is walked by a pool of threads.
+ * Each worker owns a deque of directories still to be read: it pushes
+ * the subdirectories it finds and pops them back from the same end
+ * (depth first), while idle workers steal from the other end, which
+ * holds the oldest and usually largest subtrees.  A worker that finds
+ * nothing to steal sleeps until more directories are queued or the
+ * walk is over.  Directories are read
+ * with getdents64() into a large buffer, and every worker keeps the
+ * paths it finds in its own arena.  The results are merged and sorted
+ * once the walk is done, so the order does not depend on scheduling.
+ */
+
+// Bytes of directory entries requested per getdents64() call
+#define WALK_DENTS_SIZE (256 * 1024)
+
+// Upper bound on the default number of walker threads
+#define WALK_MAX_THREADS 16
+
+struct walker;
+
+struct walk_worker {
+    pthread_t thread;
+    struct walker *w;
+    int id;
+    pthread_mutex_t lock;     // Protects the deque
+    char **queue;             // Directories to read, [head, tail)
+    size_t head;              // Thieves take from here
+    size_t tail;              // The owner pushes and pops here
+    size_t queue_cap;
+    arena arena;              // Paths found by this worker
+    char **results;
+    size_t count;
+    size_t results_cap;
+    char *dents;
+    int err;
+};
+
+struct walker {
+    const char *tail;         // Pattern for entries, or NULL to collect directories
+    struct walk_worker *workers;
+    int num_workers;
+    atomic_long pending;      // Directories queued or being read
+    atomic_int idle;          // Workers waiting for work
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work;      // Signalled when a directory is queued, or pending reaches 0
+    char **results;           // Merged and sorted, after walk_tree()
+    size_t count;
+};
+
+// Walker threads; 0 picks one per online CPU
+static int glob_threads = 0;
+
+/* Set the number of threads used to expand '**'.
+ *
+ * threads: 0 for one per online CPU (at most WALK_MAX_THREADS).
+ */
+void glob_set_threads(int threads) {
+    glob_threads = threads < 0 ? 0 : threads;
+}
+
+/* Copy dir (which is empty or ends in '/') followed by name and, if
+ * slash is set, a '/' into the worker's arena.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+static char *arena_path(struct walk_worker *me, const char *dir, const char *name, bool slash) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    size_t len = dir_len + name_len + slash + 1;
+    char *s = arena_alloc(&me->arena, len);
+
+    if (s == NULL) {
+        return NULL;
+    }
+    memcpy(s, dir, dir_len);
+    memcpy(s + dir_len, name, name_len);
+    if (slash) {
+        s[dir_len + name_len] = '/';
+    }
+    s[len - 1] = '\0';
+    return s;
+}
+
+static int add_result(struct walk_worker *me, char *path) {
+    if (me->count == me->results_cap) {
+        size_t cap = me->results_cap ? 2 * me->results_cap : 256;
+        char **tmp = realloc(me->results, cap * sizeof(char *));
+        if (tmp == NULL) {
+            return -ENOMEM;
+        }
+        me->results = tmp;
+        me->results_cap = cap;
+    }
+    me->results[me->count++] = path;
+    return 0;
+}
+
+/* Queue the directory dir on the worker's own deque. */
+static int push_dir(struct walk_worker *me, char *dir) {
+    int rv = 0;
+
+    atomic_fetch_add(&me->w->pending, 1);
+    pthread_mutex_lock(&me->lock);
+    if (me->tail == me->queue_cap) {
+        if (me->head > 0) {
+            memmove(me->queue, me->queue + me->head, (me->tail - me->head) * sizeof(char *));
+            me->tail -= me->head;
+            me->head = 0;
+        } else {
+            size_t cap = me->queue_cap ? 2 * me->queue_cap : 256;
+            char **tmp = realloc(me->queue, cap * sizeof(char *));
+            if (tmp == NULL) {
+                rv = -ENOMEM;
+            } else {
+                me->queue = tmp;
+                me->queue_cap = cap;
+            }
+        }
+    }
+    if (rv == 0) {
+        me->queue[me->tail++] = dir;
+    }
+    pthread_mutex_unlock(&me->lock);
+
+    if (rv) {
+        atomic_fetch_sub(&me->w->pending, 1);
+    } else if (atomic_load(&me->w->idle) > 0) {
+        pthread_mutex_lock(&me->w->idle_lock);
+        pthread_cond_signal(&me->w->work);
+        pthread_mutex_unlock(&me->w->idle_lock);
+    }
+    return rv;
+}
+
+/* Take the next directory from the worker's own deque, or failing that,
+ * steal the oldest one from another worker.
+ *
+ * Returns NULL if there is nothing to take right now.
+ */
+static char *take_dir(struct walk_worker *me) {
+    struct walker *w = me->w;
+    char *dir = NULL;
+
+    pthread_mutex_lock(&me->lock);
+    if (me->head < me->tail) {
+        dir = me->queue[--me->tail];
+    }
+    pthread_mutex_unlock(&me->lock);
+
+    for (int i = 1; dir == NULL && i < w->num_workers; i++) {
+        struct walk_worker *victim = &w->workers[(me->id + i) % w->num_workers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            dir = victim->queue[victim->head++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return dir;
+}
+
+/* Read the directory dir (empty, or ending in '/'): queue its
+ * subdirectories and record the entries the walk is looking for.
+ * Hidden directories are not descended into, and symbolic links
+ * are not followed.
+ */
+static void read_dir(struct walk_worker *me, const char *dir) {
+    const char *tail = me->w->tail;
+    int fd = open(*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd < 0) {
+        return;
+    }
+    while ((n = getdents64(fd, me->dents, WALK_DENTS_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n && !me->err; ) {
+            struct dirent64 *de = (struct dirent64 *) (me->dents + off);
+            const char *name = de->d_name;
+            unsigned char type = de->d_type;
+            char *path;
+
+            off += de->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (type == DT_UNKNOWN) {
+                struct stat sb;
+                if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode)) {
+                    type = DT_DIR;
+                }
+            }
+
+            if (type == DT_DIR && name[0] != '.') {
+                path = arena_path(me, dir, name, true);
+                if (path == NULL || push_dir(me, path) < 0
+                        || (tail == NULL && add_result(me, path) < 0)) {
+                    me->err = -ENOMEM;
+                }
+            }
+            if (tail && (name[0] != '.' || tail[0] == '.') && glob_matches(tail, name)) {
+                path = arena_path(me, dir, name, false);
+                if (path == NULL || add_result(me, path) < 0) {
+                    me->err = -ENOMEM;
+                }
+            }
+        }
+    }
+    close(fd);
+}
+
+/* Sleep until there is a directory to take, while others are still
+ * reading directories that may add some.
+ *
+ * Returns the directory, or NULL once the walk is done.
+ */
+static char *wait_for_dir(struct walk_worker *me) {
+    struct walker *w = me->w;
+    char *dir;
+
+    pthread_mutex_lock(&w->idle_lock);
+    // Counted as idle before looking again, so that a push_dir() from
+    // now on signals us
+    atomic_fetch_add(&w->idle, 1);
+    while ((dir = take_dir(me)) == NULL && atomic_load(&w->pending) > 0) {
+        pthread_cond_wait(&w->work, &w->idle_lock);
+    }
+    atomic_fetch_sub(&w->idle, 1);
+    pthread_mutex_unlock(&w->idle_lock);
+    return dir;
+}
+
+static void *walk_worker_main(void *arg) {
+    struct walk_worker *me = arg;
+    struct walker *w = me->w;
+
+    for (;;) {
+        char *dir = take_dir(me);
+        if (dir == NULL) {
+            dir = wait_for_dir(me);
+            if (dir == NULL) {
+                break;
+            }
+        }
+        read_dir(me, dir);
+        if (atomic_fetch_sub(&w->pending, 1) == 1) {
+            // That was the last one: let the idle workers finish
+            pthread_mutex_lock(&w->idle_lock);
+            pthread_cond_broadcast(&w->work);
+            pthread_mutex_unlock(&w->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+static void free_walk(struct walker *w) {
+    for (int i = 0; i < w->num_workers; i++) {
+        struct walk_worker *me = &w->workers[i];
+        arena_free(&me->arena);
+        pthread_mutex_destroy(&me->lock);
+        free(me->queue);
+        free(me->results);
+        free(me->dents);
+    }
+    free(w->workers);
+    free(w->results);
+    pthread_mutex_destroy(&w->idle_lock);
+    pthread_cond_destroy(&w->work);
+    w->workers = NULL;
+    w->results = NULL;
+}
+
+static int compare_matches(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Walk the tree below root (empty, or ending in '/') with the walker
+ * threads.
+ *
+ * tail: Record every entry whose name matches this pattern, at any
+ *       depth (including root's own entries).  If NULL, record every
+ *       directory below root instead, with a trailing '/'.
+ *
+ * On success, w->results holds w->count paths in sorted order, until
+ * free_walk() is called.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int walk_tree(struct walker *w, const char *root, const char *tail) {
+    int threads = glob_threads;
+    int err = 0;
+    size_t total = 0;
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > WALK_MAX_THREADS ? WALK_MAX_THREADS : cpus;
+    }
+
+    memset(w, 0, sizeof(*w));
+    w->tail = tail;
+    atomic_init(&w->pending, 0);
+    atomic_init(&w->idle, 0);
+    w->workers = calloc(threads, sizeof(struct walk_worker));
+    if (w->workers == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&w->idle_lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    w->num_workers = threads;
+    for (int i = 0; i < threads; i++) {
+        struct walk_worker *me = &w->workers[i];
+        me->w = w;
+        me->id = i;
+        pthread_mutex_init(&me->lock, NULL);
+        me->dents = malloc(WALK_DENTS_SIZE);
+        if (me->dents == NULL) {
+            err = -ENOMEM;
+        }
+    }
+    if (err == 0) {
+        char *start = arena_path(&w->workers[0], root, "", false);
+        err = start ? push_dir(&w->workers[0], start) : -ENOMEM;
+    }
+    if (err) {
+        free_walk(w);
+        return err;
+    }
+
+    // The calling thread is worker 0
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&w->workers[i].thread, NULL, walk_worker_main, &w->workers[i])) {
+            // Fewer threads only make the walk slower
+            w->workers[i].thread = 0;
+        }
+    }
+    walk_worker_main(&w->workers[0]);
+    for (int i = 1; i < threads; i++) {
+        if (w->workers[i].thread) {
+            pthread_join(w->workers[i].thread, NULL);
+        }
+    }
+
+    for (int i = 0; i < threads; i++) {
+        total += w->workers[i].count;
+        if (w->workers[i].err) {
+            err = w->workers[i].err;
+        }
+    }
+    w->results = malloc((total ? total : 1) * sizeof(char *));
+    if (err == 0 && w->results == NULL) {
+        err = -ENOMEM;
+    }
+    if (err) {
+        free_walk(w);
+        return err;
+    }
+    for (int i = 0; i < threads; i++) {
+        memcpy(w->results + w->count, w->workers[i].results,
+               w->workers[i].count * sizeof(char *));
+        w->count += w->workers[i].count;
+    }
+    qsort(w->results, w->count, sizeof(char *), compare_matches);
+    return 0;
+}
+
+struct glob_state {
+    arena *arena;       // Where the matches are copied
+    wordlist *matches;
+    int err;
+    char path[PATH_MAX];
+};
+
+/* Copy a match (len bytes of path) into the arena and record it. */
+static void add_match(struct glob_state *g, const char *path, size_t len) {
+    char *match;
+
+    if (g->err) {
+        return;
+    }
+    match = arena_alloc(g->arena, len + 1);
+    if (match == NULL || wordlist_add(g->matches, match) < 0) {
+        g->err = -ENOMEM;
+        return;
+    }
+    memcpy(match, path, len);
+    match[len] = '\0';
+}
+
+/* Check if entry e of the directory at g->path (whose name is already
+ * appended there, up to len) is a directory, or a link to one.
+ */
+static bool is_directory(struct glob_state *g, const struct dir_entry *e) {
+    struct stat sb;
+    if (e->type == DT_DIR) {
+        return true;
+    }
+    if (e->type != DT_UNKNOWN && e->type != DT_LNK) {
+        return false;
+    }
+    return stat(g->path, &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+static void expand_from(struct glob_state *g, size_t len, const char *pattern);
+
+/* Expand a '**' component followed by rest (NULL if the '**' ends the
+ * glob), below the directory in g->path (len bytes long).
+ *
+ * Like bash's globstar, '**' alone matches every file and directory
+ * below, and '**' followed by '/' matches every directory below.
+ */
+static void expand_globstar(struct glob_state *g, size_t len, const char *rest) {
+    struct walker w;
+    const char *tail = NULL;
+    int rv;
+
+    if (rest == NULL) {
+        tail = "*";
+    } else if (*rest && strchr(rest, '/') == NULL) {
+        // The common '**/*.c': match while walking
+        tail = rest;
+    }
+    rv = walk_tree(&w, g->path, tail);
+    if (rv < 0) {
+        g->err = rv;
+        return;
+    }
+
+    if (rest == NULL && len > 1) {
+        // Matching no directory at all leaves the directory itself
+        add_match(g, g->path, len - 1);
+    }
+    if (tail || *rest == '\0') {
+        for (size_t i = 0; i < w.count && !g->err; i++) {
+            add_match(g, w.results[i], strlen(w.results[i]));
+        }
+    } else {
+        // '**' may match no directory at all, so start at the top
+        expand_from(g, len, rest);
+        for (size_t i = 0; i < w.count && !g->err; i++) {
+            size_t dir_len = strlen(w.results[i]);
+            if (dir_len + 1 < PATH_MAX) {
+                memcpy(g->path, w.results[i], dir_len + 1);
+                expand_from(g, dir_len, rest);
+            }
+        }
+    }
+    free_walk(&w);
+}
+
+/* Expand pattern, the rest of a glob, below the directory in
+ * g->path (len bytes long, ending in '/' unless empty).
+ */
+static void expand_from(struct glob_state *g, size_t len, const char *pattern) {
+    const char *slash = strchr(pattern, '/');
+    size_t comp_len = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    const char *rest = NULL;
+    char comp[NAME_MAX + 1];
+    struct dir_snapshot *d;
+
+    if (comp_len > NAME_MAX) {
+        return;
+    }
+    memcpy(comp, pattern, comp_len);
+    comp[comp_len] = '\0';
+    if (slash) {
+        rest = slash;
+        while (*rest == '/') {
+            rest++;
+        }
+    }
+
+    if (strcmp(comp, "**") == 0) {
+        expand_globstar(g, len, rest);
+        return;
+    }
+
+    if (!has_glob(comp)) {
+        // A plain name needs no listing, only to exist
+        struct stat sb;
+        for (size_t i = 0; i < comp_len; i++) {
+            if (comp[i] == '\\' && comp[i + 1]) {
+                i++;
+            }
+            if (len + 2 >= PATH_MAX) {
+                return;
+            }
+            g->path[len++] = comp[i];
+        }
+        g->path[len] = '\0';
+        if (rest == NULL) {
+            if (lstat(g->path, &sb) == 0) {
+                add_match(g, g->path, len);
+            }
+            return;
+        }
+        g->path[len++] = '/';
+        g->path[len] = '\0';
+        if (*rest) {
+            expand_from(g, len, rest);
+        } else if (stat(g->path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            add_match(g, g->path, len);
+        }
+        return;
+    }
+
+    d = get_snapshot(len ? g->path : ".");
+    if (d == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < d->count && !g->err; i++) {
+        const struct dir_entry *e = &d->entries[i];
+        size_t name_len;
+
+        // Hidden files only match a pattern that starts with a '.'
+        if (e->name[0] == '.' && comp[0] != '.') {
+            continue;
+        }
+        if (!glob_matches(comp, e->name)) {
+            continue;
+        }
+        name_len = strlen(e->name);
+        if (len + name_len + 2 >= PATH_MAX) {
+            continue;
+        }
+        memcpy(g->path + len, e->name, name_len + 1);
+        if (rest == NULL) {
+            add_match(g, g->path, len + name_len);
+        } else if (is_directory(g, e)) {
+            g->path[len + name_len] = '/';
+            g->path[len + name_len + 1] = '\0';
+            if (*rest) {
+                expand_from(g, len + name_len + 1, rest);
+            } else {
+                add_match(g, g->path, len + name_len + 1);
+            }
+        }
+    }
+    release_snapshot(d);
+}
+
+/* Expand a file glob.
+ *
+ * This function takes in a glob (such as '*.c' or 'src/[a-m]*.h')
+ * and appends all matching files to matches, in sorted order.
+ * If the glob does not match anything, it returns 0, and the caller
+ * should pass the glob through to the application as an argument.
+ *
+ * a: The arena the matches are copied into.
+ *
+ * Returns the number of matches on success, -errno on error
+ */
+int expand_glob(const char *glob, arena *a, wordlist *matches) {
+    struct glob_state *g = malloc(sizeof(struct glob_state));
+    size_t first = matches->count;
+    size_t len = 0;
+    int rv;
+
+    if (g == NULL) {
+        return -ENOMEM;
+    }
+    g->arena = a;
+    g->matches = matches;
+    g->err = 0;
+    g->path[0] = '\0';
+
+    if (glob[0] == '/') {
+        g->path[len++] = '/';
+        g->path[len] = '\0';
+        while (*glob == '/') {
+            glob++;
+        }
+    }
+    expand_from(g, len, glob);
+
+    // Each directory is sorted, but "a-b/x" sorts before "a/x"
+    for (size_t i = first + 1; i < matches->count; i++) {
+        if (strcmp(matches->words[i - 1], matches->words[i]) > 0) {
+            qsort(matches->words + first, matches->count - first, sizeof(char *), compare_matches);
+            break;
+        }
+    }
+    rv = g->err ? g->err : (int) (matches->count - first);
+    if (g->err) {
+        matches->count = first;
+    }
+    free(g);
+    return rv;
+}
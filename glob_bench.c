@@ -0,0 +1,110 @@
+/* Tar Heel SHell
+ *
+ * This file is a benchmark for recursive glob expansion.
+ * It builds a synthetic source tree in a temporary directory,
+ * then times expanding a recursive glob of all .c files with a growing
+ * number of walker threads.
+ *
+ * Usage: glob_bench [depth [fanout [files per directory]]]
+ */
+#define _GNU_SOURCE
+#include "thsh.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define DEFAULT_DEPTH  5
+#define DEFAULT_FANOUT 6
+#define DEFAULT_FILES  8
+#define RUNS 3
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the number of directories created
+static long build_tree(const char *dir, int depth, int fanout, int files) {
+  char path[4096];
+  long dirs = 1;
+
+  mkdir(dir, 0755);
+  for (int i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "%s/file%d.%s", dir, i, i % 2 ? "c" : "h");
+    close(open(path, O_WRONLY | O_CREAT, 0644));
+  }
+  if (depth > 0) {
+    for (int i = 0; i < fanout; i++) {
+      snprintf(path, sizeof(path), "%s/dir%d", dir, i);
+      dirs += build_tree(path, depth - 1, fanout, files);
+    }
+  }
+  return dirs;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(int argc, char **argv) {
+  int depth = argc > 1 ? atoi(argv[1]) : DEFAULT_DEPTH;
+  int fanout = argc > 2 ? atoi(argv[2]) : DEFAULT_FANOUT;
+  int files = argc > 3 ? atoi(argv[3]) : DEFAULT_FILES;
+  int thread_counts[] = { 1, 2, 4, 8, 16 };
+  char root[] = "/tmp/glob_bench.XXXXXX";
+  arena a;
+  wordlist matches;
+  double base = 0;
+  long dirs;
+
+  if (mkdtemp(root) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  dirs = build_tree(root, depth, fanout, files);
+  if (chdir(root) < 0) {
+    perror("chdir");
+    return 1;
+  }
+
+  memset(&a, 0, sizeof(a));
+  memset(&matches, 0, sizeof(matches));
+
+  printf("%ld directories, %ld files, %ld online CPUs\n",
+         dirs, dirs * files, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%8s %10s %8s %10s\n", "threads", "ms", "speedup", "matches");
+  for (int t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); t++) {
+    double best = 0;
+    int rv = 0;
+
+    glob_set_threads(thread_counts[t]);
+    // The first run also warms the dentry cache
+    for (int run = 0; run <= RUNS; run++) {
+      double start = now();
+      arena_reset(&a);
+      matches.count = 0;
+      rv = expand_glob("**/*.c", &a, &matches);
+      start = now() - start;
+      if (run > 0 && (best == 0 || start < best)) {
+        best = start;
+      }
+    }
+    if (rv < 0) {
+      printf("expand_glob failed: %d\n", rv);
+      break;
+    }
+    if (base == 0) {
+      base = best;
+    }
+    printf("%8d %10.1f %8.2f %10d\n", thread_counts[t], best * 1e3, base / best, rv);
+  }
+
+  if (chdir("/") == 0) {
+    nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  }
+  return 0;
+}
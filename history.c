@@ -2,42 +2,123 @@
  *
  * This module implements tracking, saving, clearing, and restoring command history.
  *
+ * Entries are kept back to back in one growable text buffer, each ending
+ * in a newline, exactly as they appear in the .history file, with an
+ * array of offsets to find each one.  Loading is a bulk read of the file
+ * into that buffer, and saving appends only the entries that are new.
+ * A trigram index on top of it backs reverse search (Ctrl-R).
  */
 
+#define _GNU_SOURCE
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include "thsh.h"
 
-/* Add a line to the history
+#define HISTORY_FILE ".history"
+#define HISTORY_READ_BLOCK 65536
+// Entries the background indexer adds per turn of the lock
+#define INDEX_BATCH 1024
+
+// Guards the history text, offsets and index against the background
+// indexer (see index_history()); only the main thread ever changes them
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+// Whether the background indexer is still running
+static bool indexing = false;
+
+static int update_history_index(history *myhistory, size_t batch);
+
+/* Make room for extra more bytes of text and one more entry.
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+static int reserve_history(history *myhistory, size_t extra) {
+    if (myhistory->text_len + extra > myhistory->text_cap) {
+        size_t cap = myhistory->text_cap ? myhistory->text_cap : 4096;
+        while (cap < myhistory->text_len + extra) {
+            cap *= 2;
+        }
+        char *text = realloc(myhistory->text, cap);
+        if (text == NULL) {
+            return -ENOMEM;
+        }
+        myhistory->text = text;
+        myhistory->text_cap = cap;
+    }
+    if (myhistory->count == myhistory->offsets_cap) {
+        size_t cap = myhistory->offsets_cap ? myhistory->offsets_cap * 2 : 256;
+        size_t *offsets = realloc(myhistory->offsets, cap * sizeof(size_t));
+        if (offsets == NULL) {
+            return -ENOMEM;
+        }
+        myhistory->offsets = offsets;
+        myhistory->offsets_cap = cap;
+    }
+    return 0;
+}
+
+/* Returns entry i (0 is the oldest), and its length without the
+ * trailing newline in *len.  The entry is not null terminated.
+ */
+const char *history_entry(history *myhistory, size_t i, size_t *len) {
+    size_t start = myhistory->offsets[i];
+    size_t end = (i + 1 < myhistory->count) ? myhistory->offsets[i + 1] : myhistory->text_len;
+    *len = end - start - 1;
+    return myhistory->text + start;
+}
+
+/* Add a line to the history.  The line may span several lines, with
+ * the bodies of its here-documents; only the final newline is dropped.
 */
 void add_history_line(char *line, history *myhistory) {
-    // Add the character at idx in arr and increment idx
-    strcpy(myhistory->arr[myhistory->idx], line);
-    myhistory->idx = (myhistory->idx == 49) ? 0 : myhistory->idx + 1;
-    myhistory->valid_entries = (myhistory->valid_entries == 50) ? myhistory->valid_entries : myhistory->valid_entries + 1;
-}
+    size_t len = strlen(line);
 
-int clear_history(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory) {
-    myhistory->idx = 0;
-    myhistory->valid_entries = 0;
+    if (len && line[len - 1] == '\n') {
+        len--;
+    }
 
-    return 42;
+    if (len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&history_lock);
+    if (reserve_history(myhistory, len + 1) == 0) {
+        myhistory->offsets[myhistory->count++] = myhistory->text_len;
+        memcpy(myhistory->text + myhistory->text_len, line, len);
+        myhistory->text_len += len;
+        myhistory->text[myhistory->text_len++] = '\n';
+        // Index the new entry, unless the indexer has yet to get there
+        if (myhistory->index && !indexing) {
+            update_history_index(myhistory, SIZE_MAX);
+        }
+    }
+    pthread_mutex_unlock(&history_lock);
 }
 
+int clear_history(char **args, int stdin, outbuf *out, history *myhistory) {
+    if (myhistory == NULL) {
+        return 42;
+    }
+    pthread_mutex_lock(&history_lock);
+    myhistory->count = 0;
+    myhistory->text_len = 0;
+    myhistory->saved = 0;
+    free_history_index(myhistory);
+    pthread_mutex_unlock(&history_lock);
+    if (myhistory->fd >= 0) {
+        ftruncate(myhistory->fd, 0);
+    }
 
-int print_history(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory) {
-    // Starting at idx, decrement backwards until you valid entries is 0
-    int history_len = myhistory->valid_entries;
-    int idx = (myhistory->idx - history_len) % 50;
+    return 42;
+}
 
-    while (history_len > 0) {
-        write(stdout, myhistory->arr[idx], strlen(myhistory->arr[idx]));
 
-        idx++;
-        if (idx == 50) idx=0;
-        history_len--;
+int print_history(char **args, int stdin, outbuf *out, history *myhistory) {
+    // The entries are already laid out as lines; write them in one go
+    if (myhistory) {
+        out_write(out, myhistory->text, myhistory->text_len);
     }
 
     return 42;
@@ -47,38 +128,417 @@ int print_history(char *args[MAX_ARGS], int stdin, int stdout, history *myhistor
 
 
 int save_history(history *myhistory) {
-    // Saves the history in thsh_history.txt
-    // Idea: call this function in exit();
+    // Appends the entries added since the last save to .history,
+    // with a single write.
+    size_t start;
 
-    // Starting at idx, decrement backwards until you valid entries is 0
-    remove(".history");
-    int history_len = myhistory->valid_entries;
-    int idx = (myhistory->idx - history_len) % 50;
+    if (myhistory->fd < 0 || myhistory->saved == myhistory->count) {
+        return 0;
+    }
+    start = myhistory->offsets[myhistory->saved];
+    if (write(myhistory->fd, myhistory->text + start, myhistory->text_len - start) < 0) {
+        return -errno;
+    }
+    myhistory->saved = myhistory->count;
+    return 0;
+}
 
-    // Create a fd to reference thsh_history.txt
-    int fileh = open(".history", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND);
+int load_history(history *myhistory) {
+    // Loads the history from .history, and keeps the file open for
+    // appending, so it stays the same file after a cd.
+    struct stat sb;
+    arena scratch = { NULL, NULL, 0 };
+    ssize_t rv;
 
-    while (history_len > 0) {
-        write(fileh, myhistory->arr[idx], strlen(myhistory->arr[idx]));
+    memset(myhistory, 0, sizeof(*myhistory));
+    myhistory->fd = open(HISTORY_FILE, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (myhistory->fd < 0) {
+        return -errno;
+    }
 
-        idx++;
-        if (idx == 50) idx=0;
-        history_len--;
+    // Read the whole file into the text buffer in large blocks
+    if (fstat(myhistory->fd, &sb) == 0 && sb.st_size > 0) {
+        myhistory->text = malloc(sb.st_size + 1);
+        if (myhistory->text == NULL) {
+            return -ENOMEM;
+        }
+        myhistory->text_cap = sb.st_size + 1;
     }
-    close(fileh);
+    do {
+        // Keep a byte spare for a missing final newline
+        if (myhistory->text_cap - myhistory->text_len < 2
+                && reserve_history(myhistory, HISTORY_READ_BLOCK) < 0) {
+            return -ENOMEM;
+        }
+        rv = read(myhistory->fd, myhistory->text + myhistory->text_len,
+                myhistory->text_cap - myhistory->text_len - 1);
+        if (rv > 0) {
+            myhistory->text_len += rv;
+        }
+    } while (rv > 0 || (rv < 0 && errno == EINTR));
+
+    // A file cut off mid-line still gets a final newline
+    if (myhistory->text_len && myhistory->text[myhistory->text_len - 1] != '\n') {
+        myhistory->text[myhistory->text_len++] = '\n';
+    }
+
+    // The parser needs the text null terminated
+    if (reserve_history(myhistory, 1) < 0) {
+        return -ENOMEM;
+    }
+    myhistory->text[myhistory->text_len] = '\0';
+
+    // Index the start of every entry: every line, except the bodies of
+    // the here-documents of an entry, which belong to it
+    for (size_t pos = 0; pos < myhistory->text_len; ) {
+        char *newline = memchr(myhistory->text + pos, '\n', myhistory->text_len - pos);
+        size_t end = newline - myhistory->text + 1;
+        if (reserve_history(myhistory, 0) < 0) {
+            arena_free(&scratch);
+            return -ENOMEM;
+        }
+        if (memmem(myhistory->text + pos, end - pos, "<<", 2)) {
+            char *tokens;
+            size_t used = 0;
+            if (compile_command(myhistory->text + pos, myhistory->text_len - pos,
+                        &scratch, &tokens, &used) >= 0 && pos + used > end) {
+                end = pos + used;
+            }
+            arena_reset(&scratch);
+        }
+        myhistory->offsets[myhistory->count++] = pos;
+        pos = end;
+    }
+    arena_free(&scratch);
+    myhistory->saved = myhistory->count;
+
     return 0;
 }
 
-int load_history(history *myhistory) {
-    // Loads the history from thsh_history.txt
-    FILE *file = fopen(".history", "r");
-    char line[MAX_ARGS];
-    if (file == NULL) return 0;
-    while(fgets(line, sizeof(line), file) != NULL) {
-        // Put the line in the appropriate array entry
-        char *buf = &line[0];
-        add_history_line(buf, myhistory);
+
+/* Trigram index over the history, for reverse search.
+ *
+ * Every distinct three-byte sequence in an entry maps to a posting list
+ * of the entries that contain it, in ascending order.  A query of three
+ * or more bytes only has to look at the entries that appear in the
+ * lists of all of its trigrams, newest first, and confirm each with
+ * memmem().
+ *
+ * An interactive shell builds the index in the background as soon as
+ * the history is loaded (see index_history()), and add_history_line()
+ * adds each new entry to it, so no keystroke ever waits for a build.
+ * A search that comes before the background build is done finishes it
+ * first; so does the first search of a shell that never started one.
+ */
+struct posting {
+    uint32_t key;    // Trigram + 1, or 0 for an empty slot
+    uint32_t len;
+    uint32_t cap;
+    uint32_t *ids;   // Entries containing the trigram, ascending
+};
+
+struct history_index {
+    struct posting *slots; // Open addressing table, power of two sized
+    size_t num_slots;
+    size_t used;
+    size_t indexed;        // Entries [0, indexed) are in the index
+};
+
+static uint32_t trigram_key(const char *p) {
+    return (((uint32_t)(unsigned char) p[0] << 16) | ((unsigned char) p[1] << 8)
+            | (unsigned char) p[2]) + 1;
+}
+
+static struct posting *find_slot(struct posting *slots, size_t num_slots, uint32_t key) {
+    size_t i = (key * 2654435761u) & (num_slots - 1);
+    while (slots[i].key && slots[i].key != key) {
+        i = (i + 1) & (num_slots - 1);
+    }
+    return &slots[i];
+}
+
+/* Double the table once it is half full. */
+static int grow_index(struct history_index *idx) {
+    size_t n = idx->num_slots ? idx->num_slots * 2 : 4096;
+    struct posting *slots = calloc(n, sizeof(struct posting));
+    if (slots == NULL) {
+        return -ENOMEM;
     }
+    for (size_t i = 0; i < idx->num_slots; i++) {
+        if (idx->slots[i].key) {
+            *find_slot(slots, n, idx->slots[i].key) = idx->slots[i];
+        }
+    }
+    free(idx->slots);
+    idx->slots = slots;
+    idx->num_slots = n;
+    return 0;
+}
 
+/* Add entry id to the posting list of every trigram in it. */
+static int index_entry(struct history_index *idx, const char *entry, size_t len, uint32_t id) {
+    for (size_t i = 0; i + 3 <= len; i++) {
+        uint32_t key = trigram_key(entry + i);
+        struct posting *p;
+
+        if ((idx->used + 1) * 2 > idx->num_slots && grow_index(idx) < 0) {
+            return -ENOMEM;
+        }
+        p = find_slot(idx->slots, idx->num_slots, key);
+        if (p->key == 0) {
+            p->key = key;
+            idx->used++;
+        }
+        // A trigram repeated within the entry is only listed once
+        if (p->len && p->ids[p->len - 1] == id) {
+            continue;
+        }
+        if (p->len == p->cap) {
+            uint32_t cap = p->cap ? p->cap * 2 : 4;
+            uint32_t *ids = realloc(p->ids, cap * sizeof(uint32_t));
+            if (ids == NULL) {
+                return -ENOMEM;
+            }
+            p->ids = ids;
+            p->cap = cap;
+        }
+        p->ids[p->len++] = id;
+    }
     return 0;
 }
+
+/* Free the search index; it is rebuilt on the next search. */
+void free_history_index(history *myhistory) {
+    struct history_index *idx = myhistory->index;
+    if (idx == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < idx->num_slots; i++) {
+        free(idx->slots[i].ids);
+    }
+    free(idx->slots);
+    free(idx);
+    myhistory->index = NULL;
+}
+
+/* Add up to batch more entries of the history to the index.
+ *
+ * Returns 0 once every entry is in the index, 1 if some are left,
+ * -ENOMEM on failure.
+ */
+static int update_history_index(history *myhistory, size_t batch) {
+    struct history_index *idx = myhistory->index;
+
+    if (idx == NULL) {
+        idx = calloc(1, sizeof(struct history_index));
+        if (idx == NULL) {
+            return -ENOMEM;
+        }
+        myhistory->index = idx;
+    }
+    for (; idx->indexed < myhistory->count && batch > 0; idx->indexed++, batch--) {
+        size_t len;
+        const char *entry = history_entry(myhistory, idx->indexed, &len);
+        // Include the newline, so every pair of bytes in the entry
+        // starts some trigram (see search_pair)
+        if (index_entry(idx, entry, len + 1, idx->indexed) < 0) {
+            free_history_index(myhistory);
+            return -ENOMEM;
+        }
+    }
+    return idx->indexed < myhistory->count;
+}
+
+/* The background indexer: index the history a batch at a time, so
+ * that the main thread never waits long for the lock.
+ */
+static void *run_indexer(void *arg) {
+    history *myhistory = arg;
+    int rv;
+
+    do {
+        pthread_mutex_lock(&history_lock);
+        rv = update_history_index(myhistory, INDEX_BATCH);
+        if (rv <= 0) {
+            indexing = false;
+        }
+        pthread_mutex_unlock(&history_lock);
+    } while (rv > 0);
+    return NULL;
+}
+
+// A forked child has no indexer thread: it finishes the index itself
+static void lock_for_fork(void) {
+    pthread_mutex_lock(&history_lock);
+}
+
+static void unlock_after_fork(void) {
+    pthread_mutex_unlock(&history_lock);
+}
+
+static void unlock_in_child(void) {
+    indexing = false;
+    pthread_mutex_unlock(&history_lock);
+}
+
+/* Start building the search index in the background, for an
+ * interactive shell, once the history is loaded.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int index_history(history *myhistory) {
+    static bool registered = false;
+    pthread_t thread;
+    int rv;
+
+    if (!registered) {
+        pthread_atfork(lock_for_fork, unlock_after_fork, unlock_in_child);
+        registered = true;
+    }
+    pthread_mutex_lock(&history_lock);
+    indexing = true;
+    rv = pthread_create(&thread, NULL, run_indexer, myhistory);
+    if (rv) {
+        indexing = false;
+    } else {
+        pthread_detach(thread);
+    }
+    pthread_mutex_unlock(&history_lock);
+    return -rv;
+}
+
+/* Does entry i contain query? */
+static bool entry_matches(history *myhistory, size_t i, const char *query, size_t qlen) {
+    size_t len;
+    const char *entry = history_entry(myhistory, i, &len);
+    return memmem(entry, len, query, qlen) != NULL;
+}
+
+/* Count the ids in p->ids[0, hi) that are below limit.  The list is
+ * ascending, so the newest of them sits at the returned count - 1.
+ */
+static size_t ids_below(struct posting *p, size_t hi, uint32_t limit) {
+    size_t lo = 0;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (p->ids[mid] < limit) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Search for a two byte query.  Since every indexed entry ends in a
+ * newline, an entry contains the pair exactly when it contains a
+ * trigram that starts with it, so the answer is the newest id below
+ * before across those (at most 256) posting lists.
+ */
+static long search_pair(struct history_index *idx, const char *query, long before) {
+    char trigram[3] = { query[0], query[1], 0 };
+    long newest = -1;
+
+    for (int c = 0; c < 256; c++) {
+        struct posting *p;
+        size_t n;
+
+        trigram[2] = c;
+        p = find_slot(idx->slots, idx->num_slots, trigram_key(trigram));
+        if (p->key == 0) {
+            continue;
+        }
+        n = ids_below(p, p->len, before);
+        if (n > 0 && (long) p->ids[n - 1] > newest) {
+            newest = p->ids[n - 1];
+        }
+    }
+    return newest;
+}
+
+/* search_history(), with history_lock held. */
+static long search_locked(history *myhistory, const char *query, size_t qlen, long before) {
+    struct posting *lists[MAX_INPUT];
+    size_t ends[MAX_INPUT];
+    size_t nlists = 0;
+    uint32_t target;
+
+    if (myhistory == NULL || before <= 0) {
+        return -1;
+    }
+    if ((size_t) before > myhistory->count) {
+        before = myhistory->count;
+    }
+
+    // A single byte has no trigram; it matches often, so just scan
+    if (qlen < 2 || qlen >= MAX_INPUT || update_history_index(myhistory, SIZE_MAX) < 0) {
+        for (long i = before - 1; i >= 0; i--) {
+            if (entry_matches(myhistory, i, query, qlen)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    if (qlen == 2) {
+        return search_pair(myhistory->index, query, before);
+    }
+
+    for (size_t i = 0; i + 3 <= qlen; i++) {
+        struct history_index *idx = myhistory->index;
+        struct posting *p = find_slot(idx->slots, idx->num_slots, trigram_key(query + i));
+        if (p->key == 0) {
+            return -1;
+        }
+        lists[nlists] = p;
+        ends[nlists++] = p->len;
+    }
+
+    // Leapfrog backwards through the posting lists: an entry is a
+    // candidate only once every trigram of the query lists it, and
+    // each list can skip straight past ids the others lack.
+    target = before;
+    while (1) {
+        uint32_t lowest = target;
+        bool agree = true;
+
+        for (size_t i = 0; i < nlists; i++) {
+            ends[i] = ids_below(lists[i], ends[i], target);
+            if (ends[i] == 0) {
+                return -1;
+            }
+            uint32_t id = lists[i]->ids[ends[i] - 1];
+            if (i > 0 && id != lowest) {
+                agree = false;
+            }
+            if (i == 0 || id < lowest) {
+                lowest = id;
+            }
+        }
+
+        if (agree && entry_matches(myhistory, lowest, query, qlen)) {
+            return lowest;
+        }
+        // Next round looks at ids below the current candidate (if every
+        // list agreed), or at or below the lowest id seen
+        target = agree ? lowest : lowest + 1;
+    }
+}
+
+/* Search the history backwards for an entry containing query.
+ *
+ * before: Only entries older than this one are considered; pass
+ *         the number of entries to search from the newest.
+ *
+ * Returns the index of the newest matching entry, or -1 if none.
+ */
+long search_history(history *myhistory, const char *query, size_t qlen, long before) {
+    long rv;
+
+    if (myhistory == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&history_lock);
+    rv = search_locked(myhistory, query, qlen, before);
+    pthread_mutex_unlock(&history_lock);
+    return rv;
+}
@@ -0,0 +1,79 @@
+/* Tar Heel SHell
+ *
+ * This file is a benchmark for reverse history search.
+ * It fills a history with synthetic commands, then times
+ * each keystroke of a few incremental searches, the way
+ * Ctrl-R issues them.
+ *
+ */
+#include "thsh.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define DEFAULT_ENTRIES 500000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int entries = argc > 1 ? atoi(argv[1]) : DEFAULT_ENTRIES;
+  const char *words[] = { "ls", "grep", "make", "git", "cat", "sort", "ssh", "docker", "kubectl", "find" };
+  const char *queries[] = { "kubectl get pods", "grep -r needle", "make -j8 install", "no such command" };
+  history myhistory;
+  char line[MAX_INPUT];
+  double start, worst = 0, total = 0;
+  int keystrokes = 0;
+
+  memset(&myhistory, 0, sizeof(myhistory));
+  myhistory.fd = -1;
+
+  srand(530);
+  for (int i = 0; i < entries; i++) {
+    snprintf(line, sizeof(line), "%s -x%d /srv/data/%d/file%d.txt | sort | uniq -c # %d\n",
+             words[rand() % 10], rand() % 100, rand() % 1000, rand() % 50, i);
+    add_history_line(line, &myhistory);
+  }
+  // A few needles, far back in the history
+  add_history_line("kubectl get pods -n prod\n", &myhistory);
+  add_history_line("grep -r needle src\n", &myhistory);
+  for (int i = 0; i < entries / 10; i++) {
+    snprintf(line, sizeof(line), "ls -la /tmp/%d\n", i);
+    add_history_line(line, &myhistory);
+  }
+
+  start = now();
+  search_history(&myhistory, "xyz", 3, myhistory.count);
+  printf("%zu entries, index built on first search in %.1f ms\n", myhistory.count, (now() - start) * 1e3);
+
+  for (int q = 0; q < (int)(sizeof(queries) / sizeof(queries[0])); q++) {
+    long match = -1;
+    for (size_t qlen = 1; qlen <= strlen(queries[q]); qlen++) {
+      double t = now();
+      match = search_history(&myhistory, queries[q], qlen, match >= 0 ? match + 1 : myhistory.count);
+      t = now() - t;
+      total += t;
+      worst = t > worst ? t : worst;
+      keystrokes++;
+    }
+    printf("%-20s -> %s\n", queries[q], match >= 0 ? "found" : "not found");
+  }
+  printf("%d keystrokes: mean %.1f us, worst %.1f us\n", keystrokes, total * 1e6 / keystrokes, worst * 1e6);
+
+  start = now();
+  for (int i = 0; i < 1000; i++) {
+    snprintf(line, sizeof(line), "echo appended %d\n", i);
+    add_history_line(line, &myhistory);
+    search_history(&myhistory, "appended", 8, myhistory.count);
+  }
+  printf("append + search: %.1f us each\n", (now() - start) * 1e6 / 1000);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("max RSS: %ld MiB\n", usage.ru_maxrss / 1024);
+  return 0;
+}
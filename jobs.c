@@ -3,17 +3,238 @@
  * This file implements functions related to launching jobs and job control.
  */
 
-
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "thsh.h"
 #include <string.h>
 
 static char ** path_table;
+// The copy of PATH that path_table points into
+static char *path_copy;
+
+/* Executable lookup cache.
+ *
+ * Maps a command name to the path it resolved to in the path_table,
+ * or to NULL if no prefix had it (a negative entry), so that repeated
+ * commands do not pay a stat() per PATH prefix on every line.
+ *
+ * Entries are stamped with path_generation.  At most once every
+ * PATH_RECHECK_SECS the mtime of each prefix directory is compared to
+ * what was last seen; if any directory changed, the generation moves on
+ * and every older entry is treated as stale.
+ */
+#define PATH_RECHECK_SECS 1
+#define HASH_INITIAL_BUCKETS 64
+
+struct path_entry {
+    char *name;
+    char *path;       // NULL if the command was not found
+    unsigned long generation;
+    unsigned long hits;
+    struct path_entry *next; // Chain of entries in the same bucket
+};
+
+static struct path_entry **path_cache = NULL;
+static size_t path_cache_buckets = 0;
+static size_t path_cache_entries = 0;
+static unsigned long path_generation = 0;
+static unsigned long path_cache_hits = 0;
+static unsigned long path_cache_misses = 0;
+
+// Last seen mtime of each path_table prefix, and when they were checked
+static struct timespec *path_mtimes = NULL;
+static struct timespec path_checked;
+
+/* FNV-1a hash of a command name */
+static size_t hash_name(const char *name) {
+    size_t h = 14695981039346656037UL;
+    for (; *name; name++) {
+        h ^= (unsigned char) *name;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Record the current mtime of every prefix directory.
+ *
+ * Returns true if any of them differ from the last snapshot.
+ */
+static bool snapshot_path_mtimes(void) {
+    bool changed = false;
+    for (int i = 0; path_table[i]; i++) {
+        struct stat sb;
+        if (stat(path_table[i], &sb) < 0) {
+            sb.st_mtim.tv_sec = 0;
+            sb.st_mtim.tv_nsec = 0;
+        }
+        if (sb.st_mtim.tv_sec != path_mtimes[i].tv_sec
+                || sb.st_mtim.tv_nsec != path_mtimes[i].tv_nsec) {
+            path_mtimes[i] = sb.st_mtim;
+            changed = true;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &path_checked);
+    return changed;
+}
+
+/* Invalidate the cache if a prefix directory has changed since the
+ * last check.  Directories are only stat()ed once per PATH_RECHECK_SECS.
+ */
+static void revalidate_path_cache(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - path_checked.tv_sec < PATH_RECHECK_SECS) {
+        return;
+    }
+    if (snapshot_path_mtimes()) {
+        path_generation++;
+    }
+}
+
+/* Free every entry in the lookup cache and reset its counters. */
+void reset_hash_table(void) {
+    for (size_t b = 0; b < path_cache_buckets; b++) {
+        struct path_entry *e, *next;
+        for (e = path_cache[b]; e; e = next) {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        path_cache[b] = NULL;
+    }
+    path_cache_entries = 0;
+    path_cache_hits = 0;
+    path_cache_misses = 0;
+}
+
+/* Double the number of buckets once the table is fully loaded. */
+static void grow_path_cache(void) {
+    size_t n = path_cache_buckets ? path_cache_buckets * 2 : HASH_INITIAL_BUCKETS;
+    struct path_entry **table = calloc(n, sizeof(struct path_entry *));
+    if (table == NULL) {
+        return;
+    }
+    for (size_t b = 0; b < path_cache_buckets; b++) {
+        struct path_entry *e, *next;
+        for (e = path_cache[b]; e; e = next) {
+            size_t idx = hash_name(e->name) & (n - 1);
+            next = e->next;
+            e->next = table[idx];
+            table[idx] = e;
+        }
+    }
+    free(path_cache);
+    path_cache = table;
+    path_cache_buckets = n;
+}
+
+/* Walk the path_table for cmd.
+ *
+ * Returns a malloc'ed path, or NULL if no prefix has the command.
+ */
+static char *search_path_table(const char *cmd) {
+    for (int i=0; path_table[i]; i++) {
+        // Append the cmd to the path_table
+        char path[strlen(path_table[i]) + strlen(cmd) + 2];
+        strcpy(path, path_table[i]);
+        strcat(path, "/");
+        strcat(path, cmd);
+
+        // Check if the bin file is here.
+        struct stat sb;
+        if (stat(path, &sb) == 0) {
+            return strdup(path);
+        }
+    }
+    return NULL;
+}
+
+/* Resolve a command name to a path through the lookup cache.
+ *
+ * Returns the cached path (owned by the cache), or NULL if the
+ * command is not in any prefix of the path_table.
+ */
+static const char *lookup_path(const char *cmd) {
+    struct path_entry *e = NULL;
+    size_t h = hash_name(cmd);
+
+    revalidate_path_cache();
+
+    if (path_cache_buckets) {
+        for (e = path_cache[h & (path_cache_buckets - 1)]; e; e = e->next) {
+            if (strcmp(e->name, cmd) == 0) {
+                break;
+            }
+        }
+    }
+
+    if (e && e->generation == path_generation) {
+        path_cache_hits++;
+        e->hits++;
+        return e->path;
+    }
+
+    path_cache_misses++;
+    if (e) {
+        // Stale entry; look it up again in place
+        free(e->path);
+    } else {
+        if (path_cache_entries >= path_cache_buckets) {
+            grow_path_cache();
+        }
+        if (path_cache_buckets == 0) {
+            return NULL;
+        }
+        e = malloc(sizeof(struct path_entry));
+        if (e == NULL) {
+            return NULL;
+        }
+        e->name = strdup(cmd);
+        if (e->name == NULL) {
+            free(e);
+            return NULL;
+        }
+        e->hits = 0;
+        e->next = path_cache[h & (path_cache_buckets - 1)];
+        path_cache[h & (path_cache_buckets - 1)] = e;
+        path_cache_entries++;
+    }
+    e->path = search_path_table(cmd);
+    e->generation = path_generation;
+    e->hits++;
+    return e->path;
+}
+
+/* Print the lookup cache to stdout, one command per line, followed
+ * by the hit and miss counters.
+ */
+void print_hash_table(outbuf *out) {
+    out_printf(out, "hits\tcommand\n");
+    for (size_t b = 0; b < path_cache_buckets; b++) {
+        for (struct path_entry *e = path_cache[b]; e; e = e->next) {
+            if (e->generation != path_generation) {
+                continue;
+            }
+            out_printf(out, "%4lu\t%s\n", e->hits, e->path ? e->path : e->name);
+        }
+    }
+    out_printf(out, "cache: %zu entries, %lu hits, %lu misses\n",
+            path_cache_entries, path_cache_hits, path_cache_misses);
+}
 
 /* Initialize the table of PATH prefixes.
  *
@@ -32,9 +253,15 @@ static char ** path_table;
  * Returns 0 on success, -errno on failure.
  */
 int init_path(void) {
-    // Get the path and create a copy
-    char* env = getenv("PATH");
+    // Get the path and create a copy; it may have been unset
+    const char* env = get_var("PATH", 4);
+    if (env == NULL) {
+        env = "";
+    }
     char* copied = malloc((strlen(env) + 1) * sizeof(char));
+    if (copied == NULL) {
+        return -ENOMEM;
+    }
     strcpy(copied, env);
 
     // Count the number of ':' in order to determine the size of the path_table
@@ -45,8 +272,22 @@ int init_path(void) {
         }
     }
 
-    // Malloc some space for the path_table
-    path_table = malloc((count + 2) * sizeof(char*));
+    // Malloc some space for the path_table, and for the mtimes of its
+    // prefixes, replacing any earlier ones only once both are there
+    char **table = malloc((count + 2) * sizeof(char*));
+    struct timespec *mtimes = calloc(count + 2, sizeof(struct timespec));
+    if (table == NULL || mtimes == NULL) {
+        free(table);
+        free(mtimes);
+        free(copied);
+        return -ENOMEM;
+    }
+    free(path_table);
+    free(path_copy);
+    free(path_mtimes);
+    path_table = table;
+    path_copy = copied;
+    path_mtimes = mtimes;
 
     // Start deliminating the string by ':'
     char* token = strtok(copied, ":");
@@ -66,6 +307,11 @@ int init_path(void) {
         token = strtok(NULL, ":");
         i++;
     }
+    path_table[i] = NULL;
+
+    // Snapshot the prefix directories for the lookup cache
+    snapshot_path_mtimes();
+    path_generation++;
 
     return 0;
 }
@@ -87,181 +333,1853 @@ void print_path_table() {
 }
 
 
-static int job_counter = 0;
+struct job;
 
 struct kiddo {
-    int pid;
+    int pid;    // 0 if the stage was a builtin that ran in the shell itself
+    int status; // wstatus of the stage, valid once reaped (or for builtins)
+    bool done;  // The stage has exited
+    bool stopped; // The stage is stopped (job control only)
+    struct job *job; // Job this process belongs to
     struct kiddo *next; // Linked list of sibling processes
+    struct kiddo *pid_next; // Chain in the pid index
+    uint64_t started; // When it was started, while tracing (see trace.c)
+    char *name;       // Its command, while tracing
 };
 
 // A job consists of a unique numeric ID and
 // one or more processes
 struct job {
     int id;
+    int pgid;    // Process group of the job, if job control is on
+    int running; // Stages that have not exited yet
+    int stopped; // Running stages that are stopped
+    bool background;
+    char *cmdline; // The command line, for the jobs builtin
     struct kiddo *kidlets; // Linked list of child processes
-    struct job *next; // Linked list of active jobs
+    struct kiddo *last_kid; // Tail of kidlets, so stages append in O(1)
+    struct job *id_next; // Chain in the job id index
+    struct job *prev, *next; // List of active jobs, oldest first
 };
 
-// A singly linked list of active jobs.
+// A doubly linked list of active jobs, oldest first.
 static struct job *jobbies = NULL;
+static struct job *last_jobbie = NULL;
+
+// Hash indexes of the active jobs by job id, and of their
+// running processes by pid.  Bucket counts are powers of two.
+static struct job **jobs_by_id = NULL;
+static size_t job_buckets = 0;
+static size_t num_jobs = 0;
+static struct kiddo **kids_by_pid = NULL;
+static size_t kid_buckets = 0;
+static size_t num_kids = 0;
+
+// Ids of background jobs that finished since the last notify_jobs()
+static int *done_jobs = NULL;
+static size_t num_done = 0;
+static size_t done_capacity = 0;
+
+// Set by the SIGCHLD handler; children are reaped outside of it
+static volatile sig_atomic_t children_exited = 0;
+
+// Job control: each job gets its own process group and the terminal
+static bool job_control = false;
+static pid_t shell_pgid = 0;
+// Signals the shell ignores, which its children get back at their default
+static sigset_t child_default_signals;
+
+static size_t hash_int(int key, size_t buckets) {
+    return ((unsigned int) key * 2654435761u) & (buckets - 1);
+}
+
+/* Double the buckets of the job id index. */
+static void grow_job_index(void) {
+    size_t n = job_buckets ? job_buckets * 2 : HASH_INITIAL_BUCKETS;
+    struct job **table = calloc(n, sizeof(struct job *));
+    if (table == NULL) {
+        return;
+    }
+    for (size_t b = 0; b < job_buckets; b++) {
+        struct job *j, *next;
+        for (j = jobs_by_id[b]; j; j = next) {
+            size_t idx = hash_int(j->id, n);
+            next = j->id_next;
+            j->id_next = table[idx];
+            table[idx] = j;
+        }
+    }
+    free(jobs_by_id);
+    jobs_by_id = table;
+    job_buckets = n;
+}
+
+/* Double the buckets of the pid index. */
+static void grow_kid_index(void) {
+    size_t n = kid_buckets ? kid_buckets * 2 : HASH_INITIAL_BUCKETS;
+    struct kiddo **table = calloc(n, sizeof(struct kiddo *));
+    if (table == NULL) {
+        return;
+    }
+    for (size_t b = 0; b < kid_buckets; b++) {
+        struct kiddo *k, *next;
+        for (k = kids_by_pid[b]; k; k = next) {
+            size_t idx = hash_int(k->pid, n);
+            next = k->pid_next;
+            k->pid_next = table[idx];
+            table[idx] = k;
+        }
+    }
+    free(kids_by_pid);
+    kids_by_pid = table;
+    kid_buckets = n;
+}
+
+static void sigchld_handler(int sig) {
+    children_exited = 1;
+}
+
+/* Set up job bookkeeping.  This needs to be called once at start-up,
+ * before any command runs.
+ *
+ * interactive: If true and standard in is a terminal, turn on job
+ *              control: every job runs in its own process group, which
+ *              is handed the terminal while it is in the foreground.
+ *
+ * Returns zero on success, -errno on failure.
+ */
+int init_jobs(bool interactive) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+        return -errno;
+    }
+
+    // Builtins write into pipes from the shell itself; a reader that
+    // exits early must not take the shell down with it
+    sigemptyset(&child_default_signals);
+    sigaddset(&child_default_signals, SIGPIPE);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (interactive && isatty(0)) {
+        // The shell itself must not be stopped by the terminal
+        sigaddset(&child_default_signals, SIGTSTP);
+        sigaddset(&child_default_signals, SIGTTIN);
+        sigaddset(&child_default_signals, SIGTTOU);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+
+        shell_pgid = getpid();
+        setpgid(0, shell_pgid);
+        if (tcsetpgrp(0, shell_pgid) == 0) {
+            job_control = true;
+        }
+    }
+    return 0;
+}
 
 /* Initialize a job structure
+ *
+ * cmdline is the command line the job runs, shown by the jobs builtin.
+ *         It is copied, and may be NULL.
  *
  * Returns an integer ID that represents the job.
  */
-int create_job(void) {
-    struct job *tmp;
+int create_job(const char *cmdline) {
     struct job *j = malloc(sizeof(struct job));
-    j->id = ++job_counter;
+    // Like other shells, number jobs one past the newest active job
+    j->id = last_jobbie ? last_jobbie->id + 1 : 1;
+    j->pgid = 0;
+    j->running = 0;
+    j->stopped = 0;
+    j->background = false;
+    j->cmdline = strndup(cmdline ? cmdline : "", cmdline ? strcspn(cmdline, "\n") : 0);
     j->kidlets = NULL;
+    j->last_kid = NULL;
+
+    if (num_jobs >= job_buckets) {
+        grow_job_index();
+    }
+    j->id_next = jobs_by_id[hash_int(j->id, job_buckets)];
+    jobs_by_id[hash_int(j->id, job_buckets)] = j;
+    num_jobs++;
+
+    j->prev = last_jobbie;
     j->next = NULL;
-    if (jobbies) {
-        for (tmp = jobbies; tmp && tmp->next; tmp = tmp->next) ;
-        assert(tmp!=j);
-        tmp->next = j;
+    if (last_jobbie) {
+        last_jobbie->next = j;
     } else {
         jobbies = j;
     }
+    last_jobbie = j;
     return j->id;
 }
 
-/* Helper function to walk the job list and find
- * a given job.
- *
- * remove: If true, remove this job from the job list.
+/* Helper function to find a given job in the job id index.
  *
  * Returns NULL on failure, a job pointer on success.
  */
-static struct job *find_job(int job_id, bool remove) {
-    struct job *tmp, *last = NULL;
-    for (tmp = jobbies; tmp; tmp = tmp->next) {
-        if (tmp->id == job_id) {
-            if (remove) {
-                if (last) {
-                    last->next = tmp->next;
-                } else {
-                    assert (tmp == jobbies);
-                    jobbies = NULL;
-                }
-            }
-            return tmp;
+static struct job *find_job(int job_id) {
+    if (job_buckets == 0) {
+        return NULL;
+    }
+    for (struct job *j = jobs_by_id[hash_int(job_id, job_buckets)]; j; j = j->id_next) {
+        if (j->id == job_id) {
+            return j;
         }
-        last = tmp;
     }
     return NULL;
 }
 
-/* Given the command listed in args,
- * try to execute it and create a job structure.
- *
- * This function does NOT wait on the child to complete,
- * nor does it return an exit code from the child.
- *
- * If the first argument starts with a '.'
- * or a '/', it is an absolute path and can
- * execute as-is.
- *
- * Otherwise, search each prefix in the path_table
- * in order to find the path to the binary.
- *
- * Then fork a child and pass the path and the additional arguments
- * to execve() in the child.  Wait for exeuction to complete
- * before returning.
- *
- * stdin is a file handle to be used for standard in.
- * stdout is a file handle to be used for standard out.
- *
- * If stdin and stdout are not 0 and 1, respectively, they will be
- * closed in the parent process before this function returns.
- *
- * job_id is the job_id allocated in create_job
+/* Find the running process with the given pid.
  *
- * Returns 0 on success, -errno on failure to create the child.
+ * Returns NULL if no active job has it.
+ */
+static struct kiddo *find_kiddo(int pid) {
+    if (kid_buckets == 0) {
+        return NULL;
+    }
+    for (struct kiddo *k = kids_by_pid[hash_int(pid, kid_buckets)]; k; k = k->pid_next) {
+        if (k->pid == pid) {
+            return k;
+        }
+    }
+    return NULL;
+}
+
+/* Drop a process from the pid index once it has exited,
+ * since the kernel may hand its pid to a new process.
+ */
+static void unindex_kiddo(struct kiddo *k) {
+    struct kiddo **link = &kids_by_pid[hash_int(k->pid, kid_buckets)];
+    for (; *link; link = &(*link)->pid_next) {
+        if (*link == k) {
+            *link = k->pid_next;
+            num_kids--;
+            return;
+        }
+    }
+}
+
+/* Remove a job from the job list and indexes, and free it. */
+static void free_job(struct job *j) {
+    struct job **link = &jobs_by_id[hash_int(j->id, job_buckets)];
+    struct kiddo *k, *next;
+
+    for (; *link; link = &(*link)->id_next) {
+        if (*link == j) {
+            *link = j->id_next;
+            num_jobs--;
+            break;
+        }
+    }
+    if (j->prev) {
+        j->prev->next = j->next;
+    } else {
+        jobbies = j->next;
+    }
+    if (j->next) {
+        j->next->prev = j->prev;
+    } else {
+        last_jobbie = j->prev;
+    }
+
+    for (k = j->kidlets; k; k = next) {
+        next = k->next;
+        if (!k->done) {
+            unindex_kiddo(k);
+        }
+        free(k->name);
+        free(k);
+    }
+    free(j->cmdline);
+    free(j);
+}
+
+/* Append a stage to the end of a job's process list, so that
+ * the list stays in pipeline order.
  *
+ * name and started (from trace_now()) are kept for the stage's trace
+ * event, if tracing is on.
  */
-int run_command(char *args[MAX_ARGS], int stdin, int stdout, int job_id, history *myhistory) {
-    // Check if the first arg starts with a '.' or '/'
-    if (args[0][0] == '.' || args[0][0] == '/') {
-        // Check if the command is here!
-        struct stat sb;
-        if (stat(args[0], &sb) == 0) {
-            // The command is here!
-            int pid = fork();
-            if (pid == 0) {
-                // I am the child
-                static char *newenviron[] = { NULL };
-                execve(args[0], args, newenviron);
-            } else {
-                // Je suis the parent
-                wait(NULL);
+static void add_kiddo(struct job *j, int pid, int status, const char *name, uint64_t started) {
+    struct kiddo *k = malloc(sizeof(struct kiddo));
+    k->pid = pid;
+    k->status = status;
+    k->done = (pid == 0);
+    k->stopped = false;
+    k->job = j;
+    k->next = NULL;
+    k->started = started;
+    k->name = started && pid > 0 ? strdup(name) : NULL;
+    if (j->last_kid) {
+        j->last_kid->next = k;
+    } else {
+        j->kidlets = k;
+    }
+    j->last_kid = k;
+
+    if (pid > 0) {
+        if (num_kids >= kid_buckets) {
+            grow_kid_index();
+        }
+        k->pid_next = kids_by_pid[hash_int(pid, kid_buckets)];
+        kids_by_pid[hash_int(pid, kid_buckets)] = k;
+        num_kids++;
+        j->running++;
+    }
+}
+
+/* Record a status change reported by wait4() for pid, with the
+ * resource usage of the process if it exited.
+ */
+static void record_status(int pid, int status, struct rusage *ru) {
+    struct kiddo *k = find_kiddo(pid);
+    struct job *j;
+
+    if (k == NULL) {
+        return;
+    }
+    j = k->job;
+
+    if (WIFSTOPPED(status)) {
+        if (!k->stopped) {
+            k->stopped = true;
+            j->stopped++;
+        }
+        return;
+    }
+    if (WIFCONTINUED(status)) {
+        if (k->stopped) {
+            k->stopped = false;
+            j->stopped--;
+        }
+        return;
+    }
+
+    // The process exited or was killed
+    if (k->stopped) {
+        k->stopped = false;
+        j->stopped--;
+    }
+    k->status = status;
+    k->done = true;
+    trace_stage(pid, k->name, k->started, status, ru);
+    unindex_kiddo(k);
+    j->running--;
+
+    if (j->running == 0 && j->background) {
+        if (num_done == done_capacity) {
+            size_t n = done_capacity ? done_capacity * 2 : 64;
+            int *tmp = realloc(done_jobs, n * sizeof(int));
+            if (tmp == NULL) {
+                return;
             }
+            done_jobs = tmp;
+            done_capacity = n;
         }
+        done_jobs[num_done++] = j->id;
+    }
+}
 
-        return 0;
-    } 
-
-    int retval = 0;
-    int found_builtin = handle_builtin(args, stdin, stdout, &retval, myhistory);
-
-    if (found_builtin == 0) {
-        // Loop through all entries in the path table to find the bin file
-
-        for (int i=0; path_table[i]; i++) {
-            // Append the cmd to the path_table
-            char path[strlen(path_table[i]) + strlen(args[0]) + 2];
-            strcpy(path, path_table[i]);
-            strcat(path, "/");
-            strcat(path, args[0]);
-
-            // Check if the bin file is here.
-            struct stat sb;
-            if (stat(path, &sb) == 0) {
-                // The file exists here!
-
-                // Fork to create child process
-                int pid;
-                pid = fork();
-                if (pid == 0) {
-                    // Call execve
-                    dup2(stdin, 0);
-                    dup2(stdout, 1);
-                    static char *newenviron[] = { NULL };
-                    execve(path, args, newenviron);
-                    return -errno;
-                } else {
-                    // Wait
-                    close(stdout);
-                    wait(NULL);
-                }
-                return 0;
+/* Reap every child that has changed state since the last SIGCHLD,
+ * without blocking.
+ */
+static void reap_children(void) {
+    int pid, status;
+    struct rusage ru;
+
+    if (!children_exited) {
+        return;
+    }
+    children_exited = 0;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        record_status(pid, status, &ru);
+    }
+}
+
+/* Reap finished children and forget background jobs that are done.
+ *
+ * With job control on, a "Done" line is printed for each of them,
+ * as the shell does before each prompt.  Only the jobs that finished
+ * are visited, however many are still running.
+ */
+void notify_jobs(void) {
+    reap_children();
+
+    for (size_t i = 0; i < num_done; i++) {
+        struct job *j = find_job(done_jobs[i]);
+        // The job may already have been collected by fg or wait
+        if (j == NULL || j->running > 0) {
+            continue;
+        }
+        if (job_control) {
+            int status = j->last_kid ? j->last_kid->status : 0;
+            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+                dprintf(1, "[%d]  Exit %-4d %s\n", j->id, WEXITSTATUS(status), j->cmdline);
+            } else {
+                dprintf(1, "[%d]  Done      %s\n", j->id, j->cmdline);
             }
         }
-    } else if (found_builtin == -1) {
-        // cd failed
-        return -1;
-    } else {
-        return 0;
+        free_job(j);
     }
+    num_done = 0;
+}
 
-    (void)&find_job;
-    return -2;
+/* Close the stage's handles in the parent, unless they are
+ * the shell's own standard in and standard out.
+ */
+static void close_stage_fds(int stdin, int stdout) {
+    if (stdin != 0) {
+        close(stdin);
+    }
+    if (stdout != 1) {
+        close(stdout);
+    }
 }
 
-/* Wait for the job to complete and free internal bookkeeping
+// Backend used to start external commands; see set_launcher()
+static enum launcher launch_backend = LAUNCH_SPAWN;
+
+static const char *launcher_names[] = {
+    [LAUNCH_SPAWN] = "spawn",
+    [LAUNCH_FORK] = "fork",
+};
+
+/* Select the backend used to start external commands by name,
+ * either "spawn" or "fork".
  *
- * job_id is the job_id allocated in create_job
+ * Returns 0 on success, -EINVAL for an unknown name.
+ */
+int set_launcher(const char *name) {
+    for (int i = 0; i < (int)(sizeof(launcher_names) / sizeof(launcher_names[0])); i++) {
+        if (strcmp(name, launcher_names[i]) == 0) {
+            launch_backend = i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+/* Returns the name of the current launch backend. */
+const char *get_launcher(void) {
+    return launcher_names[launch_backend];
+}
+
+/* Fork a child that runs the binary at path with
+ * stdin and stdout wired to the given handles, and the settings in
+ * limits (if not NULL) applied, see apply_limits().
  *
- * exit_code is the exit code from the last child process, if it executed.
- *           This parameter may be NULL, and is only set if the return
- *           value is zero.  This is the same as the wstatus parameter
- *           to waitpid variants, and can be used with functions such
- *           as WIFEXITED.  If this job includes multiple
- *           processes, the exit code will be the last process.
+ * The whole address space of the shell is copied (copy-on-write),
+ * so this gets slower as the shell grows.
  *
- * Returns zero on success, -errno on error.
+ * Returns the child's pid, or -errno on failure.
  */
-int wait_on_job(int job_id, int *exit_code) {
-    int ret = 0;
-    return ret;
+static int launch_fork(const char *path, char **args, char **envp, int stdin, int stdout,
+        const stage_limits *limits, struct job *j) {
+    int pid = fork();
+    if (pid < 0) {
+        return -errno;
+    }
+    if (pid == 0) {
+        // I am the child
+        signal(SIGPIPE, SIG_DFL);
+        if (job_control) {
+            setpgid(0, j->pgid);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+        }
+        if (stdin != 0) {
+            dup2(stdin, 0);
+        }
+        if (stdout != 1) {
+            dup2(stdout, 1);
+        }
+        if (limits && apply_limits(limits) < 0) {
+            _exit(126);
+        }
+        trace_exec(path);
+        execve(path, args, envp);
+        dprintf(2, "thsh: %s: %s\n", args[0], strerror(errno));
+        _exit(127);
+    }
+    // Je suis the parent; set the group here too, to not race the child
+    if (job_control) {
+        setpgid(pid, j->pgid ? j->pgid : pid);
+    }
+    return pid;
 }
 
+/* Start the binary at path with posix_spawn(), with stdin and stdout
+ * wired up through spawn file actions.
+ *
+ * glibc implements this with clone(CLONE_VM|CLONE_VFORK), so the
+ * cost does not depend on the size of the shell.
+ *
+ * Returns the child's pid, or -errno on failure.
+ */
+static int launch_spawn(const char *path, char **args, char **envp, int stdin, int stdout, struct job *j) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid;
+    int rv;
+
+    rv = posix_spawn_file_actions_init(&actions);
+    if (rv) {
+        return -rv;
+    }
+    rv = posix_spawnattr_init(&attr);
+    if (rv) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -rv;
+    }
+
+    if (stdin != 0) {
+        rv = posix_spawn_file_actions_adddup2(&actions, stdin, 0);
+    }
+    if (!rv && stdout != 1) {
+        rv = posix_spawn_file_actions_adddup2(&actions, stdout, 1);
+    }
+    if (!rv) {
+        // Undo the signals the shell ignores, and with job control,
+        // join the job's process group (0 starts a new one)
+        short flags = POSIX_SPAWN_SETSIGDEF;
+        posix_spawnattr_setsigdefault(&attr, &child_default_signals);
+        if (job_control) {
+            posix_spawnattr_setpgroup(&attr, j->pgid);
+            flags |= POSIX_SPAWN_SETPGROUP;
+        }
+        rv = posix_spawnattr_setflags(&attr, flags);
+    }
+    if (!rv) {
+        rv = posix_spawn(&pid, path, &actions, &attr, args, envp);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rv) {
+        dprintf(2, "thsh: %s: %s\n", args[0], strerror(rv));
+        return -rv;
+    }
+    return pid;
+}
+
+/* Start the binary at path with the current launch backend and
+ * the environment envp, as a stage of job j.
+ *
+ * A command with limits (nice, taskset or ulimit settings) is always
+ * forked, since posix_spawn() has no way to apply them in the child.
+ *
+ * Returns the child's pid, or -errno on failure.
+ */
+static int launch(const char *path, char **args, char **envp, int stdin, int stdout,
+        const stage_limits *limits, struct job *j) {
+    uint64_t start = trace_now();
+    int pid;
+    if (launch_backend == LAUNCH_FORK || limits) {
+        pid = launch_fork(path, args, envp, stdin, stdout, limits, j);
+        trace_phase("fork", start, path);
+    } else {
+        // posix_spawn() returns once the child has called execve()
+        pid = launch_spawn(path, args, envp, stdin, stdout, j);
+        trace_phase("spawn", start, path);
+    }
+    // The first stage leads the job's process group
+    if (pid > 0 && job_control && j->pgid == 0) {
+        j->pgid = pid;
+    }
+    return pid;
+}
+
+/* Returns true if fd is a pipe of the pipeline, i.e. not the shell's
+ * own standard out; see init_output().
+ */
+static bool is_stage_pipe(int fd) {
+    struct stat sb;
+    return fd != 1 && fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode);
+}
+
+/* Run a builtin that streams (see builtin_streams()) in a forked
+ * child, with its output written straight to the pipe stdout.  In
+ * the shell, it would run to its end before the stages after it
+ * were started, with all of its output held in memory.
+ *
+ * Returns the child's pid, or -errno on failure.
+ */
+static int fork_builtin(char **args, int stdin, int stdout, struct job *j, history *myhistory) {
+    int pid;
+
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        return -errno;
+    }
+    if (pid == 0) {
+        outbuf out;
+        int retval = 0;
+
+        signal(SIGPIPE, SIG_DFL);
+        if (job_control) {
+            setpgid(0, j->pgid);
+        }
+        // Its jobs are its own, and never take the terminal
+        job_control = false;
+        init_output(&out, stdout);
+        // Blocking on the reader only holds up this child
+        out.capture = false;
+        handle_builtin(args, stdin, &out, &retval, myhistory);
+        flush_output(&out);
+        exit(out.status);
+    }
+    if (job_control) {
+        setpgid(pid, j->pgid ? j->pgid : pid);
+        if (j->pgid == 0) {
+            j->pgid = pid;
+        }
+    }
+    return pid;
+}
+
+/* Given the command listed in args,
+ * try to execute it and add it to a job structure.
+ *
+ * This function does NOT wait on the child to complete,
+ * nor does it return an exit code from the child.
+ * Use wait_on_job() to reap every stage of the job once
+ * the whole pipeline has been started.
+ *
+ * If the first argument starts with a '.'
+ * or a '/', it is an absolute path and can
+ * execute as-is.
+ *
+ * Otherwise, search each prefix in the path_table
+ * in order to find the path to the binary.
+ *
+ * Then fork a child and pass the path and the additional arguments
+ * to execve() in the child, with the exported variables as its
+ * environment (see get_envp()).
+ *
+ * Leading NAME=value words are added to the environment of that
+ * command only.  A command made of nothing but assignments sets
+ * shell variables instead.
+ *
+ * After those, nice, taskset and ulimit prefixes are applied to the
+ * command's process, between fork() and execve() (see limits.c).
+ *
+ * Builtins run in the shell itself, without a fork, and their output
+ * is buffered (see init_output()).  They are recorded in the job with
+ * their status so that wait_on_job() reports them too.  Only output
+ * too large for the pipe it goes to is handed to a forked writer,
+ * which then stands in for the builtin in the job.
+ *
+ * stdin is a file handle to be used for standard in.
+ * stdout is a file handle to be used for standard out.
+ *
+ * If stdin and stdout are not 0 and 1, respectively, they will be
+ * closed in the parent process before this function returns.
+ *
+ * job_id is the job_id allocated in create_job
+ *
+ * cpu is a CPU to run the command on (see spread_cpu()), or -1.
+ *
+ * Returns 0 on success, -errno on failure to create the child.
+ *
+ */
+static int run_stage(char **args, int stdin, int stdout, int job_id, int cpu, history *myhistory) {
+    struct job *j = find_job(job_id);
+    uint64_t start = trace_now();
+    stage_limits *limits = NULL;
+    int rv = -ENOENT;
+
+    if (j == NULL) {
+        close_stage_fds(stdin, stdout);
+        return -EINVAL;
+    }
+
+    // Split off the assignments in front of the command
+    int assignments = 0;
+    while (args[assignments] && assignment_name(args[assignments])) {
+        assignments++;
+    }
+    if (args[assignments] == NULL) {
+        int status = 0;
+        for (int i = 0; i < assignments; i++) {
+            size_t len = assignment_name(args[i]);
+            args[i][len] = '\0';
+            if (set_var(args[i], args[i] + len + 1, false) < 0) {
+                status = 1;
+            }
+            args[i][len] = '=';
+        }
+        close_stage_fds(stdin, stdout);
+        add_kiddo(j, 0, status << 8, args[0], start);
+        return 0;
+    }
+
+    // Then the nice, taskset and ulimit prefixes
+    int prefixes = parse_limits(args + assignments, cpu, &limits);
+    if (prefixes < 0) {
+        close_stage_fds(stdin, stdout);
+        if (prefixes == -EINVAL) {
+            add_kiddo(j, 0, 2 << 8, args[assignments], start);
+            return 0;
+        }
+        return prefixes;
+    }
+    char **envp = get_envp();
+    if (assignments) {
+        envp = envp_with(args, assignments);
+        if (envp == NULL) {
+            close_stage_fds(stdin, stdout);
+            free(limits);
+            return -ENOMEM;
+        }
+    }
+    args += assignments + prefixes;
+
+    // Check if the first arg starts with a '.' or '/'
+    if (args[0][0] == '.' || args[0][0] == '/') {
+        // Check if the command is here!
+        struct stat sb;
+        if (stat(args[0], &sb) == 0) {
+            // The command is here!
+            rv = launch(args[0], args, envp, stdin, stdout, limits, j);
+        }
+    } else if (builtin_streams(args[0]) && is_stage_pipe(stdout)) {
+        rv = fork_builtin(args, stdin, stdout, j, myhistory);
+    } else {
+        int retval = 0;
+        outbuf out;
+        int found_builtin;
+
+        init_output(&out, stdout);
+        found_builtin = handle_builtin(args, stdin, &out, &retval, myhistory);
+
+        if (found_builtin == 0) {
+            free(out.data);
+            // Resolve the bin file through the lookup cache
+            uint64_t lookup = trace_now();
+            const char *path = lookup_path(args[0]);
+            trace_phase("lookup", lookup, args[0]);
+            if (path) {
+                rv = launch(path, args, envp, stdin, stdout, limits, j);
+            }
+        } else {
+            int writer = flush_output(&out);
+            if (assignments) {
+                free(envp);
+            }
+            free(limits);
+            if (writer > 0 && job_control) {
+                setpgid(writer, j->pgid ? j->pgid : writer);
+                if (j->pgid == 0) {
+                    j->pgid = writer;
+                }
+            }
+            close_stage_fds(stdin, stdout);
+            trace_phase("builtin", start, args[0]);
+            if (found_builtin == -1) {
+                // cd failed
+                add_kiddo(j, 0, 1 << 8, args[0], start);
+                return -1;
+            }
+            add_kiddo(j, writer > 0 ? writer : 0, out.status << 8, args[0], start);
+            return 0;
+        }
+    }
+
+    close_stage_fds(stdin, stdout);
+    if (assignments) {
+        free(envp);
+    }
+    free(limits);
+    if (rv < 0) {
+        return rv;
+    }
+    add_kiddo(j, rv, 0, args[0], start);
+    return 0;
+}
+
+/* Run the command in args as a stage of job job_id, see run_stage(). */
+int run_command(char **args, int stdin, int stdout, int job_id, history *myhistory) {
+    return run_stage(args, stdin, stdout, job_id, -1, myhistory);
+}
+
+/* Returns a file descriptor to read the len bytes of text from, for
+ * a here-document or here-string.
+ *
+ * Text that fits in a pipe is written into one, which costs no more
+ * than the pipe itself.  Anything larger goes into a memfd, an
+ * anonymous file in memory: it is written once, the child reads it
+ * like a regular file (and may mmap() or seek it), and it goes away
+ * with the last descriptor.  Either way, nothing touches the
+ * filesystem and nothing needs cleaning up.
+ *
+ * Returns the descriptor, or -errno on failure.
+ */
+static int here_input(const char *text, size_t len) {
+    int pipefd[2];
+    int fd;
+
+    if (pipe2(pipefd, O_CLOEXEC) == 0) {
+        int capacity = fcntl(pipefd[1], F_GETPIPE_SZ);
+        if (capacity > 0 && len <= (size_t) capacity
+                && write(pipefd[1], text, len) == (ssize_t) len) {
+            close(pipefd[1]);
+            return pipefd[0];
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+
+    fd = memfd_create("thsh-heredoc", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    while (len > 0) {
+        ssize_t rv = write(fd, text, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            int err = errno;
+            close(fd);
+            return -err;
+        }
+        text += rv;
+        len -= rv;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static int start_stages(command_line *line, int job_id, int first_in, int last_out,
+        pipe_relay **relays, bool debug, history *myhistory);
+
+/* Start the command of the process substitution ps as more stages of
+ * job job_id, on one end of a new pipe, and keep the other end, for
+ * the line's commands, in ps->fd.  That end is still close-on-exec,
+ * so that the other substitutions of the line do not inherit it.
+ *
+ * Returns zero on success, -errno on error.
+ */
+static int start_procsub(procsub *ps, int job_id, history *myhistory) {
+    command_line sub;
+    int pipefd[2];
+    int rv;
+
+    memset(&sub, 0, sizeof(sub));
+    rv = parse_line(ps->command, strlen(ps->command), &sub);
+    if (rv >= 0) {
+        int err = open_pipe(pipefd);
+        if (err < 0) {
+            rv = err;
+        }
+    }
+    if (rv > 0) {
+        if (ps->output) {
+            // >(command) reads what the line writes
+            ps->fd = pipefd[1];
+            rv = start_stages(&sub, job_id, pipefd[0], 1, NULL, false, myhistory);
+        } else {
+            ps->fd = pipefd[0];
+            rv = start_stages(&sub, job_id, 0, pipefd[1], NULL, false, myhistory);
+        }
+    } else if (rv == 0) {
+        // Nothing to run: an empty stream, or one nobody reads
+        close(pipefd[!ps->output]);
+        ps->fd = pipefd[ps->output];
+    }
+    arena_free(&sub.arena);
+    free(sub.commands);
+    free(sub.words.words);
+    return rv;
+}
+
+/* Start every stage of a parsed line as a stage of job job_id.  The
+ * first stage reads from line->infile or line->input if there is one,
+ * or else from first_in, and the last stage writes to line->outfile if
+ * there is one, or else to last_out.  first_in and last_out are closed
+ * in the shell either way (unless they are 0 and 1).
+ *
+ * The process substitutions of the line are started first, so that
+ * their pipes are there for the stages to inherit.
+ *
+ * relays: if not NULL, each pipe between stages goes through a relay
+ *         that counts what goes through it, added to *relays (see
+ *         start_relay()).
+ *
+ * debug: print each stage to stderr as it starts.
+ *
+ * Returns zero on success, -errno (or -1 for a failed builtin) on error.
+ */
+static int start_stages(command_line *line, int job_id, int first_in, int last_out,
+        pipe_relay **relays, bool debug, history *myhistory) {
+    int ret = 0;
+    // Read end of the pipe feeding the current stage
+    int in_fd = first_in;
+
+    for (procsub *ps = line->procsubs; ps && ret == 0; ps = ps->next) {
+        ret = start_procsub(ps, job_id, myhistory);
+    }
+    for (procsub *ps = line->procsubs; ps && ret == 0; ps = ps->next) {
+        // Now every stage may inherit it
+        fcntl(ps->fd, F_SETFD, 0);
+        snprintf(ps->arg, PROCSUB_ARG, "/dev/fd/%d", ps->fd);
+    }
+
+    for (int i = 0; i < line->stages && ret == 0; i++) {
+        int out_fd = last_out;
+        int next_in = 0;
+
+        if (debug) {
+            // Print debugging statements if necessary
+            fprintf(stderr, "RUNNING: [%s]\n", line->commands[i][0]);
+        }
+
+        // The first stage may read from a file, or a here-document
+        if (i == 0 && in_fd != 0 && (line->infile != NULL || line->input != NULL)) {
+            close(in_fd);
+            in_fd = 0;
+        }
+        if (i == 0 && line->infile != NULL) {
+            in_fd = open(line->infile, O_RDONLY | O_CLOEXEC);
+            if (in_fd < 0) {
+                ret = -errno;
+                break;
+            }
+            // The command will most likely read it from start to end
+            posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        } else if (i == 0 && line->input != NULL) {
+            in_fd = here_input(line->input, line->input_len);
+            if (in_fd < 0) {
+                ret = in_fd;
+                break;
+            }
+        }
+
+        // Every stage but the last writes into a pipe to the next one.
+        // The pipes are close-on-exec so that no child holds on to
+        // another stage's pipe and keeps its reader from seeing EOF.
+        if (i < line->stages - 1 && relays) {
+            ret = start_relay(line->commands[i][0], line->commands[i + 1][0],
+                    &out_fd, &next_in, relays);
+            if (ret < 0) {
+                break;
+            }
+        } else if (i < line->stages - 1) {
+            int pipefd[2];
+            ret = open_pipe(pipefd);
+            if (ret < 0) {
+                break;
+            }
+            next_in = pipefd[0];
+            out_fd = pipefd[1];
+        } else if (line->outfile != NULL) {
+            // We have an out file to write to. Create if necessary
+            out_fd = open(line->outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (out_fd < 0) {
+                ret = -errno;
+                break;
+            }
+        }
+
+        // run_stage closes in_fd and out_fd in the shell
+        ret = run_stage(line->commands[i], in_fd, out_fd, job_id,
+                line->stages > 1 ? spread_cpu(i) : -1, myhistory);
+        in_fd = next_in;
+        if (out_fd == last_out) {
+            last_out = 1;
+        }
+    }
+    if (in_fd > 0) {
+        // Not handed to any stage
+        close(in_fd);
+    }
+    if (last_out != 1) {
+        close(last_out);
+    }
+    for (procsub *ps = line->procsubs; ps; ps = ps->next) {
+        if (ps->fd >= 0) {
+            close(ps->fd);
+            ps->fd = -1;
+        }
+    }
+    return ret;
+}
+
+/* Report a line that failed to run, on standard out. */
+static void report_failure(int ret) {
+    char buf [100];
+    int len = snprintf(buf, 100, "Failed to run command - error %d\n", ret);
+    if (len > 0) {
+        // Write to stdout as usual
+        write(1, buf, strlen(buf));
+    }
+    else {
+        dprintf(2, "Failed to format the output (%d).  This shouldn't happen...\n", len);
+    }
+}
+
+// History for the builtins run by command substitutions
+static history *subst_history;
+
+/* Run every stage of a parsed line as one job, and wait for it to
+ * finish unless the line ends with '&'.
+ *
+ * Every stage is started before any is waited on, so that the stages
+ * of a pipeline run concurrently.  A launch error is reported on
+ * standard out, as "Failed to run command".
+ *
+ * cmdline is the text of the line, for the jobs builtin.
+ *
+ * debug: print each stage to stderr as it starts and ends.
+ *
+ * exit_code is set to the wstatus of the last stage (0 for a job left
+ *           in the background), if the return value is zero.
+ *
+ * Returns zero on success, -errno (or -1 for a failed builtin) on error.
+ */
+int run_pipeline(command_line *line, const char *cmdline, bool debug,
+        int *exit_code, history *myhistory) {
+    uint64_t start = trace_now();
+    int job_id = create_job(cmdline);
+    pipe_relay *relays = NULL;
+    bool count_pipes = pipe_stats_on() && !line->background && line->stages > 1;
+    int ret;
+    int rv;
+
+    subst_history = myhistory;
+    *exit_code = 0;
+    ret = start_stages(line, job_id, 0, 1, count_pipes ? &relays : NULL, debug, myhistory);
+
+    // Reap the whole job (or leave it running in the background);
+    // a launch error takes precedence
+    if (line->background && ret == 0) {
+        rv = background_job(job_id);
+    } else {
+        rv = wait_on_job(job_id, exit_code);
+    }
+    if (ret == 0) {
+        ret = rv;
+    }
+    // A job that is done is no longer in the table; one that was
+    // stopped is, and its relays report once it is done
+    finish_relays(relays, find_job(job_id) == NULL);
+
+    if (debug) {
+        for (int i = 0; i < line->stages; i++) {
+            fprintf(stderr, "ENDED: [%s] (ret=%d)\n", line->commands[i][0], ret);
+        }
+    }
+
+    if (ret) {
+        report_failure(ret);
+    }
+    trace_phase("line", start, cmdline);
+    return ret;
+}
+
+/* Returns true if a stage of line would change the shell itself if
+ * it ran in the shell's process: a builtin that is not pure (see
+ * is_builtin()), or nothing but assignments.
+ */
+static bool changes_shell(command_line *line) {
+    for (int i = 0; i < line->stages; i++) {
+        char **args = line->commands[i];
+        bool pure;
+        while (*args && assignment_name(*args)) {
+            args++;
+        }
+        if (*args == NULL || (is_builtin(*args, &pure) && !pure)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* In a forked subshell: run line, with its standard out on out_fd,
+ * and exit with the status of its last stage.
+ */
+static void run_subshell(command_line *line, const char *cmdline, int out_fd) {
+    int job_id, ret, exit_code = 0;
+
+    // The subshell's jobs are its own, and never take the terminal
+    job_control = false;
+    job_id = create_job(cmdline);
+    ret = start_stages(line, job_id, 0, out_fd, NULL, false, subst_history);
+    if (wait_on_job(job_id, &exit_code) == 0 && ret) {
+        report_failure(ret);
+    }
+    exit(ret ? 1 : WIFEXITED(exit_code) ? WEXITSTATUS(exit_code) : 128 + WTERMSIG(exit_code));
+}
+
+/* Run the len bytes of command line at cmd, for a command
+ * substitution, and set *output to what it wrote to standard out,
+ * less any trailing newlines, allocated from a.
+ *
+ * A lone builtin that only writes output (echo, printf, test and
+ * the like) runs right here, writing into memory, with no fork at
+ * all.  Anything else runs as a job (in the foreground, even with a
+ * '&') whose standard out is a pipe, which the shell reads into a
+ * growing buffer while the job runs.  A line with a builtin that
+ * changes the shell (cd, export, exit, ...) or a bare assignment
+ * runs in a forked subshell, so that it changes only that.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int capture_output(const char *cmd, size_t len, arena *a, char **output) {
+    uint64_t start = trace_now();
+    command_line sub;
+    char *text = arena_alloc(a, len + 1);
+    char *data = NULL;
+    size_t size = 0, cap = 0;
+    int rv;
+
+    if (text == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(text, cmd, len);
+    text[len] = '\0';
+    memset(&sub, 0, sizeof(sub));
+    rv = parse_line(text, len, &sub);
+
+    bool pure = false;
+    if (rv == 1 && !sub.infile && !sub.input && !sub.outfile
+            && is_builtin(sub.commands[0][0], &pure) && pure) {
+        outbuf out;
+        int retval = 0;
+        init_output(&out, -1);
+        out.capture = true;
+        handle_builtin(sub.commands[0], 0, &out, &retval, subst_history);
+        data = out.data;
+        size = out.len;
+        rv = 0;
+    }
+    if (rv > 0) {
+        int pipefd[2];
+        int job_id, exit_code, ret = 0;
+
+        rv = open_pipe(pipefd);
+        if (rv < 0) {
+            goto out;
+        }
+        job_id = create_job(text);
+        if (changes_shell(&sub)) {
+            int pid;
+            fflush(NULL);
+            pid = fork();
+            if (pid == 0) {
+                close(pipefd[0]);
+                run_subshell(&sub, text, pipefd[1]);
+            }
+            close(pipefd[1]);
+            if (pid < 0) {
+                ret = -errno;
+            } else {
+                add_kiddo(find_job(job_id), pid, 0, sub.commands[0][0], start);
+            }
+        } else {
+            ret = start_stages(&sub, job_id, 0, pipefd[1], NULL, false, subst_history);
+        }
+        for (;;) {
+            ssize_t n;
+            if (cap - size < 4096) {
+                char *tmp = realloc(data, cap ? cap * 2 : 8192);
+                if (tmp == NULL) {
+                    break;
+                }
+                data = tmp;
+                cap = cap ? cap * 2 : 8192;
+            }
+            n = read(pipefd[0], data + size, cap - size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            size += n;
+        }
+        close(pipefd[0]);
+        rv = wait_on_job(job_id, &exit_code);
+        if (ret) {
+            report_failure(ret);
+        }
+    }
+    if (rv < 0) {
+        goto out;
+    }
+
+    while (size > 0 && data[size - 1] == '\n') {
+        size--;
+    }
+    *output = arena_alloc(a, size + 1);
+    if (*output == NULL) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    if (size) {
+        memcpy(*output, data, size);
+    }
+    (*output)[size] = '\0';
+    rv = 0;
+out:
+    free(data);
+    arena_free(&sub.arena);
+    free(sub.commands);
+    free(sub.words.words);
+    trace_phase("subst", start, text);
+    return rv;
+}
+
+/* Block until every stage of j has exited, or (with job control)
+ * until all of its remaining stages are stopped.
+ *
+ * foreground: Hand the terminal to the job while waiting.
+ *
+ * Only this job's own processes are waited on, by pid; the kernel
+ * finds those directly, however many other children the shell has,
+ * and other jobs are left to reap_children().
+ *
+ * A finished job is freed; a stopped one stays in the job table.
+ *
+ * Returns zero on success, -errno on error.
+ */
+static int wait_for_job(struct job *j, bool foreground, int *exit_code) {
+    uint64_t start = trace_now();
+    struct rusage ru;
+    int ret = 0;
+    int status = 0;
+
+    if (foreground && job_control && j->pgid) {
+        tcsetpgrp(0, j->pgid);
+    }
+
+    for (struct kiddo *k = j->kidlets; k && ret == 0; k = k->next) {
+        while (!k->done && !k->stopped) {
+            int pid = wait4(k->pid, &status, job_control ? WUNTRACED : 0, &ru);
+            if (pid < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ret = -errno;
+                break;
+            }
+            record_status(pid, status, &ru);
+        }
+    }
+
+    if (foreground && job_control && j->pgid) {
+        tcsetpgrp(0, shell_pgid);
+    }
+    trace_phase("wait", start, j->cmdline);
+
+    if (ret == 0 && j->running > 0) {
+        // Stopped, e.g. by ^Z; it can be resumed with fg or bg
+        j->background = true;
+        dprintf(1, "\n[%d]  Stopped   %s\n", j->id, j->cmdline);
+        if (exit_code) {
+            *exit_code = status;
+        }
+        return 0;
+    }
+
+    if (ret == 0 && exit_code) {
+        *exit_code = j->last_kid ? j->last_kid->status : 0;
+    }
+    free_job(j);
+    return ret;
+}
+
+/* Wait for the job to complete and free internal bookkeeping
+ *
+ * job_id is the job_id allocated in create_job
+ *
+ * exit_code is the exit code from the last child process, if it executed.
+ *           This parameter may be NULL, and is only set if the return
+ *           value is zero.  This is the same as the wstatus parameter
+ *           to waitpid variants, and can be used with functions such
+ *           as WIFEXITED.  If this job includes multiple
+ *           processes, the exit code will be the last process.
+ *
+ * Returns zero on success, -errno on error.
+ */
+int wait_on_job(int job_id, int *exit_code) {
+    struct job *j = find_job(job_id);
+
+    if (j == NULL) {
+        return -ESRCH;
+    }
+    return wait_for_job(j, true, exit_code);
+}
+
+/* Leave a started job running in the background.
+ * It is reaped asynchronously, and reported by notify_jobs().
+ *
+ * Returns zero on success, -errno on error.
+ */
+int background_job(int job_id) {
+    struct job *j = find_job(job_id);
+
+    if (j == NULL) {
+        return -ESRCH;
+    }
+    j->background = true;
+    if (j->running == 0) {
+        // Nothing left to wait for (e.g., only builtins)
+        free_job(j);
+        return 0;
+    }
+    if (job_control) {
+        dprintf(1, "[%d] %d\n", j->id, j->last_kid->pid);
+    }
+    return 0;
+}
+
+/* Find the job named by a job spec ("%3" or "3"), or the
+ * most recent background or stopped job if spec is NULL.
+ */
+static struct job *parse_job_spec(const char *spec) {
+    if (spec == NULL) {
+        for (struct job *j = last_jobbie; j; j = j->prev) {
+            if (j->background) {
+                return j;
+            }
+        }
+        return NULL;
+    }
+    if (spec[0] == '%') {
+        spec++;
+    }
+    return find_job(atoi(spec));
+}
+
+/* Send SIGCONT to a stopped job. */
+static void continue_job(struct job *j) {
+    if (j->stopped == 0) {
+        return;
+    }
+    if (j->pgid) {
+        kill(-j->pgid, SIGCONT);
+    } else {
+        for (struct kiddo *k = j->kidlets; k; k = k->next) {
+            if (!k->done) {
+                kill(k->pid, SIGCONT);
+            }
+        }
+    }
+    // Do not wait for the WCONTINUED notifications to count it as running
+    for (struct kiddo *k = j->kidlets; k; k = k->next) {
+        k->stopped = false;
+    }
+    j->stopped = 0;
+}
+
+/* Handle a jobs command: list the background and stopped jobs.
+ * Jobs listed as done are forgotten, as notify_jobs() would.
+ */
+int handle_jobs(char **args, int stdin, outbuf *out, history *myhistory) {
+    reap_children();
+    for (struct job *j = jobbies, *next; j; j = next) {
+        const char *state;
+        next = j->next;
+        if (!j->background) {
+            continue;
+        }
+        if (j->running == 0) {
+            out_printf(out, "[%d]  %-8s  %s\n", j->id, "Done", j->cmdline);
+            free_job(j);
+            continue;
+        }
+        if (j->stopped == j->running) {
+            state = "Stopped";
+        } else {
+            state = "Running";
+        }
+        out_printf(out, "[%d]  %-8s  %s\n", j->id, state, j->cmdline);
+    }
+    return 42;
+}
+
+/* Handle a fg command: continue a job in the foreground and wait for it. */
+int handle_fg(char **args, int stdin, outbuf *out, history *myhistory) {
+    struct job *j = parse_job_spec(args[1]);
+    if (j == NULL) {
+        dprintf(2, "fg: no such job\n");
+        return -1;
+    }
+    out_printf(out, "%s\n", j->cmdline);
+    j->background = false;
+    continue_job(j);
+    if (wait_for_job(j, true, NULL) < 0) {
+        return -1;
+    }
+    return 42;
+}
+
+/* Handle a bg command: continue a stopped job in the background. */
+int handle_bg(char **args, int stdin, outbuf *out, history *myhistory) {
+    struct job *j = parse_job_spec(args[1]);
+    if (j == NULL) {
+        dprintf(2, "bg: no such job\n");
+        return -1;
+    }
+    continue_job(j);
+    out_printf(out, "[%d]  %s\n", j->id, j->cmdline);
+    return 42;
+}
+
+/* Handle a wait command: wait for the given jobs, or for every
+ * background job that is not stopped.
+ */
+int handle_wait(char **args, int stdin, outbuf *out, history *myhistory) {
+    if (args[1]) {
+        for (int i = 1; args[i]; i++) {
+            struct job *j = parse_job_spec(args[i]);
+            if (j == NULL) {
+                dprintf(2, "wait: no such job %s\n", args[i]);
+                return -1;
+            }
+            wait_for_job(j, false, NULL);
+        }
+        return 42;
+    }
+
+    for (struct job *j = jobbies, *next; j; j = next) {
+        // wait_for_job only ever frees j itself
+        next = j->next;
+        if (j->background && !(j->running > 0 && j->stopped == j->running)) {
+            wait_for_job(j, false, NULL);
+        }
+    }
+    return 42;
+}
+
+/* Wait for a task's job in the background, without handing it the
+ * terminal, which the other tasks share.
+ */
+static void wait_for_task(int job_id, int *exit_code) {
+    struct job *j = find_job(job_id);
+    if (j) {
+        wait_for_job(j, false, exit_code);
+    }
+}
+
+// A task of the parallel builtin: the command for one input
+struct task {
+    const char *input;
+    int job_id;
+    int fd;          // Read end of the pipe of its output, or -1
+    char *data;      // Its output so far
+    size_t len;
+    size_t cap;
+    int status;      // Its wstatus, once done
+    bool done;
+};
+
+/* Returns the number of CPUs the shell may run on, which is less than
+ * the number online if it has been confined with taskset or a cpuset.
+ */
+static int usable_cpus(void) {
+    cpu_set_t set;
+    long n;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/* Build the arguments of the task for input from the count words of
+ * tmpl: each {} in them becomes input, or if there is none, input is
+ * added as the last argument.
+ *
+ * Returns a NULL-terminated array, with the words, in one malloc()ed
+ * block, or NULL.
+ */
+static char **task_args(char **tmpl, int count, const char *input) {
+    size_t input_len = strlen(input);
+    size_t size = (count + 2) * sizeof(char *) + input_len + 1;
+    bool placed = false;
+    char **args, *p;
+    int n = 0;
+
+    for (int i = 0; i < count; i++) {
+        size += strlen(tmpl[i]) + 1;
+        for (const char *q = strstr(tmpl[i], "{}"); q; q = strstr(q + 2, "{}")) {
+            size += input_len;
+            placed = true;
+        }
+    }
+    args = malloc(size);
+    if (args == NULL) {
+        return NULL;
+    }
+    p = (char *) (args + count + 2);
+    for (int i = 0; i < count; i++) {
+        const char *w = tmpl[i], *q;
+        args[n++] = p;
+        while ((q = strstr(w, "{}"))) {
+            p = mempcpy(p, w, q - w);
+            p = mempcpy(p, input, input_len);
+            w = q + 2;
+        }
+        p = stpcpy(p, w) + 1;
+    }
+    if (!placed) {
+        args[n++] = strcpy(p, input);
+    }
+    args[n] = NULL;
+    return args;
+}
+
+/* Start the command of task t, as a job of its own, with its standard
+ * in from /dev/null and its standard out into a pipe.  A task that
+ * cannot be started is done right away, with status 127.
+ */
+static void start_task(struct task *t, char **tmpl, int count, history *myhistory) {
+    char **args = task_args(tmpl, count, t->input);
+    char *cmdline = NULL;
+    size_t len = 0;
+    int pipefd[2];
+    int in_fd, rv;
+
+    t->fd = -1;
+    t->status = 127 << 8;
+    t->done = true;
+    if (args == NULL || pipe2(pipefd, O_CLOEXEC) < 0) {
+        dprintf(2, "parallel: %s: %s\n", t->input, strerror(args ? errno : ENOMEM));
+        free(args);
+        return;
+    }
+    in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        in_fd = 0;
+    }
+
+    // The jobs builtin shows the task's own command line
+    for (char **a = args; *a; a++) {
+        len += strlen(*a) + 1;
+    }
+    cmdline = malloc(len);
+    if (cmdline) {
+        char *p = cmdline;
+        for (char **a = args; *a; a++) {
+            p = stpcpy(p, *a);
+            *p++ = ' ';
+        }
+        p[-1] = '\0';
+    }
+    t->job_id = create_job(cmdline);
+    free(cmdline);
+
+    rv = run_command(args, in_fd, pipefd[1], t->job_id, myhistory);
+    if (rv < 0) {
+        close(pipefd[0]);
+        if (rv != -1) {
+            dprintf(2, "parallel: %s: %s\n", args[0], strerror(-rv));
+        }
+        wait_for_task(t->job_id, NULL);
+        t->status = rv == -1 ? 1 << 8 : 127 << 8;
+    } else {
+        t->fd = pipefd[0];
+        t->done = false;
+    }
+    free(args);
+}
+
+/* Read what task t has written.  At the end of its output, reap it,
+ * and mark it done.
+ */
+static void drain_task(struct task *t) {
+    ssize_t n;
+
+    if (t->cap - t->len < 4096) {
+        size_t cap = t->cap ? t->cap * 2 : 8192;
+        char *tmp = realloc(t->data, cap);
+        if (tmp == NULL) {
+            // Out of memory; let the task see EPIPE
+            n = 0;
+            goto end;
+        }
+        t->data = tmp;
+        t->cap = cap;
+    }
+    n = read(t->fd, t->data + t->len, t->cap - t->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (n > 0) {
+        t->len += n;
+        return;
+    }
+end:
+    close(t->fd);
+    t->fd = -1;
+    wait_for_task(t->job_id, &t->status);
+    t->done = true;
+}
+
+/* Hand the output of a finished task to out, report its status, and
+ * free it.
+ *
+ * Returns true if the task failed.
+ */
+static bool finish_task(struct task *t, outbuf *out, bool show_status) {
+    int status = WIFEXITED(t->status) ? WEXITSTATUS(t->status) : 128 + WTERMSIG(t->status);
+
+    out_write(out, t->data, t->len);
+    drain_output(out);
+    free(t->data);
+    t->data = NULL;
+    if (show_status) {
+        dprintf(2, "%d\t%s\n", status, t->input);
+    } else if (WIFSIGNALED(t->status)) {
+        dprintf(2, "parallel: %s: killed by signal %d\n", t->input, WTERMSIG(t->status));
+    } else if (status != 0) {
+        dprintf(2, "parallel: %s: exit %d\n", t->input, status);
+    }
+    return status != 0;
+}
+
+/* Read all of fd, and split it into lines.  *lines is set to an array
+ * of them, which points into *buf; both are malloc()ed.
+ *
+ * Returns the number of lines, or -errno.
+ */
+static long read_inputs(int fd, char **buf, char ***lines) {
+    size_t len = 0, cap = 0, count = 0;
+    char *data = NULL;
+
+    for (;;) {
+        ssize_t n;
+        if (cap - len < 4096) {
+            char *tmp = realloc(data, cap ? cap * 2 : 8192);
+            if (tmp == NULL) {
+                free(data);
+                return -ENOMEM;
+            }
+            data = tmp;
+            cap = cap ? cap * 2 : 8192;
+        }
+        n = read(fd, data + len, cap - len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int err = errno;
+            free(data);
+            return -err;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    data[len] = '\0';
+    for (size_t i = 0; i < len; i++) {
+        count += data[i] == '\n';
+    }
+    *lines = malloc((count + 1) * sizeof(char *));
+    if (*lines == NULL) {
+        free(data);
+        return -ENOMEM;
+    }
+    count = 0;
+    for (char *p = data, *nl; *p; p = nl + 1) {
+        nl = strchr(p, '\n');
+        (*lines)[count++] = p;
+        if (nl == NULL) {
+            break;
+        }
+        *nl = '\0';
+    }
+    *buf = data;
+    return count;
+}
+
+/* Handle a parallel (or forall) command:
+ *
+ *   parallel [-j N] [-k] [-s] [-a file] command [args...] [::: inputs...]
+ *
+ * Run the command once per input, each {} in its arguments replaced
+ * with the input (or, with no {}, the input added as the last
+ * argument).  The inputs are the words after ':::', or else the lines
+ * of file (-a), or else of standard in.
+ *
+ * Up to N tasks (by default, one per CPU the shell may use) run at a
+ * time, each a job of its own started with run_command().  The output
+ * of each task is collected from a pipe, and written out whole: as
+ * each task finishes, or with -k, in the order of the inputs.  A
+ * slot is refilled as soon as its task's output ends, so one slow
+ * task holds up only its own slot.  In a pipeline, parallel runs in
+ * a child of its own (see fork_builtin()), so the stages after it
+ * read each task's output as soon as it is written.
+ *
+ * A task that fails is reported on standard error; -s reports the
+ * status of every task, as "STATUS<tab>INPUT".  The exit status is the
+ * number of failed tasks, up to 101.
+ */
+int handle_parallel(char **args, int stdin, outbuf *out, history *myhistory) {
+    int slots = 0;
+    bool keep_order = false, show_status = false;
+    const char *file = NULL;
+    char **tmpl, **inputs = NULL, *input_buf = NULL;
+    long count = 0;
+    int ntmpl = 0, i = 1;
+    struct task *tasks;
+    struct pollfd *fds;
+    size_t *active;
+    size_t next = 0, flushed = 0, running = 0, failed = 0;
+
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1]) {
+            slots = atoi(args[++i]);
+        } else if (strcmp(args[i], "-k") == 0) {
+            keep_order = true;
+        } else if (strcmp(args[i], "-s") == 0) {
+            show_status = true;
+        } else if (strcmp(args[i], "-a") == 0 && args[i + 1]) {
+            file = args[++i];
+        } else {
+            break;
+        }
+    }
+    tmpl = args + i;
+    while (tmpl[ntmpl] && strcmp(tmpl[ntmpl], ":::") != 0) {
+        ntmpl++;
+    }
+    if (ntmpl == 0) {
+        dprintf(2, "usage: %s [-j N] [-k] [-s] [-a file] command [args...] [::: inputs...]\n", args[0]);
+        out->status = 2;
+        return 42;
+    }
+    if (slots <= 0) {
+        slots = usable_cpus();
+    }
+
+    if (tmpl[ntmpl]) {
+        inputs = tmpl + ntmpl + 1;
+        while (inputs[count]) {
+            count++;
+        }
+        inputs = NULL;
+    } else {
+        int fd = file ? open(file, O_RDONLY | O_CLOEXEC) : stdin;
+        count = fd < 0 ? -errno : read_inputs(fd, &input_buf, &inputs);
+        if (file && fd >= 0) {
+            close(fd);
+        }
+        if (count < 0) {
+            dprintf(2, "%s: %s: %s\n", args[0], file ? file : "stdin", strerror(-count));
+            out->status = 2;
+            return 42;
+        }
+    }
+
+    tasks = calloc(count + 1, sizeof(struct task));
+    fds = malloc((slots + 1) * sizeof(struct pollfd));
+    active = malloc(slots * sizeof(size_t));
+    if (tasks == NULL || fds == NULL || active == NULL) {
+        free(tasks);
+        free(fds);
+        free(active);
+        free(inputs);
+        free(input_buf);
+        return -1;
+    }
+    for (long k = 0; k < count; k++) {
+        tasks[k].input = inputs ? inputs[k] : tmpl[ntmpl + 1 + k];
+    }
+
+    while (flushed < (size_t) count) {
+        // Fill the free slots
+        while (running < (size_t) slots && next < (size_t) count) {
+            start_task(&tasks[next], tmpl, ntmpl, myhistory);
+            if (!tasks[next].done) {
+                active[running++] = next;
+            } else if (!keep_order) {
+                // It could not be started
+                failed += finish_task(&tasks[next], out, show_status);
+                flushed++;
+            }
+            next++;
+        }
+
+        // Collect output until some task is done, and pass on what
+        // is held back for want of room in the pipe out
+        if (running > 0) {
+            size_t nfds = running;
+            for (size_t k = 0; k < running; k++) {
+                fds[k].fd = tasks[active[k]].fd;
+                fds[k].events = POLLIN;
+            }
+            if (out->capture && out->len > 0) {
+                fds[nfds].fd = out->fd;
+                fds[nfds++].events = POLLOUT;
+            }
+            if (poll(fds, nfds, -1) < 0 && errno != EINTR) {
+                dprintf(2, "%s: poll: %s\n", args[0], strerror(errno));
+                break;
+            }
+            if (nfds > running && fds[running].revents) {
+                drain_output(out);
+            }
+            for (size_t k = 0; k < running; k++) {
+                if (fds[k].revents) {
+                    drain_task(&tasks[active[k]]);
+                }
+            }
+            for (size_t k = 0; k < running; ) {
+                struct task *t = &tasks[active[k]];
+                if (!t->done) {
+                    k++;
+                    continue;
+                }
+                active[k] = active[--running];
+                if (!keep_order) {
+                    failed += finish_task(t, out, show_status);
+                    flushed++;
+                }
+            }
+        }
+
+        // In order, a task is finished once every task before it is
+        for (; keep_order && flushed < next && tasks[flushed].done; flushed++) {
+            failed += finish_task(&tasks[flushed], out, show_status);
+        }
+    }
+
+    // If poll() failed, read the running tasks to their ends one at
+    // a time, so that each is reaped and counted, and start no more
+    for (size_t k = 0; k < running; k++) {
+        struct task *t = &tasks[active[k]];
+        while (!t->done) {
+            drain_task(t);
+        }
+        if (!keep_order) {
+            failed += finish_task(t, out, show_status);
+            flushed++;
+        }
+    }
+    for (; keep_order && flushed < next; flushed++) {
+        failed += finish_task(&tasks[flushed], out, show_status);
+    }
+    failed += count - next;
+
+    free(tasks);
+    free(fds);
+    free(active);
+    free(inputs);
+    free(input_buf);
+    out->status = failed > 101 ? 101 : failed;
+    return 42;
+}
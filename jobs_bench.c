@@ -0,0 +1,83 @@
+/* Tar Heel SHell
+ *
+ * This file is a fork-storm benchmark for the job table.
+ * For growing numbers of concurrent background jobs, it
+ * times how long it takes to start them, how long a
+ * foreground command takes while they are all running,
+ * and how long it takes to reap them all.
+ *
+ */
+#include "thsh.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define FOREGROUND_RUNS 50
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Average microseconds to run /bin/true in the foreground */
+static double foreground_latency(void) {
+  char *args[] = { "/bin/true", NULL };
+  double start = now();
+
+  for (int i = 0; i < FOREGROUND_RUNS; i++) {
+    int status;
+    int job_id = create_job("/bin/true");
+    if (run_command(args, 0, 1, job_id, NULL) || wait_on_job(job_id, &status)) {
+      printf("Failed to run %s\n", args[0]);
+      exit(1);
+    }
+    // What the shell does before every prompt
+    notify_jobs();
+  }
+  return (now() - start) * 1e6 / FOREGROUND_RUNS;
+}
+
+int main(int argc, char **argv) {
+  int counts[] = { 0, 500, 1000, 2000, 4000 };
+  int max_jobs = argc > 1 ? atoi(argv[1]) : 4000;
+  char *sleep_args[] = { "/bin/sleep", "5", NULL };
+  char *wait_args[] = { "wait", NULL };
+
+  if (init_path() || init_jobs(false)) {
+    printf("Problem initializing the shell.\n");
+    return 1;
+  }
+
+  printf("%8s %14s %14s %12s\n", "bg_jobs", "spawn_us/job", "fg_true_us", "reap_all_ms");
+  for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])) && counts[i] <= max_jobs; i++) {
+    double start, spawn_us, fg_us, reap_ms;
+
+    start = now();
+    for (int n = 0; n < counts[i]; n++) {
+      int job_id = create_job("/bin/sleep 5 &");
+      if (run_command(sleep_args, 0, 1, job_id, NULL) || background_job(job_id)) {
+        printf("Failed to start background job %d\n", n);
+        return 1;
+      }
+    }
+    spawn_us = counts[i] ? (now() - start) * 1e6 / counts[i] : 0;
+
+    fg_us = foreground_latency();
+
+    // Stop the storm and time reaping every job
+    start = now();
+    char kill_cmd[64];
+    snprintf(kill_cmd, sizeof(kill_cmd), "pkill -P %d -x sleep", getpid());
+    system(kill_cmd);
+    outbuf out;
+    init_output(&out, 1);
+    handle_wait(wait_args, 0, &out, NULL);
+    flush_output(&out);
+    notify_jobs();
+    reap_ms = (now() - start) * 1e3;
+
+    printf("%8d %14.1f %14.1f %12.1f\n", counts[i], spawn_us, fg_us, reap_ms);
+  }
+  return 0;
+}
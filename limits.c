@@ -0,0 +1,540 @@
+/* Tar Heel SHell
+ *
+ * This module sets the niceness, CPU affinity and resource limits of
+ * the commands the shell starts.
+ *
+ * nice, taskset and ulimit work as prefixes, as in
+ *
+ *   nice -n 5 taskset -c 2,3 ulimit -v 4000000 sort big.txt
+ *
+ * where they apply to that one command only: run_command() collects
+ * them with parse_limits(), and the child applies them with
+ * apply_limits(), between fork() and execve().  This saves starting
+ * a nice or taskset binary just to start the command, and the
+ * command itself starts out pinned and capped, with no window where
+ * it runs unrestricted.  Builtins run in the shell itself, so a
+ * prefix on a builtin has no effect.
+ *
+ * Without a command, they apply to the shell, and so to every
+ * command it starts from then on (ulimit -v 4000000), or show the
+ * shell's current setting (nice, taskset, ulimit -a).
+ *
+ * spread on makes each stage of a pipeline run on a CPU of its own
+ * (see spread_cpu()), so that stages do not evict each other's data
+ * from a shared cache, or bounce between sockets.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "thsh.h"
+
+// The resources ulimit knows about, with the unit of their values
+static const struct limit_kind {
+    char opt;
+    int resource;
+    rlim_t unit;
+    const char *name;
+} limit_kinds[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (kbytes)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (kbytes)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)"},
+    {'m', RLIMIT_RSS, 1024, "max memory size (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+};
+#define NUM_LIMIT_KINDS ((int)(sizeof(limit_kinds) / sizeof(limit_kinds[0])))
+
+struct stage_limits {
+    bool set_nice;
+    int nice;                   // Added to the niceness
+    bool set_cpus;
+    cpu_set_t cpus;
+    int num_rlimits;
+    struct {
+        const struct limit_kind *kind;
+        rlim_t value;
+        bool soft, hard;        // Which of the two limits to set
+    } rlimits[NUM_LIMIT_KINDS];
+    // For the ulimit builtin: the limits to show
+    bool show_hard;
+    int num_shown;
+    const struct limit_kind *shown[NUM_LIMIT_KINDS];
+};
+
+// Whether to give each stage of a pipeline a CPU of its own
+static bool spread_stages = false;
+
+/* Parse a decimal number into *value.
+ *
+ * Returns true if all of s is one.
+ */
+static bool parse_number(const char *s, long long *value) {
+    char *end;
+    if (*s == '\0') {
+        return false;
+    }
+    errno = 0;
+    *value = strtoll(s, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+/* Parse the options of nice at args (-n N, or -N), into l.
+ *
+ * Returns the index of the first word after them, or -1 (with a
+ * message) if they are bad.
+ */
+static int parse_nice(char **args, stage_limits *l) {
+    long long n = 10;
+    int i = 1;
+
+    if (args[1] && strcmp(args[1], "-n") == 0) {
+        if (args[2] == NULL || !parse_number(args[2], &n)) {
+            dprintf(2, "nice: bad adjustment\n");
+            return -1;
+        }
+        i = 3;
+    } else if (args[1] && args[1][0] == '-' && parse_number(args[1] + 1, &n)) {
+        i = 2;
+    }
+    // A command with no adjustment gets the usual 10; nice prefixes add up
+    if (i > 1 || args[i]) {
+        l->set_nice = true;
+        l->nice += n;
+    }
+    return i;
+}
+
+/* Parse a CPU list, like 0-3,8,10, into set.
+ *
+ * Returns true on success.
+ */
+static bool parse_cpu_list(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        long first = strtol(s, &end, 10), last;
+        if (end == s || first < 0) {
+            return false;
+        }
+        last = first;
+        s = end;
+        if (*s == '-') {
+            last = strtol(s + 1, &end, 10);
+            if (end == s + 1 || last < first) {
+                return false;
+            }
+            s = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long c = first; c <= last; c++) {
+            CPU_SET(c, set);
+        }
+        if (*s == ',') {
+            s++;
+        } else if (*s) {
+            return false;
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/* Parse a hexadecimal CPU mask, like 0xf0, into set.
+ *
+ * Returns true on success.
+ */
+static bool parse_cpu_mask(const char *s, cpu_set_t *set) {
+    size_t len;
+
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s += 2;
+    }
+    len = strlen(s);
+    CPU_ZERO(set);
+    for (size_t i = 0; i < len; i++) {
+        char c = s[len - 1 - i];
+        int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        for (int bit = 0; bit < 4; bit++) {
+            if ((digit & (1 << bit)) && 4 * i + bit < CPU_SETSIZE) {
+                CPU_SET(4 * i + bit, set);
+            }
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/* Parse the options of taskset at args (-c LIST, or a MASK), into l.
+ *
+ * Returns the index of the first word after them, or -1 (with a
+ * message) if they are bad.
+ */
+static int parse_taskset(char **args, stage_limits *l) {
+    if (args[1] == NULL) {
+        return 1;
+    }
+    if (strcmp(args[1], "-c") == 0) {
+        if (args[2] == NULL || !parse_cpu_list(args[2], &l->cpus)) {
+            dprintf(2, "taskset: bad CPU list\n");
+            return -1;
+        }
+        l->set_cpus = true;
+        return 3;
+    }
+    if (!parse_cpu_mask(args[1], &l->cpus)) {
+        dprintf(2, "taskset: bad CPU mask %s\n", args[1]);
+        return -1;
+    }
+    l->set_cpus = true;
+    return 2;
+}
+
+/* Parse the options of ulimit at args into l: -S or -H for the soft
+ * or the hard limit only (both, by default), and a resource letter
+ * for each limit, followed by its value (a number, or "unlimited") to
+ * set it, or by nothing to show it.
+ *
+ * Returns the index of the first word after them, or -1 (with a
+ * message) if they are bad.
+ */
+static int parse_ulimit(char **args, stage_limits *l) {
+    bool soft = true, hard = true;
+    int i;
+
+    for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        char *value = NULL;
+        int consumed = 0;
+        for (const char *o = args[i] + 1; *o; o++) {
+            const struct limit_kind *k = NULL;
+            if (*o == 'S' || *o == 'H') {
+                soft = *o == 'S';
+                hard = *o == 'H';
+                l->show_hard = hard;
+                continue;
+            }
+            if (*o == 'a') {
+                for (int n = 0; n < NUM_LIMIT_KINDS; n++) {
+                    l->shown[n] = &limit_kinds[n];
+                }
+                l->num_shown = NUM_LIMIT_KINDS;
+                continue;
+            }
+            for (int n = 0; n < NUM_LIMIT_KINDS; n++) {
+                if (limit_kinds[n].opt == *o) {
+                    k = &limit_kinds[n];
+                }
+            }
+            if (k == NULL) {
+                dprintf(2, "ulimit: -%c: unknown option\n", *o);
+                return -1;
+            }
+
+            // The value, if any, is the word after the options
+            value = args[i + 1 + consumed];
+            if (value && (strcmp(value, "unlimited") == 0 || (value[0] >= '0' && value[0] <= '9'))) {
+                long long n = 0;
+                rlim_t v = RLIM_INFINITY;
+                if (value[0] != 'u' && (!parse_number(value, &n) || n < 0
+                        || (rlim_t) n > RLIM_INFINITY / k->unit)) {
+                    dprintf(2, "ulimit: %s: bad limit\n", value);
+                    return -1;
+                }
+                if (value[0] != 'u') {
+                    v = n * k->unit;
+                }
+                int r = 0;
+                while (r < l->num_rlimits && l->rlimits[r].kind != k) {
+                    r++;
+                }
+                l->rlimits[r].kind = k;
+                l->rlimits[r].value = v;
+                l->rlimits[r].soft = soft;
+                l->rlimits[r].hard = hard;
+                if (r == l->num_rlimits) {
+                    l->num_rlimits++;
+                }
+                consumed++;
+            } else if (l->num_shown < NUM_LIMIT_KINDS) {
+                l->shown[l->num_shown++] = k;
+            }
+        }
+        i += consumed;
+    }
+    return i;
+}
+
+/* Parse the settings of one prefix (nice, taskset or ulimit) at args
+ * into l.
+ *
+ * Returns the index of the first word after its options, 0 if args
+ * does not start with a prefix, or -1 if its options are bad.
+ */
+static int parse_prefix(char **args, stage_limits *l) {
+    if (strcmp(args[0], "nice") == 0) {
+        return parse_nice(args, l);
+    }
+    if (strcmp(args[0], "taskset") == 0) {
+        return parse_taskset(args, l);
+    }
+    if (strcmp(args[0], "ulimit") == 0) {
+        return parse_ulimit(args, l);
+    }
+    return 0;
+}
+
+/* Collect the nice, taskset and ulimit prefixes at the start of args
+ * (those followed by a command) into *limits, which is set to a
+ * malloc()ed stage_limits, or to NULL if there is nothing to set.
+ *
+ * cpu: a CPU to run on, unless a taskset prefix says otherwise, or
+ *      -1 (see spread_cpu()).
+ *
+ * Returns the number of words the prefixes take up, or -EINVAL (with
+ * a message) if one of them is bad.
+ */
+int parse_limits(char **args, int cpu, stage_limits **limits) {
+    stage_limits l;
+    int used = 0;
+
+    memset(&l, 0, sizeof(l));
+    for (;;) {
+        stage_limits next = l;
+        int n = parse_prefix(args + used, &next);
+        if (n < 0) {
+            return -EINVAL;
+        }
+        if (n == 0 || args[used + n] == NULL) {
+            // Not a prefix, or a prefix with no command: the command
+            break;
+        }
+        l = next;
+        used += n;
+    }
+    if (cpu >= 0 && !l.set_cpus) {
+        CPU_ZERO(&l.cpus);
+        CPU_SET(cpu, &l.cpus);
+        l.set_cpus = true;
+    }
+
+    *limits = NULL;
+    if (l.set_nice || l.set_cpus || l.num_rlimits) {
+        *limits = malloc(sizeof(l));
+        if (*limits == NULL) {
+            return -ENOMEM;
+        }
+        **limits = l;
+    }
+    return used;
+}
+
+/* Apply the settings in l to the calling process (the child, just
+ * before it runs the command, or the shell itself).  A niceness that
+ * cannot be set is only warned about, as nice(1) does.
+ *
+ * Returns 0 on success, -errno (with a message) on failure.
+ */
+int apply_limits(const stage_limits *l) {
+    if (l->set_nice) {
+        errno = 0;
+        int now = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, now + l->nice) < 0) {
+            dprintf(2, "nice: cannot set niceness: %s\n", strerror(errno));
+        }
+    }
+    if (l->set_cpus && sched_setaffinity(0, sizeof(l->cpus), &l->cpus) < 0) {
+        int err = errno;
+        dprintf(2, "taskset: %s\n", strerror(err));
+        return -err;
+    }
+    for (int i = 0; i < l->num_rlimits; i++) {
+        struct rlimit rl;
+        if (getrlimit(l->rlimits[i].kind->resource, &rl) < 0) {
+            return -errno;
+        }
+        if (l->rlimits[i].hard) {
+            rl.rlim_max = l->rlimits[i].value;
+            if (rl.rlim_cur > rl.rlim_max) {
+                rl.rlim_cur = rl.rlim_max;
+            }
+        }
+        if (l->rlimits[i].soft) {
+            rl.rlim_cur = l->rlimits[i].value;
+        }
+        if (setrlimit(l->rlimits[i].kind->resource, &rl) < 0) {
+            int err = errno;
+            dprintf(2, "ulimit: %s: %s\n", l->rlimits[i].kind->name, strerror(err));
+            return -err;
+        }
+    }
+    return 0;
+}
+
+/* Returns the CPU for stage (counting from 0) of a pipeline of more
+ * than one stage, or -1 to leave it to the scheduler.
+ *
+ * With spread on, stages take the CPUs the shell may run on in turn.
+ */
+int spread_cpu(int stage) {
+    cpu_set_t set;
+    int count, seen = 0;
+
+    if (!spread_stages || sched_getaffinity(0, sizeof(set), &set) < 0) {
+        return -1;
+    }
+    count = CPU_COUNT(&set);
+    if (count < 2) {
+        return -1;
+    }
+    stage %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && seen++ == stage) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* Handle a nice command with no command after it: show the shell's
+ * niceness, or change it by -n N.
+ *
+ * Returns 0, so that it is not taken as a builtin, if a command
+ * follows (run_command() runs it with the prefix applied).
+ */
+int handle_nice(char **args, int stdin, outbuf *out, history *myhistory) {
+    stage_limits l;
+    int i;
+
+    memset(&l, 0, sizeof(l));
+    i = parse_nice(args, &l);
+    if (i < 0) {
+        out->status = 2;
+    } else if (args[i]) {
+        return 0;
+    } else if (l.set_nice) {
+        apply_limits(&l);
+    } else {
+        out_printf(out, "%d\n", getpriority(PRIO_PROCESS, 0));
+    }
+    return 42;
+}
+
+/* Handle a taskset command with no command after it: show the CPUs
+ * the shell may run on, as a list, or pin the shell to -c LIST or
+ * a MASK.
+ *
+ * Returns 0 if a command follows, as handle_nice() does.
+ */
+int handle_taskset(char **args, int stdin, outbuf *out, history *myhistory) {
+    stage_limits l;
+    int i;
+
+    memset(&l, 0, sizeof(l));
+    i = parse_taskset(args, &l);
+    if (i < 0) {
+        out->status = 2;
+    } else if (args[i]) {
+        return 0;
+    } else if (l.set_cpus) {
+        if (apply_limits(&l) < 0) {
+            out->status = 1;
+        }
+    } else if (sched_getaffinity(0, sizeof(l.cpus), &l.cpus) == 0) {
+        const char *sep = "";
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            int last = cpu;
+            if (!CPU_ISSET(cpu, &l.cpus)) {
+                continue;
+            }
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &l.cpus)) {
+                last++;
+            }
+            if (last > cpu) {
+                out_printf(out, "%s%d-%d", sep, cpu, last);
+            } else {
+                out_printf(out, "%s%d", sep, cpu);
+            }
+            sep = ",";
+            cpu = last;
+        }
+        out_printf(out, "\n");
+    } else {
+        out->status = 1;
+    }
+    return 42;
+}
+
+/* Handle a ulimit command with no command after it: set the shell's
+ * limits, and show those asked for (the file size limit, if no
+ * option is given at all).
+ *
+ * Returns 0 if a command follows, as handle_nice() does.
+ */
+int handle_ulimit(char **args, int stdin, outbuf *out, history *myhistory) {
+    stage_limits l;
+    int i;
+
+    memset(&l, 0, sizeof(l));
+    i = parse_ulimit(args, &l);
+    if (i < 0) {
+        out->status = 2;
+        return 42;
+    }
+    if (args[i]) {
+        return 0;
+    }
+    if (l.num_rlimits && apply_limits(&l) < 0) {
+        out->status = 1;
+    }
+    if (l.num_rlimits == 0 && l.num_shown == 0) {
+        l.shown[l.num_shown++] = &limit_kinds[2];
+    }
+    for (int n = 0; n < l.num_shown; n++) {
+        const struct limit_kind *k = l.shown[n];
+        struct rlimit rl;
+        rlim_t v;
+        if (getrlimit(k->resource, &rl) < 0) {
+            out->status = 1;
+            continue;
+        }
+        v = l.show_hard ? rl.rlim_max : rl.rlim_cur;
+        if (l.num_shown > 1) {
+            out_printf(out, "%-28s(-%c) ", k->name, k->opt);
+        }
+        if (v == RLIM_INFINITY) {
+            out_printf(out, "unlimited\n");
+        } else {
+            out_printf(out, "%llu\n", (unsigned long long) (v / k->unit));
+        }
+    }
+    return 42;
+}
+
+/* Handle a spread command: show whether the stages of a pipeline
+ * are spread across CPUs, or turn it on or off.
+ */
+int handle_spread(char **args, int stdin, outbuf *out, history *myhistory) {
+    if (args[1] == NULL) {
+        out_printf(out, "%s\n", spread_stages ? "on" : "off");
+    } else if (strcmp(args[1], "on") == 0 || strcmp(args[1], "off") == 0) {
+        spread_stages = args[1][1] == 'n';
+    } else {
+        dprintf(2, "spread: expected on or off, not %s\n", args[1]);
+        out->status = 2;
+    }
+    return 42;
+}
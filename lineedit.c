@@ -0,0 +1,212 @@
+/* Tar Heel SHell
+ *
+ * This module reads a line from the terminal with minimal editing,
+ * including incremental reverse search of the history (Ctrl-R).
+ */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <sys/ttydefaults.h>
+#include "thsh.h"
+
+#define KEY_ESC 27
+#define KEY_DEL 127
+
+/* Returns true if the byte c is typed into the line as is: printable
+ * ASCII, a tab, or any byte of a UTF-8 sequence.
+ */
+static bool is_text(int c) {
+    return c == '\t' || (c >= ' ' && c != KEY_DEL);
+}
+
+/* Returns the length of the text at buf, of len bytes, less its last
+ * character (all the bytes of it, if it is a UTF-8 sequence).
+ */
+static size_t drop_char(const char *buf, size_t len) {
+    while (len > 0 && (buf[--len] & 0xc0) == 0x80) {
+    }
+    return len;
+}
+
+/* Redraw the current line: the prompt and what has been typed so far. */
+static void redraw_line(const char *buf, size_t len) {
+    write(1, "\r\033[K", 4);
+    print_prompt();
+    write(1, buf, len);
+}
+
+/* Redraw the line as the reverse search status. */
+static void redraw_search(const char *query, size_t qlen, history *myhistory, long match) {
+    size_t len = 0;
+    const char *entry = "";
+
+    if (match >= 0) {
+        entry = history_entry(myhistory, match, &len);
+    }
+    write(1, "\r\033[K", 4);
+    dprintf(1, "(%sreverse-i-search)`%.*s': %.*s",
+            (match < 0 && qlen) ? "failing " : "", (int) qlen, query, (int) len, entry);
+}
+
+/* Wait for a key, redrawing the line whenever the prompt changes
+ * (see prompt.c) in the meantime.
+ *
+ * Returns the result of read().
+ */
+static int read_key(int input_fd, unsigned char *key, const char *buf, size_t len) {
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = input_fd, .events = POLLIN },
+            { .fd = prompt_wakeup_fd(), .events = POLLIN },
+        };
+        if (fds[1].fd < 0) {
+            return read(input_fd, key, 1);
+        }
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return read(input_fd, key, 1);
+        }
+        if (fds[0].revents) {
+            return read(input_fd, key, 1);
+        }
+        if (fds[1].revents & POLLIN) {
+            redraw_line(buf, len);
+        }
+    }
+}
+
+/* Run an incremental reverse search, starting from an empty query.
+ *
+ * Each key typed extends the query and moves to the newest entry that
+ * contains it; Ctrl-R moves on to the next older match.  Enter accepts
+ * the match and runs it; Ctrl-G or Escape restores the original line.
+ * Any other key leaves the search with the match in the line.
+ *
+ * Returns the key that ended the search.
+ */
+static int reverse_search(int input_fd, char *buf, size_t size, size_t *len, history *myhistory) {
+    char query[MAX_INPUT] = "";
+    size_t qlen = 0;
+    long match = -1;
+    unsigned char c;
+
+    redraw_search(query, qlen, myhistory, match);
+    while (read(input_fd, &c, 1) == 1) {
+        long from = myhistory ? (long) myhistory->count : 0;
+
+        if (c == CTRL('r')) {
+            // Next older match, if the query has one
+            if (match >= 0) {
+                long older = search_history(myhistory, query, qlen, match);
+                if (older >= 0) {
+                    match = older;
+                }
+            }
+        } else if (c == KEY_DEL || c == CTRL('h')) {
+            qlen = drop_char(query, qlen);
+            match = qlen ? search_history(myhistory, query, qlen, from) : -1;
+        } else if (is_text(c)) {
+            if (qlen < sizeof(query) - 1) {
+                query[qlen++] = c;
+            }
+            // The current match stays if it still matches
+            match = search_history(myhistory, query, qlen, match >= 0 ? match + 1 : from);
+        } else {
+            if (c != CTRL('g') && c != KEY_ESC && match >= 0) {
+                size_t elen;
+                const char *entry = history_entry(myhistory, match, &elen);
+                *len = elen < size - 2 ? elen : size - 2;
+                memcpy(buf, entry, *len);
+            }
+            redraw_line(buf, *len);
+            return c;
+        }
+        redraw_search(query, qlen, myhistory, match);
+    }
+    redraw_line(buf, *len);
+    return CTRL('d');
+}
+
+/* Read one line of input from a terminal.
+ *
+ * The terminal is switched out of canonical mode for the duration of
+ * the line, so keys can be handled as they are typed: printable keys
+ * append, backspace deletes, Ctrl-U clears the line and Ctrl-R starts
+ * a reverse search of myhistory.  Ctrl-D on an empty line is the end
+ * of input.  The line is redrawn when the prompt changes while it is
+ * being typed.
+ *
+ * If input_fd is not a terminal, this is just read_one_line().
+ *
+ * buf, size and the return value are as for read_one_line().
+ */
+int read_interactive_line(int input_fd, char *buf, size_t size, history *myhistory) {
+    struct termios saved, raw;
+    size_t len = 0;
+    int c = 0;
+
+    if (!isatty(input_fd) || tcgetattr(input_fd, &saved) < 0) {
+        return read_one_line(input_fd, buf, size);
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(input_fd, TCSADRAIN, &raw);
+
+    while (1) {
+        unsigned char key;
+        if (read_key(input_fd, &key, buf, len) != 1) {
+            c = CTRL('d');
+            len = 0;
+            break;
+        }
+        c = key;
+
+        if (c == CTRL('r')) {
+            c = reverse_search(input_fd, buf, size, &len, myhistory);
+            if (c == CTRL('g') || c == KEY_ESC) {
+                continue;
+            }
+        }
+
+        if (c == '\r' || c == '\n') {
+            write(1, "\n", 1);
+            break;
+        } else if (c == CTRL('d')) {
+            if (len == 0) {
+                break;
+            }
+        } else if (c == KEY_DEL || c == CTRL('h')) {
+            if (len > 0) {
+                len = drop_char(buf, len);
+                write(1, "\b \b", 3);
+            }
+        } else if (c == CTRL('u')) {
+            len = 0;
+            redraw_line(buf, len);
+        } else if (c == KEY_ESC) {
+            // Swallow the rest of an escape sequence such as an arrow key
+            unsigned char seq[2];
+            if (read(input_fd, &seq[0], 1) == 1 && seq[0] == '[') {
+                read(input_fd, &seq[1], 1);
+            }
+        } else if (is_text(c) && len < size - 2) {
+            buf[len++] = c;
+            write(1, &buf[len - 1], 1);
+        }
+    }
+
+    tcsetattr(input_fd, TCSADRAIN, &saved);
+
+    if (c == CTRL('d') && len == 0) {
+        buf[0] = '\0';
+        return 0;
+    }
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    return len;
+}
@@ -7,228 +7,1248 @@
 #include <sys/types.h>
 #include "thsh.h"
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
-#include <dirent.h>
+#include <ctype.h>
+
+/* Size of the block requested from the kernel on each refill */
+#define READER_BLOCK 65536
+
+/* How a line reader may pull bytes from its file descriptor.
+ *
+ * The shell's own stdin is shared with the commands it runs, so it
+ * must never hold on to bytes past the end of the line it returns.
+ * Terminals already hand back at most one line per read(), a seekable
+ * stdin is rewound past any read-ahead, and anything else (a pipe)
+ * falls back to reading one byte at a time.
+ */
+enum reader_mode {
+    READER_BUFFERED,
+    READER_SEEKBACK,
+    READER_BYTE,
+};
+
+struct line_reader {
+    enum reader_mode mode;
+    char *data;
+    size_t head; // next unconsumed byte in data
+    size_t tail; // end of the valid bytes in data
+};
+
+// Line readers, indexed by file descriptor
+static struct line_reader **readers = NULL;
+static int num_readers = 0;
+
+/* Find (or create) the line reader for input_fd.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+static struct line_reader *get_reader(int input_fd) {
+    struct line_reader *r;
+
+    if (input_fd >= num_readers) {
+        int n = input_fd + 1;
+        struct line_reader **tmp = realloc(readers, n * sizeof(*readers));
+        if (tmp == NULL) {
+            return NULL;
+        }
+        memset(tmp + num_readers, 0, (n - num_readers) * sizeof(*readers));
+        readers = tmp;
+        num_readers = n;
+    }
+
+    r = readers[input_fd];
+    if (r) {
+        return r;
+    }
+
+    r = malloc(sizeof(struct line_reader));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->data = malloc(READER_BLOCK);
+    if (r->data == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->head = r->tail = 0;
+    r->mode = READER_BUFFERED;
+    if (input_fd == 0 && !isatty(input_fd)) {
+        r->mode = lseek(input_fd, 0, SEEK_CUR) < 0 ? READER_BYTE : READER_SEEKBACK;
+    }
+    readers[input_fd] = r;
+    return r;
+}
+
+/* Drop the line reader of input_fd, with anything it has read ahead.
+ * This must be called before input_fd is closed or replaced (dup2()),
+ * since a later file given the same number would otherwise be handed
+ * the old file's bytes first.
+ */
+void close_reader(int input_fd) {
+    struct line_reader *r;
+
+    if (input_fd < 0 || input_fd >= num_readers || readers[input_fd] == NULL) {
+        return;
+    }
+    r = readers[input_fd];
+    readers[input_fd] = NULL;
+    free(r->data);
+    free(r);
+}
 
 /* This function returns one line from input_fd
+ *
+ * Input is read in large blocks and kept in a buffer per file
+ * descriptor, so most lines cost no system call at all.  The buffer
+ * lives until close_reader() is called on input_fd.
  *
  * buf is populated with the contents, including the newline, and
  *      including a null terminator.  Must point to a buffer
  *      allocated by the caller, and may not be NULL.
  *
- * size is the size of *buf
+ * size is the size of *buf.  A line longer than size - 1 is
+ *      returned in pieces over several calls.
  *
  * Return value: the length of the string (not counting the null terminator)
  *               zero indicates the end of the input file.
  *               a negative value indicates an error (e.g., -errno)
  */
 int read_one_line(int input_fd, char *buf, size_t size) {
-    int count, rv;
-    // pointer to next place in cmd to store a character
-    char *cursor;
-    // the last character that was written into cmd
-    char last_char;
+    struct line_reader *r;
+    size_t count = 0;
 
     assert (buf);
+    assert (size > 1);
 
-    /*
-     * We want to continue reading characters until:
-     *   - read() fails (rv will become 0) OR
-     *   - count == MAX_INPUT-1 (we have no buffer space left) OR
-     *   - last_char was '\n'
-     * so we continue the loop while:
-     *   rv is nonzero AND count < MAX_INPUT - 1 AND last_char != '\n'
-     *
-     * On every iteration, we:
-     *   - increment cursor to advance to the next char in the cmd buffer
-     *   - increment count to indicate we've stored another char in cmd
-     *     (this is done during the loop termination check with "++count")
-     *
-     * To make the termination check work as intended, the loop starts by:
-     *   - setting rv = 1 (so it's initially nonzero)
-     *   - setting count = 0 (we've read no characters yet)
-     *   - setting cursor = cmd (cursor at start of cmd buffer)
-     *   - setting last_char = 1 (so it's initially not '\n')
-     *
-     * In summary:
-     *   - START:
-     *      set rv = 1, count = 0, cursor = cmd, last_char = 1
-     *   - CONTINUE WHILE:
-     *      rv (is nonzero) && count < MAX_INPUT - 1 && last_char != '\n'
-     *   - UPDATE PER ITERATION:
-     *      increment count and cursor
-     */
-    for (rv = 1, count = 0, cursor = buf, last_char = 1;
-            rv && (last_char != '\n') && (++count < (size - 1)); cursor++) {
-
-        // read one character
-        // file descriptor 0 -> reading from stdin
-        // writing this one character to cursor (current place in cmd buffer)
-        rv = read(input_fd, cursor, 1);
-        last_char = *cursor;
+    if (input_fd < 0) {
+        return -EBADF;
+    }
+    r = get_reader(input_fd);
+    if (r == NULL) {
+        return -ENOMEM;
+    }
+
+    while (count < size - 1) {
+        char *newline;
+        size_t take;
+
+        // Refill the buffer once everything in it is consumed
+        if (r->head == r->tail) {
+            ssize_t rv = read(input_fd, r->data,
+                    r->mode == READER_BYTE ? 1 : READER_BLOCK);
+            if (rv < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            r->head = 0;
+            r->tail = rv;
+            if (rv == 0) {
+                // End of file; hand back whatever is left of the last line
+                break;
+            }
+        }
+
+        // Copy up to (and including) the next newline, if there is room
+        take = r->tail - r->head;
+        newline = memchr(r->data + r->head, '\n', take);
+        if (newline) {
+            take = newline - (r->data + r->head) + 1;
+        }
+        if (take > size - 1 - count) {
+            take = size - 1 - count;
+            newline = NULL;
+        }
+        memcpy(buf + count, r->data + r->head, take);
+        r->head += take;
+        count += take;
+
+        if (newline) {
+            break;
+        }
     }
     // null terminate cmd buffer (so that it will print correctly)
-    *cursor = '\0';
+    buf[count] = '\0';
 
-    // Deal with an error from the read call
-    if (!rv) {
-        count = -errno;
+    // Give any read-ahead back to the file, so children see it
+    if (r->mode == READER_SEEKBACK && r->head < r->tail) {
+        lseek(input_fd, -(off_t)(r->tail - r->head), SEEK_CUR);
+        r->head = r->tail = 0;
     }
 
     return count;
 }
 
-/* Check is a file matches a glob.
+/* Like read_one_line(), but the whole line is returned, however long.
  *
- * This function takes in a simple file glob (such as '*.c')
- * and a file name, and returns 1 if it matches, and 0 if not.
+ * *buf is a malloc()ed buffer of *size bytes (or NULL and 0), which is
+ * grown to fit the line.
+ *
+ * Return value: the length of the line, zero at the end of the input
+ *               file, or -errno on error.
  */
-static int glob_matches(const char *glob, char *name) {
-    return strstr(name, glob) != NULL && name[0] != '.';
+int read_whole_line(int input_fd, char **buf, size_t *size) {
+    size_t count = 0;
+
+    for (;;) {
+        int rv;
+        if (*size - count < MAX_INPUT) {
+            size_t new_size = *size ? 2 * *size : 4 * MAX_INPUT;
+            char *tmp = realloc(*buf, new_size);
+            if (tmp == NULL) {
+                return -ENOMEM;
+            }
+            *buf = tmp;
+            *size = new_size;
+        }
+        rv = read_one_line(input_fd, *buf + count, *size - count);
+        if (rv < 0) {
+            return rv;
+        }
+        count += rv;
+        // Done at a newline, or at the end of the file
+        if (rv == 0 || (*buf)[count - 1] == '\n') {
+            return count;
+        }
+    }
 }
 
-/* Expand a file glob.
- *
- * This function takes in a simple file glob (such as '*.c')
- * and expands it to all matching files in the current working directory.
- * If the glob does not match anything, pass the glob through to the application as an argument.
- *
- * glob: The glob must be simple - only one asterisk as the first character,
- * with 0+ non-special characters following it.
- *
- * buf: A double pointer to scratch buffer allocated by the caller and good for the life of the command,
- *      which one may place expanded globs in.  The double pointer allows you to update the offset
- *      into the buffer.
- *
- * bufsize: _pointer_ to the remaining space in the buffer.  If too many files match, this space may be exceeded,
- *      in which case, the function returns -ENOSPC
+/* Size of the first block of an arena, and of the largest
+ * block it grows to (bigger requests get a block of their own)
+ */
+#define ARENA_FIRST_BLOCK 4096
+#define ARENA_MAX_BLOCK (1024 * 1024)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    max_align_t data[];
+};
+
+/* Allocate size bytes from arena a.
  *
- * commands: Same argumetn as passed to parse_line
+ * Memory is carved out of large blocks and only given back, all at
+ * once, by arena_reset() or arena_free().
  *
- * pipeline_idx: Index into command array for the current pipeline
+ * Returns NULL if memory could not be allocated.
+ */
+void *arena_alloc(arena *a, size_t size) {
+    void *p;
+
+    // Keep every allocation aligned like malloc()'s
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (size > a->left) {
+        size_t block = a->blocks ? 2 * a->blocks->size : ARENA_FIRST_BLOCK;
+        struct arena_block *b;
+        if (block > ARENA_MAX_BLOCK) {
+            block = ARENA_MAX_BLOCK;
+        }
+        if (block < size) {
+            block = size;
+        }
+        b = malloc(sizeof(struct arena_block) + block);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->size = block;
+        b->next = a->blocks;
+        a->blocks = b;
+        a->next = (char *) b->data;
+        a->left = block;
+    }
+    p = a->next;
+    a->next += size;
+    a->left -= size;
+    return p;
+}
+
+/* Release everything allocated from a, keeping its first block
+ * for reuse.
+ */
+void arena_reset(arena *a) {
+    while (a->blocks && a->blocks->next) {
+        struct arena_block *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+    a->next = a->blocks ? (char *) a->blocks->data : NULL;
+    a->left = a->blocks ? a->blocks->size : 0;
+}
+
+/* Release everything allocated from a, and its blocks. */
+void arena_free(arena *a) {
+    arena_reset(a);
+    free(a->blocks);
+    a->blocks = NULL;
+    a->next = NULL;
+    a->left = 0;
+}
+
+/* Append word to list.
  *
- * arg_idx: _Pointer_ to the current argument index.  May be incremented as
- *         a glob is expanded.
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+int wordlist_add(wordlist *list, char *word) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? 2 * list->cap : 16;
+        char **tmp = realloc(list->words, cap * sizeof(char *));
+        if (tmp == NULL) {
+            return -ENOMEM;
+        }
+        list->words = tmp;
+        list->cap = cap;
+    }
+    list->words[list->count++] = word;
+    return 0;
+}
+
+/* A line is tokenized once, by compile_line(), into a flat string of
+ * tokens, which bind_line() then turns into a command_line.  Tokens
+ * hold no pointers, so a compiled line can be copied, or saved to disk
+ * with a compiled script (see script.c), and bound any number of times
+ * without scanning the text again.
  *
- * Returns 0 on success, -errno on error
+ * Each token starts with its kind.  Word tokens go on with a flags
+ * byte and the unquoted, NUL-terminated word, followed by the
+ * NUL-terminated glob pattern if W_GLOB is set.  The last token is
+ * TOK_END.
  */
-static int expand_glob(char *glob, char **buf, size_t *bufsize,
-        char *commands [MAX_PIPELINE][MAX_ARGS], int pipeline_idx, int *arg_idx) {
+enum token_kind {
+    TOK_END,
+    TOK_ARG,        // An argument of the current stage
+    TOK_INFILE,     // The file named after '<'
+    TOK_OUTFILE,    // The file named after '>'
+    TOK_PIPE,       // '|' ends the current stage
+    TOK_BACKGROUND, // '&'
+    TOK_HEREDOC,    // The body of a here-document, from the lines after
+    TOK_HERESTRING, // The word after '<<<'
+};
+
+// Flags of a word token
+#define W_GLOB  1   // A glob pattern follows the word
+#define W_VARS  2   // The word (and pattern) have variables or substitutions
+#define W_SPLIT 4   // The word is a single unquoted $NAME or $(...), split on blanks
+#define W_PROC  8   // The word is PROC_IN or PROC_OUT and a command
+
+// A variable reference is kept in a word as VAR_BEGIN, the name, VAR_END
+#define VAR_BEGIN '\001'
+#define VAR_END   '\002'
+// and a command substitution as CMD_BEGIN, the command, CMD_END
+#define CMD_BEGIN '\003'
+#define CMD_END   '\004'
+// The first byte of a process substitution word, <(...) or >(...)
+#define PROC_IN   '<'
+#define PROC_OUT  '>'
+
+// A here-document whose body follows the current line
+struct heredoc {
+    char *delim;      // Its end marker, unquoted
+    size_t len;
+    bool quoted;      // Part of the marker was quoted: no expansion
+    bool strip_tabs;  // '<<-': drop the leading tabs of each line
+};
+
+// Tokenizer states
+enum scan_state {
+    SCAN_SPACE,   // Between words
+    SCAN_WORD,    // In an unquoted part of a word
+    SCAN_SINGLE,  // Inside '...'
+    SCAN_DOUBLE,  // Inside "..."
+};
+
+/* Length of the variable reference after a '$' at p, which is NAME or
+ * {NAME}, or 0 if there is none.  The name is returned in *name and
+ * *name_len.
+ */
+static size_t var_ref(const char *p, size_t left, const char **name, size_t *name_len) {
+    bool braces = left > 0 && p[0] == '{';
+    size_t n = 0;
+
+    if (braces) {
+        p++;
+        left--;
+    }
+    while (n < left && (p[n] == '_' || isalpha((unsigned char) p[n])
+                || (n > 0 && isdigit((unsigned char) p[n])))) {
+        n++;
+    }
+    if (n == 0 || (braces && (n == left || p[n] != '}'))) {
+        return 0;
+    }
+    *name = p;
+    *name_len = n;
+    return braces ? n + 2 : n;
+}
 
-    DIR *d = opendir(".");
-    struct dirent *curr = readdir(d);
-    
-    int found = 0;
+/* Find the end of the command substitution that starts at p, just
+ * after its '$(' (or its '`', if backquoted), and set *len to the
+ * length of the command in it.
+ *
+ * Returns false if it is never closed.
+ */
+static bool subst_end(const char *p, size_t left, bool backquoted, size_t *len) {
+    char quote = 0;
+    int depth = 1;
 
-    glob++;
-    while (curr != NULL) {
-        if (glob_matches(glob, curr->d_name)) {
-          commands[pipeline_idx][(*arg_idx)++] = curr->d_name;
-          found++;
+    for (size_t n = 0; n < left; n++) {
+        char c = p[n];
+        if (quote == '\'') {
+            quote = c == '\'' ? 0 : quote;
+        } else if (c == '\\') {
+            n++;
+        } else if (backquoted) {
+            if (c == '`') {
+                *len = n;
+                return true;
+            }
+        } else if (quote == '"') {
+            quote = c == '"' ? 0 : quote;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            *len = n;
+            return true;
         }
-        curr = readdir(d);
     }
+    return false;
+}
 
-    closedir(d);
-    return found;
+/* Copy the len bytes of the command of a substitution at src to dst;
+ * in a backquoted one, a backslash quotes `, $ and itself.
+ *
+ * Returns the end of the copy.
+ */
+static char *copy_subst(char *dst, const char *src, size_t len, bool backquoted) {
+    for (size_t n = 0; n < len; n++) {
+        if (backquoted && src[n] == '\\' && n + 1 < len && strchr("`$\\", src[n + 1])) {
+            n++;
+        }
+        *dst++ = src[n];
+    }
+    return dst;
 }
 
+/* Finish the word token whose flags byte is at flags, and whose text
+ * ends at out.  pattern is its glob pattern, if glob is set.
+ *
+ * Returns the end of the token.
+ */
+static char *end_word(char *out, char *flags, char *pattern, size_t pattern_len,
+        bool glob, int vars, bool literal) {
+    *out++ = '\0';
+    *flags = vars ? W_VARS : 0;
+    // Files after '<' and '>' are neither split nor globbed
+    if (flags[-1] != TOK_ARG) {
+        return out;
+    }
+    if (vars == 1 && !literal) {
+        *flags |= W_SPLIT;
+    } else if (glob) {
+        pattern[pattern_len] = '\0';
+        if (has_glob(pattern)) {
+            *flags |= W_GLOB;
+            memcpy(out, pattern, pattern_len + 1);
+            out += pattern_len + 1;
+        }
+    }
+    return out;
+}
 
-/* Parse one line of input.
+/* Read the end marker of a here-document from inbuf, starting after
+ * the '<<' that ends at inbuf[*i].  Quotes and backslashes in the
+ * marker are removed, and mark the document as quoted.  *i is left at
+ * the marker's last character.
  *
- * This function should populate a two-dimensional array of commands
- * and tokens.  The array itself should be pre-allocated by the
- * caller.
+ * Returns 0 on success, -errno on failure (-EINVAL if there is none).
+ */
+static int here_delimiter(const char *inbuf, size_t length, size_t *i, arena *a, struct heredoc *doc) {
+    size_t n = *i + 1;
+    char quote = 0;
+
+    doc->strip_tabs = n < length && inbuf[n] == '-';
+    n += doc->strip_tabs;
+    while (n < length && (inbuf[n] == ' ' || inbuf[n] == '\t')) {
+        n++;
+    }
+    doc->delim = arena_alloc(a, length - n + 1);
+    if (doc->delim == NULL) {
+        return -ENOMEM;
+    }
+    doc->len = 0;
+    doc->quoted = false;
+    for (; n < length; n++) {
+        char c = inbuf[n];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else {
+                doc->delim[doc->len++] = c;
+            }
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            doc->quoted = true;
+        } else if (c == '\\' && n + 1 < length && inbuf[n + 1] != '\n') {
+            doc->delim[doc->len++] = inbuf[++n];
+            doc->quoted = true;
+        } else if (strchr(" \t\n|<>&", c)) {
+            break;
+        } else {
+            doc->delim[doc->len++] = c;
+        }
+    }
+    if (quote || (doc->len == 0 && !doc->quoted)) {
+        return -EINVAL;
+    }
+    *i = n - 1;
+    return 0;
+}
+
+/* Copy the body of the here-document doc, from inbuf[*i] up to the
+ * line holding just its marker, into a TOK_HEREDOC token at out.
+ * Unless the marker was quoted, $NAME and ${NAME} become variable
+ * references, and a backslash quotes $, ` and itself, or joins lines.
+ * *i is moved past the marker's line.
  *
- * The first level of the array is each stage in a pipeline, at most MAX_PIPELINE long.
- * The second level of the array is each argument to a given command, at most MAX_ARGS entries.
- * In each command buffer, the entry after the last valid entry should be NULL.
- * After the last valid pipeline buffer, there should be one command entry with just a NULL.
+ * Returns the end of the token, or NULL if the marker never comes.
+ */
+static char *here_body(char *out, const char *inbuf, size_t length, size_t *i, const struct heredoc *doc) {
+    char *flags;
+    int vars = 0;
+    size_t n = *i;
+
+    *out++ = TOK_HEREDOC;
+    flags = out++;
+    while (n < length) {
+        const char *nl;
+        size_t end;
+
+        while (doc->strip_tabs && n < length && inbuf[n] == '\t') {
+            n++;
+        }
+        nl = memchr(inbuf + n, '\n', length - n);
+        end = nl ? (size_t) (nl - inbuf) : length;
+        if (end - n == doc->len && memcmp(inbuf + n, doc->delim, doc->len) == 0) {
+            *out++ = '\0';
+            *flags = vars ? W_VARS : 0;
+            *i = nl ? end + 1 : end;
+            return out;
+        }
+        if (nl == NULL) {
+            break;
+        }
+        for (; n <= end; n++) {
+            const char *name;
+            size_t name_len, skip;
+            char c = inbuf[n];
+
+            if (doc->quoted) {
+                *out++ = c;
+            } else if (c == '\\' && n < end && strchr("\\$`", inbuf[n + 1])) {
+                *out++ = inbuf[++n];
+            } else if (c == '\\' && n + 1 == end) {
+                // A backslash-newline joins the lines
+                n++;
+            } else if (c == '$' && (skip = var_ref(inbuf + n + 1, end - n - 1, &name, &name_len))) {
+                *out++ = VAR_BEGIN;
+                memcpy(out, name, name_len);
+                out += name_len;
+                *out++ = VAR_END;
+                vars++;
+                n += skip;
+            } else {
+                *out++ = c;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Tokenize one command, see parse_line() for the syntax.
  *
- * inbuf: a NULL-terminated buffer of input.
- *        This buffer may be changed by the function
- *        (e.g., changing some characters to \0).
+ * The command ends at the end of its line, or after the body of the
+ * last here-document it starts; *used (if not NULL) is set to its
+ * length.  A newline inside quotes, or after a backslash, does not end
+ * the line.
  *
- * length: the length of the string in inbuf.  Should be
- *         less than the size of inbuf.
+ * The tokens, and scratch space, are allocated from a; *tokens is set
+ * to the first one.  Variables are not expanded, and globs not matched,
+ * until the tokens are bound with bind_line().
  *
- * commands: a two-dimensional array of character pointers, allocated by the caller, which
- *           this function populates.
- *
- * scratch: A caller-allocated buffer that can be used for scratch space, such as
- *          expanding globs in the challenge problems.  You may not need to use this
- *          for the core assignment.
- *
- * scratch_len: Size of the scratch buffer
- *
- * return value: Number of entries populated in commands (1+, not counting the NULL),
-*               or -errno on failure.
-*
-*               In the case of a line with no actual commands (e.g.,
-        *               a line with just comments), return 0.
-*/
-int parse_line (char *inbuf, size_t length,
-        char *commands [MAX_PIPELINE][MAX_ARGS],
-        char **infile, char **outfile,
-        char *scratch, size_t scratch_len) {
-
-    //When we see the start of a comment we replace # with \0 to end parsing
-    for (int index = 0; inbuf[index]; index++) {
-        if (inbuf[index] == '#') {
-            inbuf[index] = '\0';
+ * Returns the size of the tokens in bytes, or -errno on failure
+ * (-EINVAL for a syntax error, such as an unterminated quote, or
+ * -EAGAIN if inbuf ends before a here-document does).
+ */
+int compile_command(const char *inbuf, size_t length, arena *a, char **tokens, size_t *used) {
+    enum scan_state state = SCAN_SPACE;
+    char target = TOK_ARG;    // Kind of the next word token
+    bool in_word = false;     // A word has started (even an empty "")
+    bool glob = false;        // The word has unquoted glob characters
+    bool literal = false;     // The word is more than one unquoted $NAME
+    int vars = 0;             // Variable references in the word
+    bool after_amp = false;   // Only blanks and comments may follow '&'
+    struct heredoc *docs = NULL;  // Here-documents whose bodies follow
+    int ndocs = 0;
+    bool bodies = false;      // The line, before any here-documents, has ended
+    size_t end = length;      // End of the command in inbuf
+    char *out, *flags = NULL, *pattern;
+    size_t pattern_len = 0;
+    int rv = 0;
+
+    // A word token takes at most three bytes per character of input,
+    // and a glob pattern may escape every character of its word
+    out = *tokens = arena_alloc(a, 4 * length + 16);
+    pattern = arena_alloc(a, 2 * length + 1);
+    if (out == NULL || pattern == NULL) {
+        return -ENOMEM;
+    }
+
+// Start a word token, unless one is open
+#define BEGIN_WORD() do { \
+        if (!in_word) { \
+            *out++ = target; \
+            flags = out++; \
+            in_word = true; \
+        } \
+    } while (0)
+
+// Add c to the current word; quoted glob characters are escaped in the pattern
+#define PUT(c, quoted) do { \
+        BEGIN_WORD(); \
+        if ((quoted) && strchr("*?[]\\", (c))) { \
+            pattern[pattern_len++] = '\\'; \
+        } \
+        *out++ = (c); \
+        pattern[pattern_len++] = (c); \
+        literal = true; \
+    } while (0)
+
+// Add the command substitution at text to the current word
+#define PUT_CMD(text, text_len, backquoted, quoted) do { \
+        BEGIN_WORD(); \
+        *out++ = pattern[pattern_len++] = CMD_BEGIN; \
+        out = copy_subst(out, (text), (text_len), (backquoted)); \
+        pattern_len = copy_subst(pattern + pattern_len, (text), (text_len), (backquoted)) - pattern; \
+        *out++ = pattern[pattern_len++] = CMD_END; \
+        literal |= (quoted); \
+        vars++; \
+    } while (0)
+
+// Add a reference to the variable name to the current word
+#define PUT_VAR(name, name_len, quoted) do { \
+        BEGIN_WORD(); \
+        *out++ = pattern[pattern_len++] = VAR_BEGIN; \
+        memcpy(out, (name), (name_len)); \
+        memcpy(pattern + pattern_len, (name), (name_len)); \
+        out += (name_len); \
+        pattern_len += (name_len); \
+        *out++ = pattern[pattern_len++] = VAR_END; \
+        literal |= (quoted); \
+        vars++; \
+    } while (0)
+
+    for (size_t i = 0; i < length && rv == 0; i++) {
+        char c = inbuf[i];
+        const char *name;
+        size_t name_len, n;
+
+        if (state == SCAN_SINGLE) {
+            if (c == '\'') {
+                state = SCAN_WORD;
+            } else {
+                PUT(c, true);
+            }
+            continue;
+        }
+        if (state == SCAN_DOUBLE) {
+            if (c == '"') {
+                state = SCAN_WORD;
+            } else if (c == '\\' && i + 1 < length && strchr("\\\"$`\n", inbuf[i + 1])) {
+                if (inbuf[++i] != '\n') {
+                    PUT(inbuf[i], true);
+                }
+            } else if ((c == '`' || (c == '$' && i + 1 < length && inbuf[i + 1] == '('))) {
+                bool backquoted = c == '`';
+                size_t start = i + 2 - backquoted;
+                if (!subst_end(inbuf + start, length - start, backquoted, &n)) {
+                    rv = -EINVAL;
+                    break;
+                }
+                PUT_CMD(inbuf + start, n, backquoted, true);
+                i = start + n;
+            } else if (c == '$' && (n = var_ref(inbuf + i + 1, length - i - 1, &name, &name_len))) {
+                PUT_VAR(name, name_len, true);
+                i += n;
+            } else {
+                PUT(c, true);
+            }
+            continue;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '|' || c == '<' || c == '>' || c == '&') {
+            // End of a word
+            if (in_word) {
+                out = end_word(out, flags, pattern, pattern_len, glob, vars, literal);
+                pattern_len = 0;
+                vars = 0;
+                in_word = glob = literal = false;
+                target = TOK_ARG;
+            }
+            state = SCAN_SPACE;
+            if (c == '\n') {
+                // The end of the line, and of the command, after the
+                // bodies of its here-documents
+                bodies = true;
+                i++;
+                for (int d = 0; d < ndocs && out; d++) {
+                    out = here_body(out, inbuf, length, &i, &docs[d]);
+                }
+                if (out == NULL) {
+                    rv = -EAGAIN;
+                }
+                end = i;
+                break;
+            }
+            if (c == ' ' || c == '\t' || c == '\n') {
+                continue;
+            }
+            if ((c == '<' || c == '>') && i + 1 < length && inbuf[i + 1] == '(' && !after_amp) {
+                // A process substitution: a word of its own, which may
+                // also be the file after a '<' or '>'
+                if (!subst_end(inbuf + i + 2, length - i - 2, false, &n)) {
+                    rv = -EINVAL;
+                    break;
+                }
+                *out++ = target;
+                *out++ = W_PROC;
+                *out++ = c == '<' ? PROC_IN : PROC_OUT;
+                memcpy(out, inbuf + i + 2, n);
+                out += n;
+                *out++ = '\0';
+                target = TOK_ARG;
+                i += n + 2;
+                continue;
+            }
+            if (after_amp || target != TOK_ARG) {
+                // e.g. 'a & b' or 'a > | b'
+                rv = -EINVAL;
+            } else if (c == '|') {
+                *out++ = TOK_PIPE;
+            } else if (c == '<' && i + 2 < length && inbuf[i + 1] == '<' && inbuf[i + 2] == '<') {
+                target = TOK_HERESTRING;
+                i += 2;
+            } else if (c == '<' && i + 1 < length && inbuf[i + 1] == '<') {
+                if (docs == NULL) {
+                    docs = arena_alloc(a, (length / 2 + 1) * sizeof(struct heredoc));
+                    if (docs == NULL) {
+                        rv = -ENOMEM;
+                        continue;
+                    }
+                }
+                i++;
+                rv = here_delimiter(inbuf, length, &i, a, &docs[ndocs++]);
+            } else if (c == '<') {
+                target = TOK_INFILE;
+            } else if (c == '>') {
+                target = TOK_OUTFILE;
+            } else {
+                *out++ = TOK_BACKGROUND;
+                after_amp = true;
+            }
+            continue;
+        }
+        if (c == '#' && state == SCAN_SPACE) {
+            // The comment ends with the line, which here-documents follow
+            while (i + 1 < length && inbuf[i + 1] != '\n') {
+                i++;
+            }
+            continue;
+        }
+        if (after_amp) {
+            rv = -EINVAL;
             break;
         }
+
+        state = SCAN_WORD;
+        if (c == '\'' || c == '"') {
+            state = c == '\'' ? SCAN_SINGLE : SCAN_DOUBLE;
+            BEGIN_WORD();
+            literal = true;
+        } else if (c == '\\' && i + 1 < length) {
+            // A backslash-newline joins the lines
+            if (inbuf[++i] != '\n') {
+                PUT(inbuf[i], true);
+            }
+        } else if (c == '`' || (c == '$' && i + 1 < length && inbuf[i + 1] == '(')) {
+            bool backquoted = c == '`';
+            size_t start = i + 2 - backquoted;
+            if (!subst_end(inbuf + start, length - start, backquoted, &n)) {
+                rv = -EINVAL;
+                break;
+            }
+            PUT_CMD(inbuf + start, n, backquoted, false);
+            i = start + n;
+        } else if (c == '$' && (n = var_ref(inbuf + i + 1, length - i - 1, &name, &name_len))) {
+            PUT_VAR(name, name_len, false);
+            i += n;
+        } else {
+            if (c == '*' || c == '?' || c == '[') {
+                glob = true;
+            }
+            PUT(c, false);
+        }
+    }
+#undef PUT_VAR
+#undef PUT_CMD
+#undef PUT
+#undef BEGIN_WORD
+
+    if (rv == 0 && (state == SCAN_SINGLE || state == SCAN_DOUBLE)) {
+        // Unterminated quote
+        rv = -EINVAL;
+    }
+    if (rv == 0 && in_word) {
+        out = end_word(out, flags, pattern, pattern_len, glob, vars, literal);
+        target = TOK_ARG;
+    }
+    if (rv == 0 && target != TOK_ARG) {
+        // '<' or '>' without a file name
+        rv = -EINVAL;
+    }
+    if (rv == 0 && ndocs > 0 && !bodies) {
+        // No newline after the line, so no body yet
+        rv = -EAGAIN;
+    }
+    if (rv < 0) {
+        return rv;
     }
+    *out++ = TOK_END;
+    if (used) {
+        *used = end;
+    }
+    return out - *tokens;
+}
 
-    //Set up splitting
-    char* buffer_ptr = NULL;
-    char* buffer_token = strtok_r(inbuf, "|", &buffer_ptr);
-    int i = 0;
-    int j = 0;
+/* Tokenize one line of input, as compile_command().
+ *
+ * Returns the size of the tokens in bytes, or -errno on failure.
+ */
+int compile_line(const char *inbuf, size_t length, arena *a, char **tokens) {
+    return compile_command(inbuf, length, a, tokens, NULL);
+}
 
-    //Loop while we have a token left in the input
-    while (buffer_token) {
-        j = 0;
-        char* token_ptr = NULL;
-        char* command = NULL;
+/* Returns the size in bytes of the tokens at tokens, including TOK_END. */
+size_t tokens_length(const char *tokens) {
+    const char *p = tokens;
 
-        // Check if the token is handling infile or outfile case
-        if(strstr(buffer_token, "<") || strstr(buffer_token, ">")) {
-            int in = strstr(buffer_token, "<") ? 1 : 0;
+    while (*p != TOK_END) {
+        char kind = *p++;
+        if (kind == TOK_PIPE || kind == TOK_BACKGROUND) {
+            continue;
+        }
+        char flags = *p++;
+        p += strlen(p) + 1;
+        if (flags & W_GLOB) {
+            p += strlen(p) + 1;
+        }
+    }
+    return p + 1 - tokens;
+}
 
-            command = strtok_r(buffer_token, "<>", &token_ptr);
-            if (in) {
-                *infile = strtok_r(NULL, "< \n", &token_ptr);
+/* If the first token of tokens is an argument that is a plain word
+ * (with no variables or globs), return it, and set *rest to the tokens
+ * after it.  Scripts use this to pick out keywords, see script.c.
+ *
+ * Returns NULL otherwise.
+ */
+const char *first_word(const char *tokens, const char **rest) {
+    const char *word = tokens + 2;
+
+    if (tokens[0] != TOK_ARG || tokens[1] != 0) {
+        return NULL;
+    }
+    *rest = word + strlen(word) + 1;
+    return word;
+}
+
+/* Run the command substitutions in word, in order, and set *outputs
+ * to an array (allocated from a) of what each wrote, or to NULL if
+ * there are none.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int run_substitutions(arena *a, const char *word, char ***outputs) {
+    const char *p = strchr(word, CMD_BEGIN);
+    size_t count = 0;
+
+    *outputs = NULL;
+    if (p == NULL) {
+        return 0;
+    }
+    for (const char *q = p; q; q = strchr(q + 1, CMD_BEGIN)) {
+        count++;
+    }
+    *outputs = arena_alloc(a, count * sizeof(char *));
+    if (*outputs == NULL) {
+        return -ENOMEM;
+    }
+    for (size_t k = 0; k < count; k++, p = strchr(p + 1, CMD_BEGIN)) {
+        const char *end = strchr(p, CMD_END);
+        int rv = capture_output(p + 1, end - p - 1, a, &(*outputs)[k]);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    return 0;
+}
+
+/* Expand the variable references and command substitutions (whose
+ * outputs are in outputs, see run_substitutions()) in tmpl, a word
+ * or (if pattern is set) a glob pattern, into a new string allocated
+ * from a.  Unset variables expand to nothing.  In a pattern, glob
+ * characters in the values are escaped, so that they match literally.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+static char *expand_vars(arena *a, const char *tmpl, bool pattern, char **outputs) {
+    char *s = NULL;
+
+    // Measure, then copy
+    for (;;) {
+        size_t len = 0;
+        size_t k = 0;
+        for (const char *p = tmpl; *p; p++) {
+            const char *end, *value;
+            if (*p == CMD_BEGIN) {
+                end = strchr(p, CMD_END);
+                value = outputs[k++];
+            } else if (*p == VAR_BEGIN) {
+                end = strchr(p, VAR_END);
+                value = get_var(p + 1, end - p - 1);
             } else {
-                *outfile = strtok_r(NULL, "> \n", &token_ptr);
-            }
-        }
-        //Split original token into individual commands/args e.g. "ls -a" splits to "ls" and "-a" 
-        char* command_ptr = NULL;
-        char* command_token = strtok_r(command ? command : buffer_token, " \n", &command_ptr);
-        if (command_token) {
-            //Write to output while we have tokens
-            while (command_token) {
-                if (strstr(command_token, "*.") != NULL) {
-                    // WE ARE GLOBBING
-                    int rv = expand_glob(command_token, NULL, NULL, commands, i, &j);
-                    if (rv == 0) {
-                        commands[i][j++] = command_token;
-                    }    
-                } else {
-                    commands[i][j++] = command_token;
+                if (s) {
+                    s[len] = *p;
                 }
-
-                command_token = strtok_r(NULL, " \n", &command_ptr);
+                len++;
+                continue;
+            }
+            for (; value && *value; value++) {
+                if (pattern && strchr("*?[]\\", *value)) {
+                    if (s) {
+                        s[len] = '\\';
+                    }
+                    len++;
+                }
+                if (s) {
+                    s[len] = *value;
+                }
+                len++;
             }
+            p = end;
+        }
+        if (s) {
+            s[len] = '\0';
+            return s;
+        }
+        s = arena_alloc(a, len + 1);
+        if (s == NULL) {
+            return NULL;
+        }
+    }
+}
+
+/* Split value on blanks, and add each field to the stage being
+ * bound.  Unlike other shells, the fields are not globbed.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int split_words(command_line *line, const char *value) {
+    while (value && *value) {
+        size_t len;
+        char *word;
 
-            //Get next token from input buffer
-            i++;
+        value += strspn(value, " \t\n");
+        len = strcspn(value, " \t\n");
+        if (len == 0) {
+            break;
+        }
+        word = arena_alloc(&line->arena, len + 1);
+        if (word == NULL) {
+            return -ENOMEM;
         }
+        memcpy(word, value, len);
+        word[len] = '\0';
+        if (wordlist_add(&line->words, word) < 0) {
+            return -ENOMEM;
+        }
+        value += len;
+    }
+    return 0;
+}
+
+/* Bind one word token: run its command substitutions, expand its
+ * variables and glob, and send it where its kind says.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int bind_word(command_line *line, char kind, char flags, const char *word, const char *pattern) {
+    char **outputs = NULL;
+
+    if (flags & W_PROC) {
+        // Started along with the line; stands for one end of a pipe
+        procsub *ps = arena_alloc(&line->arena, sizeof(procsub));
+        procsub **link = &line->procsubs;
+        if (ps == NULL || (ps->arg = arena_alloc(&line->arena, PROCSUB_ARG)) == NULL) {
+            return -ENOMEM;
+        }
+        ps->command = word + 1;
+        ps->output = word[0] == PROC_OUT;
+        ps->fd = -1;
+        ps->next = NULL;
+        strcpy(ps->arg, "/dev/fd/");
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = ps;
+        word = ps->arg;
+    }
+    if (flags & W_VARS) {
+        // Each substitution runs once, for both the word and its pattern
+        int rv = run_substitutions(&line->arena, word, &outputs);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    if (flags & W_SPLIT) {
+        return split_words(line, outputs ? outputs[0] : get_var(word + 1, strlen(word) - 2));
+    }
+    if (flags & W_VARS) {
+        word = expand_vars(&line->arena, word, false, outputs);
+        if (pattern) {
+            pattern = expand_vars(&line->arena, pattern, true, outputs);
+        }
+        if (word == NULL || ((flags & W_GLOB) && pattern == NULL)) {
+            return -ENOMEM;
+        }
+    }
+    if (kind == TOK_INFILE) {
+        line->infile = (char *) word;
+        line->input = NULL;
+        return 0;
+    }
+    if (kind == TOK_HEREDOC) {
+        line->input = word;
+        line->input_len = strlen(word);
+        line->infile = NULL;
+        return 0;
+    }
+    if (kind == TOK_HERESTRING) {
+        // A here-string gets a newline, like a line of input
+        size_t len = strlen(word);
+        char *text = arena_alloc(&line->arena, len + 2);
+        if (text == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(text, word, len);
+        text[len] = '\n';
+        text[len + 1] = '\0';
+        line->input = text;
+        line->input_len = len + 1;
+        line->infile = NULL;
+        return 0;
+    }
+    if (kind == TOK_OUTFILE) {
+        line->outfile = (char *) word;
+        return 0;
+    }
+    if (pattern) {
+        uint64_t start = trace_now();
+        int rv = expand_glob(pattern, &line->arena, &line->words);
+        trace_phase("glob", start, pattern);
+        if (rv != 0) {
+            return rv < 0 ? rv : 0;
+        }
+    }
+    // No glob, or no match: pass the word through as is
+    return wordlist_add(&line->words, (char *) word);
+}
+
+/* Finish the stage whose arguments are in line->words.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int end_stage(command_line *line) {
+    char **args;
+
+    // Like before, 'a || b' is just a pipeline of a and b
+    if (line->words.count == 0) {
+        return 0;
+    }
+    if ((size_t) line->stages + 2 > line->stages_cap) {
+        size_t cap = line->stages_cap ? 2 * line->stages_cap : 8;
+        char ***tmp = realloc(line->commands, cap * sizeof(char **));
+        if (tmp == NULL) {
+            return -ENOMEM;
+        }
+        line->commands = tmp;
+        line->stages_cap = cap;
+    }
+    args = arena_alloc(&line->arena, (line->words.count + 1) * sizeof(char *));
+    if (args == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(args, line->words.words, line->words.count * sizeof(char *));
+    args[line->words.count] = NULL;
+    line->commands[line->stages++] = args;
+    line->commands[line->stages] = NULL;
+    line->words.count = 0;
+    return 0;
+}
+
+/* Release the previous line held by line.
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+static int reset_line(command_line *line) {
+    arena_reset(&line->arena);
+    line->stages = 0;
+    line->infile = NULL;
+    line->input = NULL;
+    line->outfile = NULL;
+    line->background = false;
+    line->procsubs = NULL;
+    line->words.count = 0;
+    if (line->stages_cap == 0) {
+        line->commands = malloc(8 * sizeof(char **));
+        if (line->commands == NULL) {
+            return -ENOMEM;
+        }
+        line->stages_cap = 8;
+    }
+    line->commands[0] = NULL;
+    return 0;
+}
+
+/* Turn the tokens at p into the stages of line.
+ *
+ * Returns the number of stages, or -errno on failure.
+ */
+static int bind_tokens(const char *p, command_line *line) {
+    int rv = 0;
 
-        buffer_token = strtok_r(NULL, "|", &buffer_ptr);
+    //Every glob on this line shares one snapshot of each directory
+    glob_new_line();
+
+    while (rv == 0 && *p != TOK_END) {
+        char kind = *p++;
+        char flags;
+        const char *word, *pattern = NULL;
+
+        if (kind == TOK_PIPE) {
+            rv = end_stage(line);
+            continue;
+        }
+        if (kind == TOK_BACKGROUND) {
+            line->background = true;
+            continue;
+        }
+        flags = *p++;
+        word = p;
+        p += strlen(p) + 1;
+        if (flags & W_GLOB) {
+            pattern = p;
+            p += strlen(p) + 1;
+        }
+        rv = bind_word(line, kind, flags, word, pattern);
+    }
+    if (rv == 0) {
+        rv = end_stage(line);
+    }
+    if (rv < 0) {
+        line->stages = 0;
+        return rv;
     }
+    return line->stages;
+}
 
-    return i;
+/* Populate line from tokens made by compile_line(), as parse_line()
+ * would from the text they were compiled from.  Variables are
+ * expanded and globs matched anew on every call.
+ *
+ * The tokens must outlive the use of line, since the words may
+ * point into them.
+ *
+ * Returns the number of stages, or -errno on failure.
+ */
+int bind_line(const char *tokens, command_line *line) {
+    int rv = reset_line(line);
+    if (rv < 0) {
+        return rv;
+    }
+    return bind_tokens(tokens, line);
 }
 
+/* Parse one line of input.
+ *
+ * This function populates line->commands with each stage of the
+ * pipeline, in order, followed by a NULL.  Each stage is an argument
+ * list, also terminated by a NULL.  There is no limit on the number
+ * of stages or arguments.
+ *
+ * The line is scanned once, left to right, by compile_line().  Words
+ * are separated by blanks, '|', '<' and '>'.  Inside a word, '...'
+ * quotes everything, "..." quotes everything but \\, \", \$, \` and
+ * \newline, and a backslash quotes the next character.  $NAME and
+ * ${NAME} expand to the value of a variable, except inside '...'.
+ * $(command) and `command` expand to the output of the command, less
+ * its trailing newlines (see capture_output()).  A word that is just
+ * an unquoted $NAME or $(command) is split on blanks.  <(command) and
+ * >(command) are words of their own, which stand for a pipe from or
+ * to the command, as /dev/fd/N (see start_stages()).  Unquoted
+ * glob characters are expanded, see expand_glob().  A '#' at the start
+ * of a word starts a comment.
+ *
+ * '<<WORD' (or '<<-WORD', which drops leading tabs) feeds the lines
+ * after this one, up to a line that is just WORD, to the first stage;
+ * variables are expanded in them unless WORD is quoted.  '<<< word'
+ * feeds it word and a newline.  Until the whole body of a here-document
+ * is in inbuf, -EAGAIN is returned, and the caller may read more lines
+ * and try again.
+ *
+ * The words live in line->arena, and are released when the next
+ * line is parsed with the same command_line.
+ *
+ * inbuf: a NULL-terminated buffer of input.
+ *
+ * length: the length of the string in inbuf.  Should be
+ *         less than the size of inbuf.
+ *
+ * line: a command_line, zeroed before its first use, which this
+ *       function populates.  line->infile and line->outfile are set to
+ *       the files named after '<' and '>', if any, line->input to the
+ *       text of a here-document or here-string, and
+ *       line->background is set if the line ends with '&', i.e. the
+ *       pipeline should run in the background.
+ *
+ * return value: Number of stages populated in line->commands (1+, not
+ *               counting the NULL), or -errno on failure (-EINVAL for
+ *               a syntax error, such as an unterminated quote).
+ *
+ *               In the case of a line with no actual commands (e.g.,
+ *               a line with just comments), return 0.
+ */
+int parse_line(const char *inbuf, size_t length, command_line *line) {
+    char *tokens;
+    int rv = reset_line(line);
+
+    if (rv == 0) {
+        rv = compile_line(inbuf, length, &line->arena, &tokens);
+    }
+    if (rv < 0) {
+        return rv;
+    }
+    return bind_tokens(tokens, line);
+}
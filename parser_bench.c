@@ -0,0 +1,178 @@
+/* Tar Heel SHell
+ *
+ * This file is a benchmark for the parser.
+ * It generates a corpus of command lines from linux_commands.txt,
+ * with random arguments, quotes, pipes, redirects, comments and
+ * globs, then times read_one_line() and parse_line() over it and
+ * counts the heap allocations they make per line.
+ *
+ * Usage: parser_bench [lines [commands file]]
+ */
+#define _GNU_SOURCE
+#include "thsh.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define DEFAULT_LINES 1000000
+#define DEFAULT_COMMANDS "linux_commands.txt"
+
+// Count every heap allocation, by standing in for glibc's allocator
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+static long allocations = 0;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  allocations++;
+  return __libc_realloc(p, size);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, long lines, double secs, long allocs) {
+  printf("%-20s %12.0f %10.1f %12.3f\n", what, lines / secs, secs * 1e9 / lines,
+         (double) allocs / lines);
+}
+
+int main(int argc, char **argv) {
+  long lines = argc > 1 ? atol(argv[1]) : DEFAULT_LINES;
+  const char *commands_file = argc > 2 ? argv[2] : DEFAULT_COMMANDS;
+  const char *args[] = { "-l", "-la", "--verbose", "-n 10", "file.txt", "/tmp/data",
+                         "'two words'", "\"$HOME x\"", "a\\ b", "*.c", "*.[ch]", "src/?ain.c" };
+  char **commands = NULL;
+  size_t num_commands = 0, cap = 0;
+  char line[MAX_INPUT];
+  char *corpus;
+  size_t corpus_len = 0, corpus_cap;
+  command_line parsed;
+  long allocs, count, stages = 0;
+  double start;
+  int fd, len;
+
+  // Load the command names
+  fd = open(commands_file, O_RDONLY);
+  if (fd < 0) {
+    dprintf(2, "parser_bench: %s: %s\n", commands_file, strerror(errno));
+    return 1;
+  }
+  while ((len = read_one_line(fd, line, sizeof(line))) > 0) {
+    if (line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    if (num_commands == cap) {
+      cap = cap ? 2 * cap : 1024;
+      commands = realloc(commands, cap * sizeof(char *));
+    }
+    commands[num_commands++] = strdup(line);
+  }
+  close_reader(fd);
+  close(fd);
+  if (num_commands == 0) {
+    dprintf(2, "parser_bench: no commands in %s\n", commands_file);
+    return 1;
+  }
+
+  // Generate the corpus
+  srand(530);
+  corpus_cap = lines * 96;
+  corpus = malloc(corpus_cap);
+  for (long i = 0; i < lines; i++) {
+    int n = 0, num_stages = 1 + rand() % 4;
+    if (rand() % 8 == 0) {
+      n += snprintf(line + n, sizeof(line) - n, "cat < input.txt | ");
+    }
+    for (int s = 0; s < num_stages; s++) {
+      int num_args = rand() % 4;
+      n += snprintf(line + n, sizeof(line) - n, "%s%s", s ? " | " : "",
+                    commands[rand() % num_commands]);
+      for (int a = 0; a < num_args; a++) {
+        n += snprintf(line + n, sizeof(line) - n, " %s", args[rand() % 12]);
+      }
+    }
+    if (rand() % 8 == 0) {
+      n += snprintf(line + n, sizeof(line) - n, " > output.txt");
+    }
+    if (rand() % 16 == 0) {
+      n += snprintf(line + n, sizeof(line) - n, " # comment");
+    }
+    if (n > MAX_INPUT - 2) {
+      n = MAX_INPUT - 2;
+    }
+    line[n++] = '\n';
+    if (corpus_len + n > corpus_cap) {
+      corpus_cap *= 2;
+      corpus = realloc(corpus, corpus_cap);
+    }
+    memcpy(corpus + corpus_len, line, n);
+    corpus_len += n;
+  }
+
+  printf("%ld lines, %.1f MB, %zu commands\n", lines, corpus_len / 1e6, num_commands);
+  printf("%-20s %12s %10s %12s\n", "phase", "lines/s", "ns/line", "allocs/line");
+
+  // read_one_line() alone, from an in-memory file
+  fd = memfd_create("parser_bench", MFD_CLOEXEC);
+  if (fd < 0 || write(fd, corpus, corpus_len) != (ssize_t) corpus_len) {
+    perror("memfd");
+    return 1;
+  }
+  lseek(fd, 0, SEEK_SET);
+  allocs = allocations;
+  count = 0;
+  start = now();
+  while (read_one_line(fd, line, sizeof(line)) > 0) {
+    count++;
+  }
+  report("read_one_line", count, now() - start, allocations - allocs);
+
+  // parse_line() alone; the first line sets up the arena
+  memset(&parsed, 0, sizeof(parsed));
+  parse_line("warm up\n", 8, &parsed);
+  allocs = allocations;
+  count = 0;
+  start = now();
+  for (char *p = corpus, *end = corpus + corpus_len; p < end; ) {
+    char *nl = memchr(p, '\n', end - p);
+    int rv = parse_line(p, nl - p + 1, &parsed);
+    stages += rv > 0 ? rv : 0;
+    p = nl + 1;
+    count++;
+  }
+  report("parse_line", count, now() - start, allocations - allocs);
+
+  // Both, the way a script is run
+  lseek(fd, 0, SEEK_SET);
+  allocs = allocations;
+  count = 0;
+  start = now();
+  while ((len = read_one_line(fd, line, sizeof(line))) > 0) {
+    parse_line(line, len, &parsed);
+    count++;
+  }
+  report("read + parse", count, now() - start, allocations - allocs);
+
+  printf("%ld stages parsed\n", stages);
+  close_reader(fd);
+  close(fd);
+  return 0;
+}
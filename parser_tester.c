@@ -12,24 +12,16 @@ int main(int argc, char **argv, char **envp) {
   bool finished = 0;
   // buffer to hold current command
   int ret = 0;
+  // Parsed pipeline; its memory is reused from line to line
+  command_line line;
+  memset(&line, 0, sizeof(line));
 
   do {
     int length;
     char cmd[MAX_INPUT];
-    // Buffer for scratch space - optional, only necessary for lab2 challenge problems
-    char scratch[MAX_INPUT];
     // Get a pointer to cmd that type-checks with char *
     char *buf = &cmd[0];
-    char *parsed_commands[MAX_PIPELINE][MAX_ARGS];
-    char *infile = NULL;
-    char *outfile = NULL;
-
-    // Reset memory from the last iteration
-    for(int i = 0; i < MAX_PIPELINE; i++) {
-      for(int j = 0; j < MAX_ARGS; j++) {
-        parsed_commands[i][j] = NULL;
-      }
-    }
+    char ***parsed_commands;
 
     // Read a line of input
     length = read_one_line(0, buf, MAX_INPUT);
@@ -39,7 +31,8 @@ int main(int argc, char **argv, char **envp) {
     }
 
     // Pass it to the parser
-    ret = parse_line(buf, length, parsed_commands, &infile, &outfile, scratch, MAX_INPUT);
+    ret = parse_line(buf, length, &line);
+    parsed_commands = line.commands;
 
     if (ret == -ENOSYS) {
       printf("parse_line (probably) not implemented.  Giving up.\n");
@@ -50,25 +43,34 @@ int main(int argc, char **argv, char **envp) {
     }
 
     // Pretty print everything
-    for (int i = 0; parsed_commands[i][0]; i++) {
+    for (int i = 0; parsed_commands[i]; i++) {
       printf("Pipeline Stage %d: ", i);
       for (int j = 0; parsed_commands[i][j]; j++) {
         printf("[%s] ", parsed_commands[i][j]);
       }
       printf("\n");
     }
-    if (infile) {
-      printf("Input redirection to file [%s]\n", infile);
+    if (line.infile) {
+      printf("Input redirection to file [%s]\n", line.infile);
+    }
+    if (line.outfile) {
+      printf("Output redirection to file [%s]\n", line.outfile);
     }
-    if (outfile) {
-      printf("Output redirection to file [%s]\n", outfile);
+    if (line.background) {
+      printf("Run in background\n");
     }
 
     // If any commands are built-in commands, execute them.
     // Otherwise, we will handle this in lab 2
-    for (int i = 0; parsed_commands[i][0]; i++) {
+    for (int i = 0; parsed_commands[i]; i++) {
       int rv;
-      if (handle_builtin(parsed_commands[i], 0, 1, &rv, NULL)) {
+      outbuf out;
+      int found;
+      init_output(&out, 1);
+      found = handle_builtin(parsed_commands[i], 0, &out, &rv, NULL);
+      fflush(stdout);
+      flush_output(&out);
+      if (found) {
         printf("Command [%s] is a built-in, returned %d.\n", parsed_commands[i][0], rv);
       } else {
         printf("Command [%s] is not a built-in.\n", parsed_commands[i][0]);
@@ -0,0 +1,309 @@
+/* Tar Heel SHell
+ *
+ * This module makes the pipes between the stages of a pipeline, and
+ * can measure the data going through them.
+ *
+ * pipesize BYTES sets the capacity of the pipes the shell makes from
+ * then on (F_SETPIPE_SZ), in place of the kernel's 64 KiB default.  A
+ * larger pipe lets a fast writer run ahead of its reader for longer,
+ * so that the two switch back and forth less often when a pipeline
+ * moves a lot of data.
+ *
+ * pipestats on puts a relay between the stages of each foreground
+ * pipeline: a thread of the shell that moves the data from one pipe
+ * to the next with splice(), so it is never copied into the shell,
+ * and counts it.  It also keeps the time it waited for the writing
+ * stage (when the reading stage would have starved) and for the
+ * reading stage (when the pipe was full and the writing stage would
+ * have been stopped).  When the job is done, each pipe is reported on
+ * standard error, e.g.
+ *
+ *   thsh: pipe cat | gzip: 1073741824 bytes, reader waited 0.012 s, writer waited 4.731 s
+ *
+ * which says that gzip is the slow stage.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "thsh.h"
+
+// Most bytes moved by one splice()
+#define RELAY_CHUNK (1 << 20)
+// Room for the name of a stage in a report
+#define RELAY_NAME 64
+
+struct pipe_relay {
+    pthread_t thread;
+    int in, out;                // Read end from the writer, write end to the reader
+    char writer[RELAY_NAME], reader[RELAY_NAME];
+    uint64_t bytes;
+    uint64_t reader_waited;     // ns waiting for data
+    uint64_t writer_waited;     // ns waiting for room
+    pthread_mutex_t lock;       // Protects done and detached
+    bool done, detached;
+    struct pipe_relay *next;
+};
+
+// Capacity of new pipes, or 0 for the kernel's default
+static int pipe_size = 0;
+// Whether to relay and count the pipes of foreground pipelines
+static bool pipe_stats = false;
+
+/* Make a pipe, close-on-exec, with the capacity set by pipesize.  A
+ * capacity the kernel refuses leaves the pipe at its default.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int open_pipe(int pipefd[2]) {
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -errno;
+    }
+    if (pipe_size > 0) {
+        fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size);
+    }
+    return 0;
+}
+
+/* Returns true if the pipes of foreground pipelines are relayed and
+ * counted, see start_relay().
+ */
+bool pipe_stats_on(void) {
+    return pipe_stats;
+}
+
+static uint64_t relay_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Wait for fd to have events, adding the time it took to *waited. */
+static void relay_wait(int fd, short events, uint64_t *waited) {
+    struct pollfd p = { fd, events, 0 };
+    uint64_t start = relay_now();
+    while (poll(&p, 1, -1) < 0 && errno == EINTR) {
+    }
+    *waited += relay_now() - start;
+}
+
+/* Print what went through r, on standard error. */
+static void report_relay(struct pipe_relay *r) {
+    dprintf(2, "thsh: pipe %s | %s: %" PRIu64 " bytes, reader waited %.3f s, writer waited %.3f s\n",
+            r->writer, r->reader, r->bytes, r->reader_waited / 1e9, r->writer_waited / 1e9);
+}
+
+/* The relay thread: move data from r->in to r->out until the writer
+ * is done or the reader goes away.
+ */
+static void *relay(void *arg) {
+    struct pipe_relay *r = arg;
+    bool detached;
+
+    for (;;) {
+        ssize_t n = splice(r->in, NULL, r->out, NULL, RELAY_CHUNK,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            r->bytes += n;
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            // EPIPE: the reader is gone
+            break;
+        }
+
+        // Either there is nothing to move, or no room for it
+        struct pollfd p[2] = {{ r->in, POLLIN, 0 }, { r->out, POLLOUT, 0 }};
+        poll(p, 2, 0);
+        if (p[1].revents & POLLERR) {
+            break;
+        }
+        if (!p[0].revents) {
+            relay_wait(r->in, POLLIN, &r->reader_waited);
+        } else if (!p[1].revents) {
+            relay_wait(r->out, POLLOUT, &r->writer_waited);
+        }
+    }
+    // Pass EOF, or EPIPE, on
+    close(r->in);
+    close(r->out);
+
+    pthread_mutex_lock(&r->lock);
+    r->done = true;
+    detached = r->detached;
+    pthread_mutex_unlock(&r->lock);
+    if (detached) {
+        report_relay(r);
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+    }
+    return NULL;
+}
+
+/* Make the pipe between the stages writer and reader (the names of
+ * their commands, for the report) as two pipes, with a relay thread
+ * between them, and add the relay to *relays.
+ *
+ * *out_fd is set to the end the writer writes to, and *in_fd to the
+ * end the reader reads from.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int start_relay(const char *writer, const char *reader, int *out_fd, int *in_fd,
+        pipe_relay **relays) {
+    struct pipe_relay *r = calloc(1, sizeof(struct pipe_relay));
+    int up[2], down[2];
+    int rv;
+
+    if (r == NULL) {
+        return -ENOMEM;
+    }
+    rv = open_pipe(up);
+    if (rv < 0) {
+        free(r);
+        return rv;
+    }
+    rv = open_pipe(down);
+    if (rv < 0) {
+        close(up[0]);
+        close(up[1]);
+        free(r);
+        return rv;
+    }
+    fcntl(up[0], F_SETFL, O_NONBLOCK);
+    fcntl(down[1], F_SETFL, O_NONBLOCK);
+    r->in = up[0];
+    r->out = down[1];
+    snprintf(r->writer, RELAY_NAME, "%s", writer);
+    snprintf(r->reader, RELAY_NAME, "%s", reader);
+    pthread_mutex_init(&r->lock, NULL);
+    rv = pthread_create(&r->thread, NULL, relay, r);
+    if (rv) {
+        close(up[0]);
+        close(up[1]);
+        close(down[0]);
+        close(down[1]);
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+        return -rv;
+    }
+    *out_fd = up[1];
+    *in_fd = down[0];
+    r->next = *relays;
+    *relays = r;
+    return 0;
+}
+
+/* Report on, and free, the relays in the list relays.
+ *
+ * wait: the job is done; wait for its relays to drain, and report
+ *       them in the order of the pipeline.  Otherwise (a job left in
+ *       the background, or stopped), each relay reports itself when
+ *       its pipe closes.
+ */
+void finish_relays(pipe_relay *relays, bool wait) {
+    struct pipe_relay *r, *next, *ordered = NULL;
+
+    // The list is newest first; the pipeline's order is oldest first
+    for (r = relays; r; r = next) {
+        next = r->next;
+        r->next = ordered;
+        ordered = r;
+    }
+    for (r = ordered; r; r = next) {
+        bool done;
+        next = r->next;
+        if (wait) {
+            pthread_join(r->thread, NULL);
+            done = true;
+        } else {
+            pthread_detach(r->thread);
+            pthread_mutex_lock(&r->lock);
+            done = r->done;
+            r->detached = true;
+            pthread_mutex_unlock(&r->lock);
+        }
+        if (done) {
+            report_relay(r);
+            pthread_mutex_destroy(&r->lock);
+            free(r);
+        }
+    }
+}
+
+/* Handle a pipesize command: show the capacity of the pipes the
+ * shell makes, or set it, in bytes (with an optional k or m suffix),
+ * or back to the kernel's default.
+ */
+int handle_pipesize(char **args, int stdin, outbuf *out, history *myhistory) {
+    char *end;
+    long long size;
+    int pipefd[2];
+
+    if (args[1] == NULL) {
+        if (pipe_size > 0) {
+            out_printf(out, "%d\n", pipe_size);
+        } else {
+            out_printf(out, "default\n");
+        }
+        return 42;
+    }
+    if (strcmp(args[1], "default") == 0) {
+        pipe_size = 0;
+        return 42;
+    }
+    size = strtoll(args[1], &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        size *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        size *= 1024 * 1024;
+        end++;
+    }
+    if (end == args[1] || *end || size <= 0 || size > INT32_MAX) {
+        dprintf(2, "pipesize: bad size %s\n", args[1]);
+        out->status = 2;
+        return 42;
+    }
+
+    // Try it, to report what the kernel allows (it rounds up to pages)
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        out->status = 1;
+        return 42;
+    }
+    int rv = fcntl(pipefd[1], F_SETPIPE_SZ, (int) size);
+    if (rv < 0) {
+        dprintf(2, "pipesize: %s: %s\n", args[1], strerror(errno));
+        out->status = 1;
+    } else {
+        pipe_size = rv;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return 42;
+}
+
+/* Handle a pipestats command: show whether the pipes of pipelines
+ * are counted, or turn it on or off.
+ */
+int handle_pipestats(char **args, int stdin, outbuf *out, history *myhistory) {
+    if (args[1] == NULL) {
+        out_printf(out, "%s\n", pipe_stats ? "on" : "off");
+    } else if (strcmp(args[1], "on") == 0 || strcmp(args[1], "off") == 0) {
+        pipe_stats = args[1][1] == 'n';
+    } else {
+        dprintf(2, "pipestats: expected on or off, not %s\n", args[1]);
+        out->status = 2;
+    }
+    return 42;
+}
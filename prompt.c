@@ -0,0 +1,442 @@
+/* Tar Heel SHell
+ *
+ * This module renders the prompt, e.g.:
+ *
+ *   [/home/me/src/thsh] (main*) [exit 1] thsh>
+ *
+ * The prompt is built from state the shell already holds (the current
+ * directory tracked by cd, and the status of the last job), and is
+ * only rebuilt when that state changes; printing it is a single
+ * write().
+ *
+ * The VCS segment, the git branch and whether tracked files are
+ * modified, can take seconds to work out in a large repository.  It
+ * is computed by a background thread, and the prompt shows the last
+ * known result until a new one is ready, so the prompt never waits.
+ * The thread is asked to look again whenever the directory changes or
+ * a command has run, and signals a pipe when it has something new, so
+ * that the line editor can redraw the prompt (see lineedit.c).
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "thsh.h"
+
+// Branch names longer than this are cut short
+#define BRANCH_MAX 64
+
+// What the VCS worker found for a directory
+struct vcs_info {
+    char root[PATH_MAX];       // Top of the work tree, "" if not in one
+    char branch[BRANCH_MAX];   // Branch, or the abbreviated commit
+    int dirty;                 // Tracked files modified: 1, 0, or -1 if unknown
+};
+
+// What git is run with, copied from the variable store (which only the
+// main thread may touch) for the VCS worker; see snapshot_env()
+struct vcs_env {
+    const char *path;          // PATH, or NULL
+    char **envp;
+};
+
+// State shared with the VCS worker, under vcs_lock
+static pthread_mutex_t vcs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vcs_wanted = PTHREAD_COND_INITIALIZER;
+static bool vcs_started = false;
+static bool vcs_pending = false;     // A request is waiting for the worker
+static char vcs_request[PATH_MAX];   // Directory to look at
+static struct vcs_env *vcs_env = NULL; // Environment to look with, if new
+static struct vcs_info vcs_result;   // Latest result
+static unsigned long vcs_updates = 0; // Bumped with every new result
+
+// Written by the worker when vcs_result changes
+static int wakeup_pipe[2] = { -1, -1 };
+
+// The rendered prompt, and what it was rendered from
+static char prompt[PATH_MAX + 128];
+static size_t prompt_len = 0;
+static char prompt_cwd[PATH_MAX];
+static unsigned long prompt_updates = 0;
+static int prompt_status = 0;
+static bool prompt_valid = false;
+
+/* Find the work tree containing dir, and its git directory.
+ *
+ * Returns false if dir is not in one.
+ */
+static bool find_git_dir(const char *dir, char *root, char *git_dir) {
+    char path[PATH_MAX];
+    size_t len;
+
+    snprintf(root, PATH_MAX, "%s", dir);
+    for (;;) {
+        struct stat sb;
+        snprintf(path, sizeof(path), "%s/.git", strcmp(root, "/") ? root : "");
+        if (stat(path, &sb) == 0) {
+            if (S_ISDIR(sb.st_mode)) {
+                snprintf(git_dir, PATH_MAX, "%s", path);
+                return true;
+            }
+            // A worktree or submodule: ".git" holds "gitdir: <path>"
+            FILE *f = fopen(path, "re");
+            bool ok = f && fgets(path, sizeof(path), f) && strncmp(path, "gitdir: ", 8) == 0;
+            if (f) {
+                fclose(f);
+            }
+            if (ok) {
+                path[strcspn(path, "\n")] = '\0';
+                if (path[8] == '/') {
+                    snprintf(git_dir, PATH_MAX, "%s", path + 8);
+                } else {
+                    snprintf(git_dir, PATH_MAX, "%s/%s", root, path + 8);
+                }
+                return true;
+            }
+        }
+        // On to the parent directory
+        len = strlen(root);
+        while (len > 1 && root[len - 1] != '/') {
+            len--;
+        }
+        if (len <= 1) {
+            if (root[0] != '/' || root[1] == '\0') {
+                return false;
+            }
+            root[1] = '\0';
+        } else {
+            root[len - 1] = '\0';
+        }
+    }
+}
+
+/* Read the current branch from HEAD in git_dir, or the first seven
+ * digits of the commit if HEAD is detached.
+ */
+static void read_branch(const char *git_dir, char *branch) {
+    char path[PATH_MAX + 8];
+    char head[256] = "";
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/HEAD", git_dir);
+    f = fopen(path, "re");
+    if (f) {
+        if (fgets(head, sizeof(head), f) == NULL) {
+            head[0] = '\0';
+        }
+        fclose(f);
+    }
+    head[strcspn(head, "\n")] = '\0';
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        snprintf(branch, BRANCH_MAX, "%s", head + 16);
+    } else {
+        snprintf(branch, BRANCH_MAX, "%.7s", head);
+    }
+}
+
+/* Copy PATH and the environment of children out of the variable
+ * store, into one allocation, for the VCS worker.
+ *
+ * Returns the copy, or NULL if out of memory.
+ */
+static struct vcs_env *snapshot_env(void) {
+    char **envp = get_envp();
+    const char *path = get_var("PATH", 4);
+    size_t count = 0, size = 0;
+    struct vcs_env *env;
+    char *p;
+
+    for (; envp[count]; count++) {
+        size += strlen(envp[count]) + 1;
+    }
+    size += path ? strlen(path) + 1 : 0;
+    env = malloc(sizeof(struct vcs_env) + (count + 1) * sizeof(char *) + size);
+    if (env == NULL) {
+        return NULL;
+    }
+    env->envp = (char **) (env + 1);
+    p = (char *) (env->envp + count + 1);
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(envp[i]) + 1;
+        env->envp[i] = memcpy(p, envp[i], len);
+        p += len;
+    }
+    env->envp[count] = NULL;
+    env->path = path ? strcpy(p, path) : NULL;
+    return env;
+}
+
+/* Find git in path.
+ *
+ * Returns the path in a static buffer, or NULL.
+ */
+static const char *find_git(const char *path) {
+    static char git[PATH_MAX];
+
+    while (path && *path) {
+        size_t len = strcspn(path, ":");
+        snprintf(git, sizeof(git), "%.*s/git", (int) len, path);
+        if (len && access(git, X_OK) == 0) {
+            return git;
+        }
+        path += len + (path[len] == ':');
+    }
+    return NULL;
+}
+
+/* Ask git whether the tracked files in the work tree at root differ
+ * from the index or HEAD.  This is the slow part.
+ *
+ * The child is left for the shell's SIGCHLD handling to reap, since
+ * waiting for it here could race with jobs.c for its pid.  Only its
+ * output is looked at.
+ *
+ * Returns 1 if they differ, 0 if not, -1 if git could not tell.
+ */
+static int git_dirty(const char *root, const struct vcs_env *env) {
+    char *args[] = {
+        "git", "-C", (char *) root, "--no-optional-locks", "status",
+        "--porcelain", "--untracked-files=no", "--ignore-submodules", NULL
+    };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    const char *git = find_git(env->path);
+    int pipefd[2];
+    size_t total = 0;
+    char buf[4096];
+    ssize_t rv;
+    pid_t pid;
+
+    if (git == NULL || pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], 1);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+    // Out of the terminal's foreground group, so ^C at the prompt
+    // does not reach it, with the signals the shell ignores restored
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    rv = posix_spawn(&pid, git, &actions, &attr, args, env->envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+    if (rv != 0) {
+        close(pipefd[0]);
+        return -1;
+    }
+
+    // Any line of output is a modified file
+    while ((rv = read(pipefd[0], buf, sizeof(buf))) != 0) {
+        if (rv < 0 && errno != EINTR) {
+            break;
+        }
+        if (rv > 0) {
+            total += rv;
+        }
+    }
+    close(pipefd[0]);
+    return rv < 0 ? -1 : total > 0;
+}
+
+/* Publish a result and wake up the line editor. */
+static void publish(const struct vcs_info *info) {
+    pthread_mutex_lock(&vcs_lock);
+    vcs_result = *info;
+    vcs_updates++;
+    pthread_mutex_unlock(&vcs_lock);
+    write(wakeup_pipe[1], "", 1);
+}
+
+/* The VCS worker: look at each requested directory in turn.  Only the
+ * latest request matters, so requests made while it is busy coalesce.
+ */
+static void *vcs_worker(void *unused) {
+    struct vcs_info info, last;
+    struct vcs_env *env = NULL;
+    char dir[PATH_MAX];
+    char git_dir[PATH_MAX];
+
+    for (;;) {
+        pthread_mutex_lock(&vcs_lock);
+        while (!vcs_pending) {
+            pthread_cond_wait(&vcs_wanted, &vcs_lock);
+        }
+        vcs_pending = false;
+        memcpy(dir, vcs_request, sizeof(dir));
+        last = vcs_result;
+        if (vcs_env) {
+            free(env);
+            env = vcs_env;
+            vcs_env = NULL;
+        }
+        pthread_mutex_unlock(&vcs_lock);
+
+        info.dirty = -1;
+        info.branch[0] = '\0';
+        if (!find_git_dir(dir, info.root, git_dir)) {
+            info.root[0] = '\0';
+        } else {
+            read_branch(git_dir, info.branch);
+            // Keep the old dirty flag for the same work tree until the
+            // slow part is done, and show the branch before it
+            if (strcmp(info.root, last.root) == 0) {
+                info.dirty = last.dirty;
+            }
+        }
+        if (strcmp(info.root, last.root) != 0 || strcmp(info.branch, last.branch) != 0
+                || info.dirty != last.dirty) {
+            publish(&info);
+            last = info;
+        }
+        if (info.root[0] && env) {
+            info.dirty = git_dirty(info.root, env);
+            if (info.dirty != last.dirty) {
+                publish(&info);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Ask the VCS worker to look at dir, starting it if need be. */
+static void request_vcs(const char *dir) {
+    struct vcs_env *env = snapshot_env();
+
+    pthread_mutex_lock(&vcs_lock);
+    if (!vcs_started) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        sigset_t all, saved;
+
+        vcs_result.dirty = -1;
+        if (pipe2(wakeup_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+            pthread_mutex_unlock(&vcs_lock);
+            free(env);
+            return;
+        }
+        // Signals are for the main thread, so the worker blocks them all
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        vcs_started = pthread_create(&thread, &attr, vcs_worker, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        if (!vcs_started) {
+            close(wakeup_pipe[0]);
+            close(wakeup_pipe[1]);
+            wakeup_pipe[0] = wakeup_pipe[1] = -1;
+            pthread_mutex_unlock(&vcs_lock);
+            free(env);
+            return;
+        }
+    }
+    snprintf(vcs_request, sizeof(vcs_request), "%s", dir);
+    if (env) {
+        // Replaces one the worker has not picked up yet
+        free(vcs_env);
+        vcs_env = env;
+    }
+    vcs_pending = true;
+    pthread_cond_signal(&vcs_wanted);
+    pthread_mutex_unlock(&vcs_lock);
+}
+
+/* Record the wstatus of the job that just ran, for the prompt.
+ *
+ * Since the job may have changed files, the VCS segment is looked at
+ * again; the prompt shows the old one until then.
+ */
+void prompt_job_done(int status) {
+    if (status != prompt_status) {
+        prompt_status = status;
+        prompt_valid = false;
+    }
+    if (prompt_cwd[0]) {
+        request_vcs(prompt_cwd);
+    }
+}
+
+/* Returns a file descriptor that becomes readable when the prompt
+ * has changed and should be redrawn, or -1 if there is none yet.
+ */
+int prompt_wakeup_fd(void) {
+    return wakeup_pipe[0];
+}
+
+/* Rebuild the prompt if anything it shows has changed. */
+static void render_prompt(void) {
+    const char *cwd = current_dir();
+    struct vcs_info info;
+    size_t root_len;
+    char status[32] = "";
+    char vcs[BRANCH_MAX + 8] = "";
+    int len;
+
+    if (strcmp(cwd, prompt_cwd) != 0) {
+        snprintf(prompt_cwd, sizeof(prompt_cwd), "%s", cwd);
+        request_vcs(prompt_cwd);
+        prompt_valid = false;
+    }
+
+    pthread_mutex_lock(&vcs_lock);
+    if (vcs_updates != prompt_updates) {
+        prompt_updates = vcs_updates;
+        prompt_valid = false;
+    }
+    if (!prompt_valid) {
+        info = vcs_result;
+    }
+    pthread_mutex_unlock(&vcs_lock);
+    if (prompt_valid) {
+        return;
+    }
+
+    // The result may still be for the previous directory; only show
+    // the branch while inside its work tree
+    root_len = strlen(info.root);
+    if (root_len && strncmp(prompt_cwd, info.root, root_len) == 0
+            && (prompt_cwd[root_len] == '/' || prompt_cwd[root_len] == '\0' || root_len == 1)) {
+        snprintf(vcs, sizeof(vcs), "(%s%s) ", info.branch, info.dirty == 1 ? "*" : "");
+    }
+    if (WIFEXITED(prompt_status) && WEXITSTATUS(prompt_status)) {
+        snprintf(status, sizeof(status), "[exit %d] ", WEXITSTATUS(prompt_status));
+    } else if (WIFSIGNALED(prompt_status)) {
+        snprintf(status, sizeof(status), "[signal %d] ", WTERMSIG(prompt_status));
+    }
+
+    len = snprintf(prompt, sizeof(prompt), "[%s] %s%sthsh> ", prompt_cwd, vcs, status);
+    prompt_len = len < (int) sizeof(prompt) ? (size_t) len : sizeof(prompt) - 1;
+    prompt_valid = true;
+}
+
+/* This function prints the prompt, e.g.:
+ * [/current/dir] (branch*) thsh>
+ *
+ * Returns the number of bytes written
+ */
+int print_prompt(void) {
+    char drain[64];
+
+    // Whatever woke the line editor up is shown now
+    if (wakeup_pipe[0] >= 0) {
+        while (read(wakeup_pipe[0], drain, sizeof(drain)) > 0) {
+            continue;
+        }
+    }
+    render_prompt();
+    return write(1, prompt, prompt_len);
+}
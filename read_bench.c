@@ -0,0 +1,83 @@
+/* Tar Heel SHell
+ *
+ * This file is a benchmark for read_one_line().  It writes
+ * a large script to a temporary file, then reports how many
+ * lines per second the line reader gets through, next to a
+ * reader that issues one read() per character.
+ *
+ */
+#include "thsh.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_LINES 200000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The line reader as it was before buffering: one system call per byte. */
+static int read_one_line_bytewise(int input_fd, char *buf, size_t size) {
+  size_t count = 0;
+  while (count < size - 1) {
+    int rv = read(input_fd, buf + count, 1);
+    if (rv <= 0) {
+      break;
+    }
+    if (buf[count++] == '\n') {
+      break;
+    }
+  }
+  buf[count] = '\0';
+  return count;
+}
+
+static void run(const char *name, const char *path, int expected,
+                int (*reader)(int, char *, size_t)) {
+  char cmd[MAX_INPUT];
+  int lines = 0;
+  int fd = open(path, O_RDONLY);
+  double start, elapsed;
+
+  start = now();
+  while (reader(fd, cmd, MAX_INPUT) > 0) {
+    lines++;
+  }
+  elapsed = now() - start;
+  close_reader(fd);
+  close(fd);
+
+  if (lines != expected) {
+    printf("%s: read %d lines, expected %d\n", name, lines, expected);
+  }
+  printf("%-10s %8d lines  %8.3f s  %12.0f lines/s\n", name, lines, elapsed, lines / elapsed);
+}
+
+int main(int argc, char **argv) {
+  int lines = argc > 1 ? atoi(argv[1]) : DEFAULT_LINES;
+  char path[] = "/tmp/thsh_read_bench.XXXXXX";
+  int fd = mkstemp(path);
+  FILE *f;
+
+  if (fd < 0 || lines <= 0) {
+    printf("Usage: %s [lines]\n", argv[0]);
+    return 1;
+  }
+
+  // Write a script of ordinary-looking command lines
+  f = fdopen(fd, "w");
+  for (int i = 0; i < lines; i++) {
+    fprintf(f, "ls -l /tmp/dir%d | grep foo%d > out%d.txt # line %d\n", i % 97, i, i % 13, i);
+  }
+  fclose(f);
+
+  run("buffered", path, lines, read_one_line);
+  run("bytewise", path, lines, read_one_line_bytewise);
+
+  remove(path);
+  return 0;
+}
@@ -0,0 +1,933 @@
+/* Tar Heel SHell
+ *
+ * This module runs scripts: the file named on the command line.
+ *
+ * A script is compiled once into a small program.  Every line is
+ * tokenized with compile_line(), and the if/while/for constructs become
+ * jumps between lines, so loop bodies run without scanning their text
+ * again.  The program is cached on disk, keyed by the script's path,
+ * inode, size and mtime, so that the next run of an unchanged script
+ * skips compiling entirely.
+ *
+ * The constructs each take lines of their own, as in:
+ *
+ *   if cmd            while cmd          for NAME in words...
+ *   then              do                 do
+ *       ...               ...                ...
+ *   elif cmd          done               done
+ *   then
+ *       ...
+ *   else
+ *       ...
+ *   fi
+ *
+ * "; then" and "; do" may also follow the condition of an if, elif,
+ * while or for on its line, and a command may follow then, else and
+ * do on their line, as in "if cmd; then echo yes".  A condition is
+ * true if the last stage of its pipeline exits with 0.
+ *
+ * Unlike lines typed at the prompt, the lines of a script are not
+ * added to the history.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "thsh.h"
+
+// Bump whenever the layout of the cache file, or of tokens, changes
+#define SCRIPT_CACHE_VERSION 5
+#define SCRIPT_CACHE_MAGIC "thshprg"
+
+#define NO_TARGET UINT32_MAX
+
+enum opcode {
+    OP_RUN,        // Run the line in tokens
+    OP_BAD_LINE,   // A line that did not tokenize; arg is the errno
+    OP_JUMP,       // Go to instruction arg
+    OP_JUMP_FALSE, // Go to arg if the last command failed
+    OP_FOR,        // Start a loop over the words in tokens
+    OP_NEXT,       // Set the variable named by text to the loop's next
+                   // word, or end the loop and go to arg
+};
+
+struct insn {
+    uint32_t op;
+    uint32_t arg;
+    uint32_t tokens;  // Offset of the tokens in the program's data
+    uint32_t text;    // Offset of the source line, or the loop variable
+};
+
+// A compiled script.  It has no pointers, so it is saved as is.
+struct program {
+    struct insn *code;
+    uint32_t count;
+    uint32_t code_cap;
+    char *data;       // Tokens and strings, back to back
+    uint32_t len;
+    uint32_t data_cap;
+    void *file;       // Cache file contents the program points into
+};
+
+/* Layout of a cache file: this header, the code, the data, and the
+ * path of the script.
+ */
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t len;
+    uint32_t path_len;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t checksum;  // Of the code and the data, see program_checksum()
+};
+
+enum block_kind {
+    BLOCK_IF,
+    BLOCK_WHILE,
+    BLOCK_FOR,
+};
+
+// An if/while/for that is still open while compiling
+struct block {
+    enum block_kind kind;
+    int line;         // Where it started, for error messages
+    bool body;        // Past its "then" or "do"
+    bool has_else;
+    uint32_t head;    // Loops: where each iteration starts
+    uint32_t branch;  // Jump to the next branch, or out of the loop
+    uint32_t exits;   // if: chain of jumps to "fi", linked through arg
+};
+
+struct compiler {
+    struct program *p;
+    const char *path;
+    int line;
+    uint32_t text;    // Offset of the current line in data, or NO_TARGET
+    const char *line_start;
+    size_t line_len;
+    struct block *blocks;
+    int depth;
+    int blocks_cap;
+    arena scratch;    // Tokens of the current line
+};
+
+/* Append len bytes to the program's data.
+ *
+ * Returns their offset, or NO_TARGET if memory could not be allocated.
+ */
+static uint32_t add_data(struct program *p, const void *bytes, size_t len) {
+    uint32_t at = p->len;
+
+    if (p->len + len > p->data_cap) {
+        size_t cap = p->data_cap ? p->data_cap : 4096;
+        while (cap < p->len + len) {
+            cap *= 2;
+        }
+        char *tmp = realloc(p->data, cap);
+        if (tmp == NULL) {
+            return NO_TARGET;
+        }
+        p->data = tmp;
+        p->data_cap = cap;
+    }
+    memcpy(p->data + p->len, bytes, len);
+    p->len += len;
+    return at;
+}
+
+/* Append an instruction.
+ *
+ * Returns its index, or NO_TARGET if memory could not be allocated.
+ */
+static uint32_t emit(struct program *p, enum opcode op, uint32_t arg, uint32_t tokens, uint32_t text) {
+    if (p->count == p->code_cap) {
+        size_t cap = p->code_cap ? p->code_cap * 2 : 256;
+        struct insn *tmp = realloc(p->code, cap * sizeof(struct insn));
+        if (tmp == NULL) {
+            return NO_TARGET;
+        }
+        p->code = tmp;
+        p->code_cap = cap;
+    }
+    p->code[p->count] = (struct insn) { op, arg, tokens, text };
+    return p->count++;
+}
+
+/* Point every jump in the chain starting at jump (linked through
+ * their args) at the next instruction.
+ */
+static void patch_chain(struct program *p, uint32_t jump) {
+    while (jump != NO_TARGET) {
+        uint32_t next = p->code[jump].arg;
+        p->code[jump].arg = p->count;
+        jump = next;
+    }
+}
+
+static int syntax_error(struct compiler *c, const char *near) {
+    dprintf(2, "thsh: %s: line %d: syntax error near '%s'\n", c->path, c->line, near);
+    return -EINVAL;
+}
+
+/* Offset of the text of the current line in the program's data,
+ * stored on first use.
+ */
+static uint32_t line_text(struct compiler *c) {
+    if (c->text == NO_TARGET) {
+        size_t len = c->line_len;
+        while (len > 0 && c->line_start[len - 1] == '\n') {
+            len--;
+        }
+        c->text = add_data(c->p, c->line_start, len);
+        if (c->text != NO_TARGET && add_data(c->p, "", 1) == NO_TARGET) {
+            c->text = NO_TARGET;
+        }
+    }
+    return c->text;
+}
+
+/* Emit an instruction that takes the tokens at tokens (which may be
+ * empty, for OP_RUN) and the current line.
+ *
+ * Returns the instruction's index, or NO_TARGET on failure.
+ */
+static uint32_t emit_tokens(struct compiler *c, enum opcode op, uint32_t arg, const char *tokens) {
+    uint32_t text, at;
+
+    if (op == OP_RUN && tokens_length(tokens) == 1) {
+        // Nothing to run; any index but NO_TARGET will do
+        return c->p->count;
+    }
+    text = line_text(c);
+    at = add_data(c->p, tokens, tokens_length(tokens));
+    if (text == NO_TARGET || at == NO_TARGET) {
+        return NO_TARGET;
+    }
+    return emit(c->p, op, arg, at, text);
+}
+
+/* Open a block of the given kind.
+ *
+ * Returns the block, or NULL if memory could not be allocated.
+ */
+static struct block *push_block(struct compiler *c, enum block_kind kind) {
+    struct block *b;
+
+    if (c->depth == c->blocks_cap) {
+        int cap = c->blocks_cap ? c->blocks_cap * 2 : 8;
+        struct block *tmp = realloc(c->blocks, cap * sizeof(struct block));
+        if (tmp == NULL) {
+            return NULL;
+        }
+        c->blocks = tmp;
+        c->blocks_cap = cap;
+    }
+    b = &c->blocks[c->depth++];
+    b->kind = kind;
+    b->line = c->line;
+    b->body = false;
+    b->has_else = false;
+    b->head = c->p->count;
+    b->branch = NO_TARGET;
+    b->exits = NO_TARGET;
+    return b;
+}
+
+/* Find the first "; then" or "; do" on the line (outside quotes and
+ * comments), which may be followed by a command.  *head_len is set to
+ * the length of the text before the ';', and *after to the offset just
+ * past the keyword.
+ *
+ * Returns the keyword, or NULL if there is none.
+ */
+static const char *split_keyword(const char *text, size_t len, size_t *head_len, size_t *after) {
+    static const char *keywords[] = { "then", "do" };
+    char quote = '\0';
+
+    for (size_t i = 0; i < len; i++) {
+        char ch = text[i];
+        if (quote) {
+            if (ch == quote) {
+                quote = '\0';
+            } else if (ch == '\\' && quote == '"') {
+                i++;
+            }
+            continue;
+        }
+        if (ch == '\\') {
+            i++;
+        } else if (ch == '\'' || ch == '"') {
+            quote = ch;
+        } else if (ch == '#' && (i == 0 || text[i - 1] == ' ' || text[i - 1] == '\t')) {
+            break;
+        } else if (ch == ';') {
+            size_t j = i + 1;
+            while (j < len && (text[j] == ' ' || text[j] == '\t')) {
+                j++;
+            }
+            for (int k = 0; k < 2; k++) {
+                size_t n = strlen(keywords[k]);
+                if (j + n <= len && memcmp(text + j, keywords[k], n) == 0
+                        && (j + n == len || strchr(" \t\n", text[j + n]))) {
+                    *head_len = i;
+                    *after = j + n;
+                    return keywords[k];
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Compile a keyword line: the keyword, and the tokens that follow it.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int compile_keyword(struct compiler *c, const char *word, const char *rest) {
+    struct block *b = c->depth ? &c->blocks[c->depth - 1] : NULL;
+    bool empty = tokens_length(rest) == 1;
+    uint32_t at = 0;
+
+    if (strcmp(word, "if") == 0 || strcmp(word, "while") == 0) {
+        if (empty) {
+            return syntax_error(c, word);
+        }
+        b = push_block(c, word[0] == 'i' ? BLOCK_IF : BLOCK_WHILE);
+        if (b) {
+            at = emit_tokens(c, OP_RUN, 0, rest);
+        }
+    } else if (strcmp(word, "for") == 0) {
+        const char *name = first_word(rest, &rest);
+        const char *in = name ? first_word(rest, &rest) : NULL;
+        if (name == NULL || in == NULL || strcmp(in, "in") != 0
+                || strspn(name, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") != strlen(name)
+                || (name[0] >= '0' && name[0] <= '9')) {
+            return syntax_error(c, word);
+        }
+        if (emit_tokens(c, OP_FOR, 0, rest) == NO_TARGET) {
+            return -ENOMEM;
+        }
+        b = push_block(c, BLOCK_FOR);
+        at = add_data(c->p, name, strlen(name) + 1);
+        if (b && at != NO_TARGET) {
+            at = b->branch = emit(c->p, OP_NEXT, NO_TARGET, 0, at);
+        }
+    } else if (strcmp(word, "then") == 0 || strcmp(word, "do") == 0) {
+        if (b == NULL || b->body || (b->kind == BLOCK_IF) != (word[0] == 't')) {
+            return syntax_error(c, word);
+        }
+        b->body = true;
+        if (b->kind != BLOCK_FOR) {
+            at = b->branch = emit(c->p, OP_JUMP_FALSE, NO_TARGET, 0, 0);
+        }
+        if (at != NO_TARGET) {
+            at = emit_tokens(c, OP_RUN, 0, rest);
+        }
+    } else if (strcmp(word, "elif") == 0 || strcmp(word, "else") == 0) {
+        if (b == NULL || b->kind != BLOCK_IF || !b->body || b->has_else
+                || (word[2] == 'i' && empty)) {
+            return syntax_error(c, word);
+        }
+        // The branch before this one is done
+        at = b->exits = emit(c->p, OP_JUMP, b->exits, 0, 0);
+        patch_chain(c->p, b->branch);
+        b->branch = NO_TARGET;
+        if (word[2] == 'i') {
+            b->body = false;
+        } else {
+            b->has_else = true;
+        }
+        if (at != NO_TARGET) {
+            at = emit_tokens(c, OP_RUN, 0, rest);
+        }
+    } else {
+        // "fi" or "done"
+        if (b == NULL || !b->body || !empty || (b->kind == BLOCK_IF) != (word[0] == 'f')) {
+            return syntax_error(c, word);
+        }
+        if (b->kind != BLOCK_IF) {
+            at = emit(c->p, OP_JUMP, b->head, 0, 0);
+        }
+        patch_chain(c->p, b->branch);
+        patch_chain(c->p, b->exits);
+        c->depth--;
+        return at == NO_TARGET ? -ENOMEM : 0;
+    }
+    return b == NULL || at == NO_TARGET ? -ENOMEM : 0;
+}
+
+static bool is_keyword(const char *word) {
+    static const char *keywords[] = {
+        "if", "then", "elif", "else", "fi", "while", "for", "do", "done", NULL
+    };
+    for (int i = 0; keywords[i]; i++) {
+        if (strcmp(word, keywords[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Compile one line of the script.
+ *
+ * A line that fails to tokenize is reported when it would run, like
+ * the shell does for a line typed in.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int compile_script_line(struct compiler *c, const char *text, size_t len) {
+    const char *word, *rest, *trailing = NULL;
+    size_t head_len, after;
+    char *tokens;
+    int rv;
+
+    arena_reset(&c->scratch);
+    c->text = NO_TARGET;
+    c->line_start = text;
+    c->line_len = len;
+
+    rv = compile_line(text, len, &c->scratch, &tokens);
+    if (rv < 0) {
+        return emit(c->p, OP_BAD_LINE, -rv, 0, 0) == NO_TARGET ? -ENOMEM : 0;
+    }
+    word = first_word(tokens, &rest);
+    if (word == NULL || !is_keyword(word)) {
+        return emit_tokens(c, OP_RUN, 0, tokens) == NO_TARGET ? -ENOMEM : 0;
+    }
+
+    if (strcmp(word, "if") == 0 || strcmp(word, "elif") == 0
+            || strcmp(word, "while") == 0 || strcmp(word, "for") == 0) {
+        trailing = split_keyword(text, len, &head_len, &after);
+        if (trailing) {
+            if (compile_line(text, head_len, &c->scratch, &tokens) < 0) {
+                return syntax_error(c, word);
+            }
+            word = first_word(tokens, &rest);
+        }
+    }
+    rv = compile_keyword(c, word, rest);
+    if (rv == 0 && trailing) {
+        // Whatever follows "then" or "do" is the first command of the body
+        if (compile_line(text + after, len - after, &c->scratch, &tokens) < 0) {
+            return syntax_error(c, trailing);
+        }
+        rv = compile_keyword(c, trailing, tokens);
+    }
+    return rv;
+}
+
+/* Compile the len bytes of script text at text into p.
+ *
+ * Returns 0 on success, -errno on failure.  Syntax errors are
+ * reported on stderr.
+ */
+static int compile_script(const char *text, size_t len, const char *path, struct program *p) {
+    struct compiler c;
+    const char *end = text + len;
+    int rv = 0;
+
+    memset(&c, 0, sizeof(c));
+    c.p = p;
+    c.path = path;
+    while (rv == 0 && text < end) {
+        const char *newline = memchr(text, '\n', end - text);
+        size_t line_len = newline ? (size_t) (newline - text) + 1 : (size_t) (end - text);
+        int first = ++c.line;
+        if (memmem(text, line_len, "<<", 2)) {
+            // The lines of a here-document belong to the line that
+            // starts it, up to the end of the script if it never ends
+            char *tokens;
+            size_t used;
+            arena_reset(&c.scratch);
+            int n = compile_command(text, end - text, &c.scratch, &tokens, &used);
+            if (n == -EAGAIN) {
+                line_len = end - text;
+            } else if (n >= 0 && used > line_len) {
+                line_len = used;
+            }
+        }
+        rv = compile_script_line(&c, text, line_len);
+        c.line = first;
+        for (const char *p = text; p < text + line_len - 1; p++) {
+            c.line += *p == '\n';
+        }
+        text += line_len;
+    }
+    if (rv == 0 && c.depth > 0) {
+        struct block *b = &c.blocks[c.depth - 1];
+        dprintf(2, "thsh: %s: line %d: '%s' without '%s'\n", path, b->line,
+                b->kind == BLOCK_IF ? "if" : b->kind == BLOCK_WHILE ? "while" : "for",
+                b->kind == BLOCK_IF ? "fi" : "done");
+        rv = -EINVAL;
+    }
+    free(c.blocks);
+    arena_free(&c.scratch);
+    return rv;
+}
+
+static void free_program(struct program *p) {
+    if (p->file) {
+        free(p->file);
+    } else {
+        free(p->code);
+        free(p->data);
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+/* FNV-1a hash of the code and data of p, so that a cache file that
+ * was damaged is compiled again rather than run.
+ */
+static uint64_t program_checksum(const struct program *p) {
+    const unsigned char *bytes = (const unsigned char *) p->code;
+    size_t len = (size_t) p->count * sizeof(struct insn);
+    uint64_t h = 14695981039346656037UL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211UL;
+    }
+    for (size_t i = 0; i < p->len; i++) {
+        h ^= (unsigned char) p->data[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* FNV-1a hash of a path */
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037UL;
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Name of the cache file for the script at real (an absolute path):
+ * $XDG_CACHE_HOME/thsh/<hash>, or ~/.cache/thsh/<hash>.  The
+ * directories are created if needed.
+ *
+ * Returns a malloc()ed path, or NULL if there is nowhere to cache.
+ */
+static char *cache_file(const char *real) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    char *path;
+
+    if (xdg && xdg[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else if (home && home[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    mkdir(dir, 0700);
+    strncat(dir, "/thsh", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+    if (asprintf(&path, "%s/%016lx.prg", dir, (unsigned long) hash_path(real)) < 0) {
+        return NULL;
+    }
+    return path;
+}
+
+/* Load the program cached in the file at cache for the script at real,
+ * whose stat() is sb.
+ *
+ * Returns 0 on success, or -errno if there is no valid, up to date
+ * program in the cache.
+ */
+static int load_cache(const char *cache, const char *real, struct stat *sb, struct program *p) {
+    struct cache_header *h;
+    struct stat cb;
+    size_t path_len = strlen(real);
+    size_t code_size, done = 0;
+    char *buf;
+    int fd = open(cache, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &cb) < 0 || (size_t) cb.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return -EINVAL;
+    }
+    buf = malloc(cb.st_size);
+    if (buf == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    while (done < (size_t) cb.st_size) {
+        ssize_t rv = read(fd, buf + done, cb.st_size - done);
+        if (rv <= 0) {
+            break;
+        }
+        done += rv;
+    }
+    close(fd);
+
+    h = (struct cache_header *) buf;
+    code_size = (size_t) h->count * sizeof(struct insn);
+    if (done != (size_t) cb.st_size
+            || memcmp(h->magic, SCRIPT_CACHE_MAGIC, sizeof(h->magic)) != 0
+            || h->version != SCRIPT_CACHE_VERSION
+            || h->dev != sb->st_dev || h->ino != sb->st_ino
+            || h->size != (uint64_t) sb->st_size
+            || h->mtime_sec != sb->st_mtim.tv_sec
+            || h->mtime_nsec != sb->st_mtim.tv_nsec
+            || h->path_len != path_len
+            || sizeof(*h) + code_size + h->len + path_len != done
+            || memcmp(buf + done - path_len, real, path_len) != 0) {
+        free(buf);
+        return -ESTALE;
+    }
+
+    p->file = buf;
+    p->code = (struct insn *) (buf + sizeof(*h));
+    p->count = p->code_cap = h->count;
+    p->data = buf + sizeof(*h) + code_size;
+    p->len = p->data_cap = h->len;
+
+    // Do not run a program that was damaged, or whose strings would
+    // run off the end of its data
+    if (program_checksum(p) != h->checksum || (p->len > 0 && p->data[p->len - 1] != '\0')) {
+        free_program(p);
+        return -EINVAL;
+    }
+
+    // Do not trust offsets that point outside of the program
+    for (uint32_t i = 0; i < p->count; i++) {
+        struct insn *in = &p->code[i];
+        if (in->tokens >= p->len || in->text >= p->len
+                || ((in->op == OP_JUMP || in->op == OP_JUMP_FALSE || in->op == OP_NEXT)
+                    && in->arg > p->count)) {
+            free_program(p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/* Save p as the cached program of the script at real, whose stat()
+ * is sb.  The file is written under a temporary name and renamed
+ * into place, so that concurrent runs never see half of it.
+ *
+ * Errors are ignored; the script just gets compiled again next time.
+ */
+static void save_cache(const char *cache, const char *real, struct stat *sb, struct program *p) {
+    struct cache_header h;
+    size_t len = strlen(cache);
+    char tmp[len + 8];
+    bool ok;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCRIPT_CACHE_MAGIC, sizeof(h.magic));
+    h.version = SCRIPT_CACHE_VERSION;
+    h.count = p->count;
+    h.len = p->len;
+    h.path_len = strlen(real);
+    h.dev = sb->st_dev;
+    h.ino = sb->st_ino;
+    h.size = sb->st_size;
+    h.mtime_sec = sb->st_mtim.tv_sec;
+    h.mtime_nsec = sb->st_mtim.tv_nsec;
+    h.checksum = program_checksum(p);
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache);
+    fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ok = write(fd, &h, sizeof(h)) == sizeof(h)
+        && write(fd, p->code, p->count * sizeof(struct insn)) == (ssize_t) (p->count * sizeof(struct insn))
+        && write(fd, p->data, p->len) == (ssize_t) p->len
+        && write(fd, real, h.path_len) == (ssize_t) h.path_len;
+    close(fd);
+    if (!ok || rename(tmp, cache) < 0) {
+        unlink(tmp);
+    }
+}
+
+/* Read all of fd into a malloc()ed buffer, and its length into *len.
+ *
+ * Returns NULL on failure.
+ */
+static char *read_file(int fd, size_t *len) {
+    size_t cap = 65536;
+    char *buf = malloc(cap);
+
+    *len = 0;
+    while (buf) {
+        ssize_t rv;
+        if (*len == cap) {
+            char *tmp = realloc(buf, cap * 2);
+            if (tmp == NULL) {
+                break;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+        rv = read(fd, buf + *len, cap - *len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            if (rv == 0) {
+                return buf;
+            }
+            break;
+        }
+        *len += rv;
+    }
+    free(buf);
+    return NULL;
+}
+
+// A running for loop
+struct loop {
+    char *words;      // The words to go through, back to back
+    char *next;       // The next one
+    char *end;
+};
+
+// wstatus of the last line run, see run_script_text()
+static int last_status;
+
+/* Run one line.
+ *
+ * Returns true if its last stage exited with 0.
+ */
+static bool run_line(command_line *line, const char *tokens, const char *text,
+        bool debug, history *myhistory) {
+    int exit_code = 0;
+    int stages;
+
+    uint64_t start;
+
+    // Reap finished background jobs, as before each prompt
+    notify_jobs();
+
+    start = trace_now();
+    stages = bind_line(tokens, line);
+    trace_phase("parse", start, text);
+    if (stages < 0) {
+        dprintf(2, "Parsing error.  Cannot execute command. %d\n", -stages);
+        last_status = 1 << 8;
+        return false;
+    }
+    if (stages == 0) {
+        return true;
+    }
+    if (run_pipeline(line, text, debug, &exit_code, myhistory)) {
+        exit_code = 1 << 8;
+    }
+    last_status = exit_code;
+    return WIFEXITED(exit_code) && WEXITSTATUS(exit_code) == 0;
+}
+
+/* Start a for loop over the words in tokens.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int start_loop(struct loop *l, command_line *line, const char *tokens) {
+    size_t len = 0;
+    int stages = bind_line(tokens, line);
+
+    l->words = l->next = l->end = NULL;
+    if (stages < 0) {
+        dprintf(2, "Parsing error.  Cannot execute command. %d\n", -stages);
+        return 0;
+    }
+    if (stages != 1 || line->background || line->infile || line->outfile) {
+        dprintf(2, "thsh: for: bad word list\n");
+        return 0;
+    }
+    // The words outlive the line, which the body reuses
+    for (char **w = line->commands[0]; *w; w++) {
+        len += strlen(*w) + 1;
+    }
+    l->words = malloc(len);
+    if (l->words == NULL) {
+        return -ENOMEM;
+    }
+    l->next = l->end = l->words;
+    for (char **w = line->commands[0]; *w; w++) {
+        l->end = stpcpy(l->end, *w) + 1;
+    }
+    return 0;
+}
+
+/* Run a compiled program.
+ *
+ * Returns 0, or -errno if the shell ran out of memory.
+ */
+static int run_program(struct program *p, bool debug, history *myhistory) {
+    command_line line;
+    struct loop *loops = NULL;
+    int depth = 0, loops_cap = 0;
+    bool ok = true;   // The last command succeeded
+    uint32_t pc = 0;
+    int rv = 0;
+
+    memset(&line, 0, sizeof(line));
+    while (rv == 0 && pc < p->count) {
+        struct insn *in = &p->code[pc++];
+        struct loop *l;
+
+        switch (in->op) {
+        case OP_RUN:
+            ok = run_line(&line, p->data + in->tokens, p->data + in->text, debug, myhistory);
+            break;
+        case OP_BAD_LINE:
+            dprintf(2, "Parsing error.  Cannot execute command. %d\n", in->arg);
+            last_status = 1 << 8;
+            ok = false;
+            break;
+        case OP_JUMP:
+            pc = in->arg;
+            break;
+        case OP_JUMP_FALSE:
+            if (!ok) {
+                pc = in->arg;
+            }
+            break;
+        case OP_FOR:
+            if (depth == loops_cap) {
+                int cap = loops_cap ? loops_cap * 2 : 8;
+                struct loop *tmp = realloc(loops, cap * sizeof(struct loop));
+                if (tmp == NULL) {
+                    rv = -ENOMEM;
+                    break;
+                }
+                loops = tmp;
+                loops_cap = cap;
+            }
+            rv = start_loop(&loops[depth++], &line, p->data + in->tokens);
+            break;
+        case OP_NEXT:
+            l = &loops[depth - 1];
+            if (l->next == l->end) {
+                free(l->words);
+                depth--;
+                pc = in->arg;
+                break;
+            }
+            set_var(p->data + in->text, l->next, false);
+            l->next += strlen(l->next) + 1;
+            break;
+        }
+    }
+
+    while (depth > 0) {
+        free(loops[--depth].words);
+    }
+    free(loops);
+    arena_free(&line.arena);
+    free(line.commands);
+    free(line.words.words);
+    return rv;
+}
+
+/* Run the script at path.
+ *
+ * The compiled program is taken from the cache if the script has not
+ * changed since it was compiled, and saved to it otherwise.
+ *
+ * debug: print each command as it starts and ends, see run_pipeline().
+ *
+ * Returns 0 once the script has run, or -errno if it could not be
+ * read or compiled (syntax errors are reported on stderr).
+ */
+int run_script(const char *path, bool debug, history *myhistory) {
+    struct program p;
+    struct stat sb;
+    char *real = NULL, *cache = NULL;
+    uint64_t start;
+    int fd, rv = 0;
+
+    memset(&p, 0, sizeof(p));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        rv = -errno;
+        dprintf(2, "thsh: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return rv;
+    }
+
+    // Only regular files can be told apart by their size and mtime
+    if (S_ISREG(sb.st_mode)) {
+        real = realpath(path, NULL);
+        cache = real ? cache_file(real) : NULL;
+    }
+    start = trace_now();
+    if (cache && load_cache(cache, real, &sb, &p) == 0) {
+        trace_phase("load", start, cache);
+    } else {
+        size_t len;
+        char *text = read_file(fd, &len);
+        trace_phase("read", start, path);
+        if (text == NULL) {
+            rv = -errno;
+            dprintf(2, "thsh: %s: %s\n", path, strerror(errno));
+        } else {
+            start = trace_now();
+            rv = compile_script(text, len, path, &p);
+            trace_phase("compile", start, path);
+            free(text);
+        }
+        if (rv == 0 && cache) {
+            save_cache(cache, real, &sb, &p);
+        }
+    }
+    close(fd);
+    free(cache);
+    free(real);
+
+    if (rv == 0) {
+        rv = run_program(&p, debug, myhistory);
+    }
+    free_program(&p);
+    return rv;
+}
+
+/* Run the len bytes of script text at text, which is named name in
+ * messages, as run_script() would a file, but without the cache.
+ *
+ * *status is set to the wstatus of the last line that ran (0 if none
+ * did).
+ *
+ * Returns 0 once the script has run, or -errno if it could not be
+ * compiled.
+ */
+int run_script_text(const char *name, const char *text, size_t len, bool debug,
+        history *myhistory, int *status) {
+    struct program p;
+    uint64_t start = trace_now();
+    int rv;
+
+    memset(&p, 0, sizeof(p));
+    last_status = 0;
+    rv = compile_script(text, len, name, &p);
+    trace_phase("compile", start, name);
+    if (rv == 0) {
+        rv = run_program(&p, debug, myhistory);
+    }
+    free_program(&p);
+    *status = last_status;
+    return rv;
+}
@@ -0,0 +1,262 @@
+/* Tar Heel SHell
+ *
+ * This module runs the shell as a command server, for callers that
+ * would otherwise start a shell for every short command:
+ *
+ *   thsh --serve SOCKET [--workers N]
+ *
+ * The server starts up once (cwd, PATH table, history and so on),
+ * then forks a pool of workers, which all wait in accept() on a Unix
+ * socket.  A request goes straight to a waiting worker, which serves
+ * just that one request and exits, and the server forks a fresh
+ * worker in its place.  So every request starts from a clean copy of
+ * the started-up shell (nothing, be it the cwd, variables or jobs,
+ * carries over from one request to the next), and the fork is off the
+ * request's path.
+ *
+ * A request is a struct serve_request, followed by len bytes of
+ * NUL-terminated strings: the client's cwd, its environment (one
+ * "NAME=value" each), an empty string, and then the command text,
+ * which runs as a script would.  The client's standard in, out and
+ * error come with the header, as SCM_RIGHTS, and become the worker's
+ * own, so output streams to the client with no copying through the
+ * server.  The reply is the exit status, as an int32, and then the
+ * worker closes the connection.  See thsh_client.c.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "thsh.h"
+
+// Bounds, in ms, of the wait before the server retries a failed fork()
+#define SERVE_BACKOFF_MIN 10
+#define SERVE_BACKOFF_MAX 1000
+
+// The connection a worker is serving, for send_status()
+static int conn_fd = -1;
+
+/* Send the exit status to the client as the worker exits.  This runs
+ * from on_exit(), so that it also covers the exit builtin.
+ */
+static void send_status(int status, void *arg) {
+    int32_t code = status;
+    if (conn_fd >= 0) {
+        send(conn_fd, &code, sizeof(code), MSG_NOSIGNAL);
+    }
+}
+
+/* Receive a request from conn: the header, with the client's standard
+ * in, out and error in fds, and then the rest, into *payload (which is
+ * malloc()ed, and NUL-terminated past its *len bytes).
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int recv_request(int conn, char **payload, size_t *len, int fds[3]) {
+    struct serve_request req;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    size_t done = 0;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    if (n < 0) {
+        return -errno;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(req) || req.magic != SERVE_MAGIC || req.len > SERVE_MAX_REQUEST
+            || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        return -EPROTO;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    *payload = malloc(req.len + 1);
+    if (*payload == NULL) {
+        return -ENOMEM;
+    }
+    while (done < req.len) {
+        n = recv(conn, *payload + done, req.len - done, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(*payload);
+            return n < 0 ? -errno : -EPROTO;
+        }
+        done += n;
+    }
+    (*payload)[req.len] = '\0';
+    *len = req.len;
+    return 0;
+}
+
+/* In a worker: wait for one request on the socket, tell the server
+ * (on taken_fd) that this worker is no longer idle, and serve it.
+ * Never returns.
+ */
+static void serve_one(int listen_fd, int taken_fd, bool debug, history *myhistory) {
+    char *payload, *p, *end;
+    int fds[3];
+    size_t len;
+    int status = 0;
+    int rv;
+
+    // Go away with the server
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) {
+        _exit(0);
+    }
+
+    do {
+        conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (conn_fd < 0 && errno == EINTR);
+    // Ask the server for a replacement right away, not at exit
+    write(taken_fd, "", 1);
+    close(taken_fd);
+    if (conn_fd < 0) {
+        _exit(1);
+    }
+    close(listen_fd);
+
+    rv = recv_request(conn_fd, &payload, &len, fds);
+    if (rv < 0) {
+        dprintf(2, "thsh: bad request: %s\n", strerror(-rv));
+        _exit(1);
+    }
+    on_exit(send_status, NULL);
+    for (int i = 0; i < 3; i++) {
+        close_reader(i);
+        dup2(fds[i], i);
+        if (fds[i] > 2) {
+            close(fds[i]);
+        }
+    }
+
+    // The client's cwd and environment
+    p = payload;
+    end = payload + len;
+    if (chdir(p) < 0 || init_cwd() < 0) {
+        dprintf(2, "thsh: %s: %s\n", p, strerror(errno));
+        exit(1);
+    }
+    p += strlen(p) + 1;
+    clear_vars();
+    while (p < end && *p) {
+        char *next = p + strlen(p) + 1;
+        char *eq = strchr(p, '=');
+        if (eq) {
+            *eq = '\0';
+            set_var(p, eq + 1, true);
+        }
+        p = next;
+    }
+    p += p < end;
+
+    rv = run_script_text("thsh", p, end - p, debug, myhistory, &status);
+    if (rv < 0) {
+        exit(2);
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+/* Serve requests on a Unix socket at path, created anew, with a pool
+ * of workers waiting for them (by default, two per CPU, and at least
+ * four).
+ *
+ * Returns -errno if the socket cannot be set up; otherwise it runs
+ * until it is killed.
+ */
+int serve(const char *path, int workers, bool debug, history *myhistory) {
+    struct sockaddr_un addr;
+    int listen_fd;
+    int taken[2];
+    int idle = 0;
+    int backoff = 0;    // ms to wait before forking again, after a failure
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        return -errno;
+    }
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(listen_fd, SOMAXCONN) < 0
+            || pipe2(taken, O_CLOEXEC) < 0) {
+        int err = errno;
+        close(listen_fd);
+        return -err;
+    }
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 2 ? 2 * cpus : 4;
+    }
+
+    for (;;) {
+        struct pollfd p = { taken[0], POLLIN, 0 };
+        char bytes[64];
+        ssize_t n;
+        int rv;
+
+        while (idle < workers) {
+            int pid = fork();
+            if (pid == 0) {
+                close(taken[0]);
+                serve_one(listen_fd, taken[1], debug, myhistory);
+            }
+            if (pid < 0) {
+                break;
+            }
+            idle++;
+        }
+        if (idle < workers) {
+            // fork() failed (EAGAIN, ENOMEM): try again once some
+            // worker is taken, or after a while, backing off, since
+            // with no worker idle no byte may ever come
+            backoff = backoff ? backoff * 2 : SERVE_BACKOFF_MIN;
+            if (backoff > SERVE_BACKOFF_MAX) {
+                backoff = SERVE_BACKOFF_MAX;
+            }
+        } else {
+            backoff = 0;
+        }
+
+        // A worker writes a byte as it takes a request, so that the
+        // pool is refilled while the request runs
+        rv = poll(&p, 1, backoff ? backoff : -1);
+        if (rv < 0 && errno != EINTR) {
+            return -errno;
+        }
+        if (rv > 0) {
+            n = read(taken[0], bytes, sizeof(bytes));
+            if (n > 0) {
+                idle -= n < idle ? n : idle;
+            } else if (n < 0 && errno != EINTR) {
+                return -errno;
+            }
+        }
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/* Tar Heel SHell
+ *
+ * This file is a benchmark for the launch backends in jobs.c.
+ * It grows the resident set of the process step by step and,
+ * at each size, times how long it takes to start and reap
+ * /bin/true with each backend.
+ *
+ */
+#include "thsh.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define ITERATIONS 200
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Average microseconds to run /bin/true to completion */
+static double time_backend(const char *backend, int iterations) {
+  char *args[] = { "/bin/true", NULL };
+  double start;
+
+  set_launcher(backend);
+  start = now();
+  for (int i = 0; i < iterations; i++) {
+    int status;
+    int job_id = create_job(args[0]);
+    if (run_command(args, 0, 1, job_id, NULL) || wait_on_job(job_id, &status)) {
+      printf("Failed to run %s with %s\n", args[0], backend);
+      exit(1);
+    }
+  }
+  return (now() - start) * 1e6 / iterations;
+}
+
+int main(int argc, char **argv) {
+  // Resident set sizes to measure at, in MiB
+  int sizes[] = { 0, 16, 64, 256, 512 };
+  int max_mb = argc > 1 ? atoi(argv[1]) : 512;
+  size_t grown = 0;
+  char *ballast = NULL;
+
+  if (init_path()) {
+    printf("Problem setting up the path table.\n");
+    return 1;
+  }
+
+  printf("%8s %12s %12s\n", "rss_mb", "spawn_us", "fork_us");
+  for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])) && sizes[i] <= max_mb; i++) {
+    size_t want = (size_t) sizes[i] << 20;
+
+    // Touch every page, so it is really part of the resident set
+    if (want > grown) {
+      ballast = realloc(ballast, want);
+      memset(ballast + grown, 1, want - grown);
+      grown = want;
+    }
+
+    printf("%8d %12.1f %12.1f\n", sizes[i],
+           time_backend("spawn", ITERATIONS), time_backend("fork", ITERATIONS));
+  }
+
+  free(ballast);
+  return 0;
+}
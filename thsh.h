@@ -4,6 +4,7 @@
 /* Do not change this file */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -11,46 +12,210 @@
 #include <assert.h>
 #include <dirent.h>
 
-// Assume a pipeline will never be longer than 31 stages (+NULL)
-#define MAX_PIPELINE   32
-
-// Assume any individual command will not have more than 15 arguments (+NULL)
-#define MAX_ARGS       16
-
 // Disallow exec*p* variants, lest we spoil the fun
 #pragma GCC poison execlp execvp execvpe
 
+struct rusage;
+
+// Ways of starting an external command, see set_launcher()
+enum launcher {
+    LAUNCH_SPAWN,
+    LAUNCH_FORK,
+};
+
+// Buffered standard out of a builtin, see init_output() in builtin.c
+typedef struct outbuf {
+    int fd;
+    bool capture;   // Keep all output in memory until flush_output()
+    char *data;
+    size_t len;
+    size_t cap;
+    int status;     // Exit status of the builtin, 0 unless it sets one
+} outbuf;
+
+// Bump allocator, see arena_alloc() in parse.c
+typedef struct arena {
+    struct arena_block *blocks; // Newest first
+    char *next;                 // Free space in the newest block
+    size_t left;
+} arena;
+
+// A growable list of words
+typedef struct wordlist {
+    char **words;
+    size_t count;
+    size_t cap;
+} wordlist;
+
+// A process substitution, <(command) or >(command), of a line
+typedef struct procsub {
+    const char *command;
+    bool output;            // >(command), which reads what is written
+    char *arg;              // The "/dev/fd/N" it stands for, once started
+    int fd;                 // The shell's end of its pipe, or -1
+    struct procsub *next;
+} procsub;
+
+// Room for the "/dev/fd/N" of a procsub
+#define PROCSUB_ARG 24
+
+// Header of a request to the command server, see serve.c
+#define SERVE_MAGIC 0x68736874   // "thsh"
+#define SERVE_MAX_REQUEST (16 * 1024 * 1024)
+struct serve_request {
+    uint32_t magic;
+    uint32_t len;   // Bytes of request that follow
+};
+
+// One parsed command line, see parse_line()
+typedef struct command_line {
+    char ***commands;   // Each stage's NULL-terminated arguments, then NULL
+    int stages;
+    size_t stages_cap;
+    char *infile;
+    const char *input;  // Text for the first stage, from '<<' or '<<<'
+    size_t input_len;
+    char *outfile;
+    bool background;
+    procsub *procsubs;  // Started with the line, see run_pipeline()
+    wordlist words;     // Arguments of the stage being parsed
+    arena arena;        // Holds the words until the next line is parsed
+} command_line;
+
 // Data Structure to keep track of history.
+// Entries are stored back to back in text, one per line.
 typedef struct history {
-    int idx;
-    int valid_entries;
-    char arr[50][MAX_ARGS];
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+    size_t *offsets;     // Start of each entry in text, oldest first
+    size_t count;        // Number of entries
+    size_t offsets_cap;
+    size_t saved;        // Entries already written to the history file
+    int fd;              // History file, open for appending, or -1
+    struct history_index *index; // Search index, see index_history()
 } history;
 
 // Helper functions
 
 // In parse.c:
 int read_one_line(int input_fd, char * buf, size_t size);
-int parse_line (char *inbuf, size_t length, char *commands [MAX_PIPELINE][MAX_ARGS],
-		char **infile, char **outfile,
-		char *scratch, size_t scratch_len);
+int read_whole_line(int input_fd, char **buf, size_t *size);
+void close_reader(int input_fd);
+int parse_line(const char *inbuf, size_t length, command_line *line);
+int compile_line(const char *inbuf, size_t length, arena *a, char **tokens);
+int compile_command(const char *inbuf, size_t length, arena *a, char **tokens, size_t *used);
+int bind_line(const char *tokens, command_line *line);
+size_t tokens_length(const char *tokens);
+const char *first_word(const char *tokens, const char **rest);
+void *arena_alloc(arena *a, size_t size);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+int wordlist_add(wordlist *list, char *word);
+
+// In glob.c:
+void glob_new_line(void);
+void glob_set_threads(int threads);
+bool has_glob(const char *word);
+int expand_glob(const char *glob, arena *a, wordlist *matches);
+
+// In lineedit.c:
+int read_interactive_line(int input_fd, char *buf, size_t size, history *myhistory);
 
 // In builtin.c:
 int init_cwd(void);
-int handle_builtin(char *args[MAX_ARGS], int stdin, int stdout, int *retval, history *myhistory);
+int handle_builtin(char **args, int stdin, outbuf *out, int *retval, history *myhistory);
+bool is_builtin(const char *name, bool *pure);
+bool builtin_streams(const char *name);
+void init_output(outbuf *out, int fd);
+int out_write(outbuf *out, const void *data, size_t len);
+int out_printf(outbuf *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void drain_output(outbuf *out);
+int flush_output(outbuf *out);
+const char *current_dir(void);
+
+// In prompt.c:
 int print_prompt(void);
+void prompt_job_done(int status);
+int prompt_wakeup_fd(void);
 
 // In jobs.c:
 int init_path(void);
 void print_path_table(void);
-int create_job(void);
-int run_command(char *args[MAX_ARGS], int stdin, int stdout, int job_id, history *myhistory);
+void print_hash_table(outbuf *out);
+void reset_hash_table(void);
+int set_launcher(const char *name);
+const char *get_launcher(void);
+int init_jobs(bool interactive);
+int create_job(const char *cmdline);
+int run_command(char **args, int stdin, int stdout, int job_id, history *myhistory);
+int run_pipeline(command_line *line, const char *cmdline, bool debug, int *exit_code, history *myhistory);
+int capture_output(const char *cmd, size_t len, arena *a, char **output);
 int wait_on_job(int job_id, int *exit_code);
+int background_job(int job_id);
+void notify_jobs(void);
+int handle_jobs(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_fg(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_bg(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_wait(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_parallel(char **args, int stdin, outbuf *out, history *myhistory);
+
+// In env.c:
+bool is_var_name(const char *name, size_t len);
+const char *get_var(const char *name, size_t len);
+int set_var(const char *name, const char *value, bool export);
+void unset_var(const char *name);
+void clear_vars(void);
+char **get_envp(void);
+size_t assignment_name(const char *word);
+char **envp_with(char **words, int count);
+int handle_export(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_unset(char **args, int stdin, outbuf *out, history *myhistory);
+
+// In limits.c:
+typedef struct stage_limits stage_limits;
+int parse_limits(char **args, int cpu, stage_limits **limits);
+int apply_limits(const stage_limits *l);
+int spread_cpu(int stage);
+int handle_nice(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_taskset(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_ulimit(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_spread(char **args, int stdin, outbuf *out, history *myhistory);
+
+// In pipes.c:
+typedef struct pipe_relay pipe_relay;
+int open_pipe(int pipefd[2]);
+bool pipe_stats_on(void);
+int start_relay(const char *writer, const char *reader, int *out_fd, int *in_fd,
+        pipe_relay **relays);
+void finish_relays(pipe_relay *relays, bool wait);
+int handle_pipesize(char **args, int stdin, outbuf *out, history *myhistory);
+int handle_pipestats(char **args, int stdin, outbuf *out, history *myhistory);
+
+// In script.c:
+int run_script(const char *path, bool debug, history *myhistory);
+int run_script_text(const char *name, const char *text, size_t len, bool debug,
+        history *myhistory, int *status);
+
+// In serve.c:
+int serve(const char *path, int workers, bool debug, history *myhistory);
+
+// In trace.c:
+int trace_open(const char *path);
+uint64_t trace_now(void);
+void trace_phase(const char *name, uint64_t start, const char *detail);
+void trace_stage(int pid, const char *name, uint64_t start, int status, struct rusage *ru);
+void trace_exec(const char *path);
+void trace_flush(void);
 
 // In history.c (optional - challenge only)
 void add_history_line(char *line, history *myhistory);
-int clear_history(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory);
-int print_history(char *args[MAX_ARGS], int stdin, int stdout, history *myhistory);
+const char *history_entry(history *myhistory, size_t i, size_t *len);
+long search_history(history *myhistory, const char *query, size_t qlen, long before);
+int index_history(history *myhistory);
+void free_history_index(history *myhistory);
+int clear_history(char **args, int stdin, outbuf *out, history *myhistory);
+int print_history(char **args, int stdin, outbuf *out, history *myhistory);
 int save_history(history *myhistory);
 int load_history(history *myhistory);
 
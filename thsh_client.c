@@ -0,0 +1,138 @@
+/* Tar Heel SHell
+ *
+ * A client for the command server (thsh --serve, see serve.c):
+ *
+ *   thsh_client SOCKET command [args...]
+ *
+ * runs the command (its words joined by spaces, as a line of script)
+ * in a server worker, in this process's cwd and environment, and with
+ * its standard in, out and error, and exits with the command's status.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "thsh.h"
+
+extern char **environ;
+
+// Append the string s, and its NUL, to buf at *len
+static int put_string(char **buf, size_t *len, size_t *size, const char *s, size_t n) {
+    while (*len + n + 1 > *size) {
+        char *tmp = realloc(*buf, *size * 2);
+        if (tmp == NULL) {
+            return -ENOMEM;
+        }
+        *buf = tmp;
+        *size *= 2;
+    }
+    memcpy(*buf + *len, s, n);
+    (*buf)[*len + n] = '\0';
+    *len += n + 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un addr;
+    struct serve_request req;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    int fds[3] = { 0, 1, 2 };
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    size_t size = 4096, len = 0, sent = 0;
+    char *payload = malloc(size);
+    char cwd[MAX_INPUT];
+    int32_t status;
+    size_t got = 0;
+    int sock, rv = 0;
+
+    if (argc < 3) {
+        dprintf(2, "usage: thsh_client socket command [args...]\n");
+        return 2;
+    }
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        dprintf(2, "thsh_client: %s: %s\n", argv[1], strerror(ENAMETOOLONG));
+        return 2;
+    }
+
+    // cwd, environment, "", and then the command
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+    rv = put_string(&payload, &len, &size, cwd, strlen(cwd));
+    for (char **e = environ; rv == 0 && *e; e++) {
+        rv = put_string(&payload, &len, &size, *e, strlen(*e));
+    }
+    if (rv == 0) {
+        rv = put_string(&payload, &len, &size, "", 0);
+    }
+    for (int i = 2; rv == 0 && i < argc; i++) {
+        rv = put_string(&payload, &len, &size, argv[i], strlen(argv[i]));
+        // Join the words with spaces, not NULs
+        payload[len - 1] = i + 1 < argc ? ' ' : '\n';
+    }
+    if (rv < 0 || len > SERVE_MAX_REQUEST) {
+        dprintf(2, "thsh_client: request too large\n");
+        return 2;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        dprintf(2, "thsh_client: %s: %s\n", argv[1], strerror(errno));
+        return 2;
+    }
+
+    // The header, our standard fds, and as much of the rest as fits
+    req.magic = SERVE_MAGIC;
+    req.len = len;
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    rv = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (rv >= 0) {
+        sent = rv > sizeof(req) ? rv - sizeof(req) : 0;
+    }
+    while (rv >= 0 && sent < len) {
+        rv = send(sock, payload + sent, len - sent, MSG_NOSIGNAL);
+        if (rv > 0) {
+            sent += rv;
+        }
+    }
+    if (rv < 0) {
+        dprintf(2, "thsh_client: %s: %s\n", argv[1], strerror(errno));
+        return 2;
+    }
+
+    // The command's output goes straight to our fds; wait for its status
+    while (got < sizeof(status)) {
+        rv = read(sock, (char *) &status + got, sizeof(status) - got);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            dprintf(2, "thsh_client: the server closed the connection\n");
+            return 255;
+        }
+        got += rv;
+    }
+    return status;
+}
@@ -0,0 +1,210 @@
+/* Tar Heel SHell
+ *
+ * This module records where the shell spends its time, as Chrome
+ * trace events (JSON), which chrome://tracing and Perfetto can open.
+ *
+ * Every phase of a line (read, parse, glob, PATH lookup, spawn or
+ * fork, wait) becomes a complete ("X") event on the shell's row, and
+ * every stage of a job gets an event on a row of its own, from when
+ * it was started to when it was reaped, with the CPU time and peak
+ * RSS that wait4() reported for it.
+ *
+ * Events are formatted into a buffer and written out in large blocks,
+ * so tracing costs a clock_gettime() and a snprintf() per event, and
+ * nothing at all when it is off.  The file is a JSON array that is
+ * never closed, which trace viewers accept, so a shell that is killed
+ * leaves a usable trace behind (up to its last flush).
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "thsh.h"
+
+// Events are written out once this much is buffered
+#define TRACE_BUFFER 65536
+// Longest string argument kept in an event
+#define TRACE_DETAIL_MAX 200
+
+// Nanoseconds as the two printf arguments of microseconds with
+// three decimals, which is cheaper to format than a double
+#define US(ns) (ns) / 1000, (unsigned) ((ns) % 1000)
+
+static int trace_fd = -1;
+static int trace_pid;
+static char trace_buf[TRACE_BUFFER];
+static size_t trace_len = 0;
+
+/* Write out the buffered events. */
+void trace_flush(void) {
+    size_t done = 0;
+
+    while (done < trace_len) {
+        ssize_t rv = write(trace_fd, trace_buf + done, trace_len - done);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        done += rv;
+    }
+    trace_len = 0;
+}
+
+/* In a forked child: drop the parent's buffered events, which the
+ * parent writes out itself, so that the child's flush at exit() adds
+ * only its own, and record them under the child's pid.
+ */
+static void trace_child(void) {
+    trace_len = 0;
+    trace_pid = getpid();
+}
+
+/* Start tracing into the file at path.  The file is created, or
+ * appended to, so that the runs of a script share one trace.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int trace_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (trace_fd >= 0) {
+        trace_flush();
+        close(trace_fd);
+    } else {
+        atexit(trace_flush);
+        pthread_atfork(NULL, NULL, trace_child);
+    }
+    trace_fd = fd;
+    trace_pid = getpid();
+    trace_len = 0;
+    if (lseek(fd, 0, SEEK_END) == 0) {
+        // Right away, since forked children write to the file too
+        write(fd, "[\n", 2);
+    }
+    return 0;
+}
+
+/* Returns the current time in nanoseconds, or 0 if tracing is off.
+ * The result is the start argument of the functions below.
+ */
+uint64_t trace_now(void) {
+    struct timespec ts;
+
+    if (trace_fd < 0) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Append one event, flushing first if it does not fit. */
+static void __attribute__((format(printf, 1, 2))) trace_printf(const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    for (int tries = 0; tries < 2; tries++) {
+        va_start(ap, fmt);
+        len = vsnprintf(trace_buf + trace_len, sizeof(trace_buf) - trace_len, fmt, ap);
+        va_end(ap);
+        if (len >= 0 && (size_t) len < sizeof(trace_buf) - trace_len) {
+            trace_len += len;
+            return;
+        }
+        trace_flush();
+    }
+}
+
+/* Copy s into out (of TRACE_DETAIL_MAX + 8 bytes) as the inside of a
+ * JSON string, without a trailing newline, and cut short if it is long.
+ */
+static const char *json_string(char *out, const char *s) {
+    size_t n = 0;
+
+    for (; s && *s && !(s[0] == '\n' && s[1] == '\0') && n < TRACE_DETAIL_MAX; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c < 0x20) {
+            n += sprintf(out + n, "\\u%04x", c);
+        } else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+/* Record a phase of the shell's own work that began at start (from
+ * trace_now()) and ends now.  detail (which may be NULL) is shown
+ * with it, e.g. the command line or the glob pattern.
+ */
+void trace_phase(const char *name, uint64_t start, const char *detail) {
+    char escaped[TRACE_DETAIL_MAX + 8];
+    uint64_t end;
+
+    if (start == 0 || trace_fd < 0) {
+        return;
+    }
+    end = trace_now();
+    trace_printf("{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"%s\"}},\n",
+            name, US(start), US(end - start), trace_pid, trace_pid,
+            json_string(escaped, detail));
+}
+
+/* Record a stage of a job, the process pid running name, from start
+ * until it was reaped just now with the given wstatus and resource
+ * usage (which may be NULL, for builtins).
+ */
+void trace_stage(int pid, const char *name, uint64_t start, int status, struct rusage *ru) {
+    char escaped[TRACE_DETAIL_MAX + 8];
+    uint64_t end;
+
+    if (start == 0 || trace_fd < 0) {
+        return;
+    }
+    end = trace_now();
+    trace_printf("{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"status\":%d,\"signal\":%d,"
+            "\"user_us\":%ld,\"sys_us\":%ld,\"maxrss_kb\":%ld}},\n",
+            json_string(escaped, name), US(start), US(end - start),
+            trace_pid, pid > 0 ? pid : trace_pid,
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+            WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+            ru ? ru->ru_utime.tv_sec * 1000000L + ru->ru_utime.tv_usec : 0,
+            ru ? ru->ru_stime.tv_sec * 1000000L + ru->ru_stime.tv_usec : 0,
+            ru ? ru->ru_maxrss : 0);
+}
+
+/* In a forked child, mark the moment it calls execve() on path.
+ * The event is written straight to the file, since the child's copy
+ * of the buffer is never flushed.
+ */
+void trace_exec(const char *path) {
+    char escaped[TRACE_DETAIL_MAX + 8];
+    char event[TRACE_DETAIL_MAX + 200];
+    int len;
+
+    if (trace_fd < 0) {
+        return;
+    }
+    len = snprintf(event, sizeof(event),
+            "{\"name\":\"exec\",\"cat\":\"shell\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ".%03u,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"%s\"}},\n",
+            US(trace_now()), trace_pid, getpid(), json_string(escaped, path));
+    if (len > 0 && (size_t) len < sizeof(event)) {
+        write(trace_fd, event, len);
+    }
+}